@@ -0,0 +1,397 @@
+/*-------------------------------------------------------------------------
+ *
+ * append.c
+ *      contention of many processes appending audit records to files
+ *
+ * Forks -c writers that append fixed size records for -T seconds with one
+ * of the strategies:
+ *
+ *   fwrite   fopen("a") + fwrite + fflush per record, as the extension does
+ *   append   open(O_APPEND) + one write(2) per record
+ *   queue    records copied to a shared memory ring protected by a process
+ *            shared mutex, drained by a single writer process in large
+ *            writes
+ *   shard    fwrite + fflush to one of -s files chosen by the writer
+ *
+ * and prints one tab separated line with the throughput and the latency of
+ * the append as seen by the writers.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defines */
+#define APPEND_FILE_BUFFER_SIZE 131072
+/* Latency histogram with 4 buckets per power of two nanoseconds */
+#define APPEND_LATENCY_BUCKETS (64 * 4)
+#define APPEND_QUEUE_SIZE (8 * 1024 * 1024)
+#define APPEND_WRITER_CHUNK (1024 * 1024)
+
+typedef enum append_strategy {
+  APPEND_FWRITE,
+  APPEND_APPEND,
+  APPEND_QUEUE,
+  APPEND_SHARD
+} append_strategy;
+
+/* Results of a writer, in shared memory */
+typedef struct append_result {
+  uint64_t records;
+  uint64_t latency[APPEND_LATENCY_BUCKETS];
+  uint64_t max_ns;
+  int failed;
+} append_result;
+
+/* Ring of bytes shared by the writers and the queue writer */
+typedef struct append_queue {
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  uint64_t head;  /* bytes inserted */
+  uint64_t tail;  /* bytes written */
+  bool done;
+  char data[APPEND_QUEUE_SIZE];
+} append_queue;
+
+/* Options */
+static const char *strategy_names[] = {"fwrite", "append", "queue", "shard"};
+static append_strategy strategy = APPEND_FWRITE;
+static const char *directory = ".";
+static int num_writers = 1;
+static int num_shards = 8;
+static int record_size = 300;
+static int duration = 10;
+
+static append_queue *queue = NULL;
+
+/* Internal functions */
+static uint64_t append_now_ns(void);
+static int append_bucket(uint64_t ns);
+static double append_bucket_upper_us(int bucket);
+static double append_percentile(const uint64_t *latency, double pct);
+static void append_writer(int writer, append_result *result);
+static void append_queue_writer(void);
+static void append_queue_put(const char *record, int len);
+
+
+static uint64_t append_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int append_bucket(uint64_t ns) {
+  int b;
+
+  if (ns < 4)
+    return ns;
+  b = 63 - __builtin_clzll(ns);
+  return b * 4 + ((ns >> (b - 2)) & 3);
+}
+
+static double append_bucket_upper_us(int bucket) {
+  int b = bucket / 4;
+  int sub = bucket % 4;
+
+  if (bucket < 4)
+    return (bucket + 1) / 1000.0;
+  return (double) ((uint64_t) (4 + sub + 1) << (b - 2)) / 1000.0;
+}
+
+static double append_percentile(const uint64_t *latency, double pct) {
+  uint64_t total = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < APPEND_LATENCY_BUCKETS; i++)
+    total += latency[i];
+  for (i = 0; i < APPEND_LATENCY_BUCKETS; i++) {
+    seen += latency[i];
+    if (total > 0 && seen >= total * pct / 100)
+      return append_bucket_upper_us(i);
+  }
+  return 0;
+}
+
+/*
+ * Copies a record to the ring, waiting while it is full
+ */
+static void append_queue_put(const char *record, int len) {
+  uint64_t pos;
+  int first;
+
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->head - queue->tail + len > APPEND_QUEUE_SIZE)
+    pthread_cond_wait(&queue->not_full, &queue->mutex);
+
+  pos = queue->head % APPEND_QUEUE_SIZE;
+  first = len < (int) (APPEND_QUEUE_SIZE - pos) ? len : (int) (APPEND_QUEUE_SIZE - pos);
+  memcpy(queue->data + pos, record, first);
+  memcpy(queue->data, record + first, len - first);
+  queue->head += len;
+
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Drains the ring to the file until the writers are done
+ */
+static void append_queue_writer(void) {
+  char path[4096];
+  char *chunk = malloc(APPEND_WRITER_CHUNK);
+  uint64_t pos, len;
+  int fd, first;
+
+  snprintf(path, sizeof(path), "%s/append-bench.log", directory);
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->head == queue->tail && !queue->done)
+      pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    if (queue->head == queue->tail && queue->done) {
+      pthread_mutex_unlock(&queue->mutex);
+      break;
+    }
+
+    len = queue->head - queue->tail;
+    if (len > APPEND_WRITER_CHUNK)
+      len = APPEND_WRITER_CHUNK;
+    pos = queue->tail % APPEND_QUEUE_SIZE;
+    first = len < APPEND_QUEUE_SIZE - pos ? len : APPEND_QUEUE_SIZE - pos;
+    memcpy(chunk, queue->data + pos, first);
+    memcpy(chunk + first, queue->data, len - first);
+    queue->tail += len;
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (write(fd, chunk, len) != (ssize_t) len) {
+      fprintf(stderr, "could not write \"%s\": %s\n", path, strerror(errno));
+      exit(1);
+    }
+  }
+
+  close(fd);
+  free(chunk);
+}
+
+/*
+ * Appends records until the end of the run
+ */
+static void append_writer(int writer, append_result *result) {
+  char path[4096];
+  char *record;
+  FILE *fp = NULL;
+  int fd = -1;
+  uint64_t deadline, start, elapsed;
+  int i;
+
+  record = malloc(record_size);
+  for (i = 0; i < record_size - 1; i++)
+    record[i] = 'a' + (writer + i) % 26;
+  record[record_size - 1] = '\n';
+
+  switch (strategy) {
+  case APPEND_FWRITE:
+  case APPEND_SHARD:
+    if (strategy == APPEND_SHARD)
+      snprintf(path, sizeof(path), "%s/append-bench.%d.log", directory, writer % num_shards);
+    else
+      snprintf(path, sizeof(path), "%s/append-bench.log", directory);
+    fp = fopen(path, "a");
+    if (fp != NULL)
+      setvbuf(fp, malloc(APPEND_FILE_BUFFER_SIZE), _IOFBF, APPEND_FILE_BUFFER_SIZE);
+    break;
+  case APPEND_APPEND:
+    snprintf(path, sizeof(path), "%s/append-bench.log", directory);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    break;
+  case APPEND_QUEUE:
+    break;
+  }
+  if (strategy != APPEND_QUEUE && fp == NULL && fd < 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    result->failed = 1;
+    return;
+  }
+
+  deadline = append_now_ns() + (uint64_t) duration * 1000000000;
+  while ((start = append_now_ns()) < deadline) {
+    switch (strategy) {
+    case APPEND_FWRITE:
+    case APPEND_SHARD:
+      if (fwrite(record, 1, record_size, fp) != (size_t) record_size || fflush(fp) != 0)
+        result->failed = 1;
+      break;
+    case APPEND_APPEND:
+      if (write(fd, record, record_size) != record_size)
+        result->failed = 1;
+      break;
+    case APPEND_QUEUE:
+      append_queue_put(record, record_size);
+      break;
+    }
+    if (result->failed) {
+      fprintf(stderr, "could not write: %s\n", strerror(errno));
+      break;
+    }
+
+    elapsed = append_now_ns() - start;
+    result->records++;
+    result->latency[append_bucket(elapsed)]++;
+    if (elapsed > result->max_ns)
+      result->max_ns = elapsed;
+  }
+
+  if (fp != NULL)
+    fclose(fp);
+  if (fd >= 0)
+    close(fd);
+  free(record);
+}
+
+int main(int argc, char **argv) {
+  append_result *results;
+  uint64_t latency[APPEND_LATENCY_BUCKETS];
+  uint64_t records = 0, max_ns = 0, start, elapsed;
+  pid_t queue_writer = 0;
+  int failed = 0;
+  int c, i, j, status;
+
+  while ((c = getopt(argc, argv, "c:d:m:r:s:T:")) != -1) {
+    switch (c) {
+    case 'c':
+      num_writers = atoi(optarg);
+      break;
+    case 'd':
+      directory = optarg;
+      break;
+    case 'm':
+      for (i = 0; i < 4 && strcmp(optarg, strategy_names[i]) != 0; i++)
+        ;
+      if (i == 4) {
+        fprintf(stderr, "unknown strategy \"%s\"\n", optarg);
+        exit(1);
+      }
+      strategy = i;
+      break;
+    case 'r':
+      record_size = atoi(optarg);
+      break;
+    case 's':
+      num_shards = atoi(optarg);
+      break;
+    case 'T':
+      duration = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c writers] [-d directory] [-m fwrite|append|queue|shard] [-r record size] [-s shards] [-T seconds]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (num_writers <= 0 || num_shards <= 0 || record_size <= 1 || duration <= 0) {
+    fprintf(stderr, "writers, shards, record size and seconds must be positive\n");
+    exit(1);
+  }
+
+  results = mmap(NULL, num_writers * sizeof(append_result), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    fprintf(stderr, "could not map results: %s\n", strerror(errno));
+    exit(1);
+  }
+  memset(results, 0, num_writers * sizeof(append_result));
+
+  if (strategy == APPEND_QUEUE) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    queue = mmap(NULL, sizeof(append_queue), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (queue == MAP_FAILED) {
+      fprintf(stderr, "could not map queue: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&queue->mutex, &mattr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&queue->not_empty, &cattr);
+    pthread_cond_init(&queue->not_full, &cattr);
+    queue->head = queue->tail = 0;
+    queue->done = false;
+
+    queue_writer = fork();
+    if (queue_writer == 0) {
+      append_queue_writer();
+      exit(0);
+    }
+  }
+
+  start = append_now_ns();
+  for (i = 0; i < num_writers; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      fprintf(stderr, "could not fork: %s\n", strerror(errno));
+      exit(1);
+    } else if (pid == 0) {
+      append_writer(i, &results[i]);
+      exit(results[i].failed);
+    }
+  }
+  for (i = 0; i < num_writers; i++)
+    wait(&status);
+
+  if (queue_writer > 0) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->done = true;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    waitpid(queue_writer, &status, 0);
+  }
+  elapsed = append_now_ns() - start;
+
+  memset(latency, 0, sizeof(latency));
+  for (i = 0; i < num_writers; i++) {
+    records += results[i].records;
+    failed |= results[i].failed;
+    if (results[i].max_ns > max_ns)
+      max_ns = results[i].max_ns;
+    for (j = 0; j < APPEND_LATENCY_BUCKETS; j++)
+      latency[j] += results[i].latency[j];
+  }
+
+  printf("%s\t%s\t%d\t%d\t%llu\t%.1f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
+         strategy_names[strategy], directory, num_writers, record_size,
+         (unsigned long long) records,
+         records / (elapsed / 1e9),
+         records * (double) record_size / (elapsed / 1e9) / (1024 * 1024),
+         append_percentile(latency, 50),
+         append_percentile(latency, 99),
+         append_percentile(latency, 99.9),
+         max_ns / 1000.0);
+
+  return failed;
+}
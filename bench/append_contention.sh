@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+#
+# append_contention.sh
+#      throughput and tail latency of many writers appending audit records,
+#      per write strategy and filesystem
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -c WRITERS     writer processes (default "1 2 4 8 16 32 64 128 256")
+  -d DIRECTORIES directories to write to (default "/dev/shm \$TMPDIR")
+  -m STRATEGIES  strategies (default "fwrite append queue shard")
+  -o FILE        results table (default stdout)
+  -r BYTES       record size (default 300)
+  -s SHARDS      files of the shard strategy (default 8)
+  -T SECONDS     duration of every run (default 10)
+EOF
+  exit 1
+}
+
+WRITERS="1 2 4 8 16 32 64 128 256"
+DIRECTORIES="/dev/shm ${TMPDIR:-/var/tmp}"
+STRATEGIES="fwrite append queue shard"
+OUTPUT=
+RECORD_SIZE=300
+SHARDS=8
+DURATION=10
+
+while getopts "c:d:m:o:r:s:T:" opt; do
+  case "$opt" in
+    c) WRITERS=$OPTARG ;;
+    d) DIRECTORIES=$OPTARG ;;
+    m) STRATEGIES=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    r) RECORD_SIZE=$OPTARG ;;
+    s) SHARDS=$OPTARG ;;
+    T) DURATION=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+APPEND="$BENCH_DIR/append"
+if [ ! -x "$APPEND" ]; then
+  make -s -C "$BENCH_DIR/.." bench/append > /dev/null
+fi
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+printf 'strategy\tdirectory\twriters\trecord_bytes\trecords\trecords_per_s\tMB_per_s\tlatency_p50_us\tlatency_p99_us\tlatency_p999_us\tlatency_max_us\n'
+
+for directory in $DIRECTORIES; do
+  workdir=$(mktemp -d "$directory/pgauditlogtofile-append.XXXXXX")
+  for strategy in $STRATEGIES; do
+    for writers in $WRITERS; do
+      echo "$(date '+%H:%M:%S') $strategy $directory writers=$writers" >&2
+      "$APPEND" -m "$strategy" -d "$workdir" -c "$writers" -r "$RECORD_SIZE" -s "$SHARDS" -T "$DURATION" |
+        awk -v dir="$directory" 'BEGIN { FS = OFS = "\t" } { $2 = dir; print }'
+      rm -f "$workdir"/append-bench.*
+    done
+  done
+  rmdir "$workdir"
+done
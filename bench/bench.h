@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ *
+ * bench.h
+ *      standalone microbenchmarks of the pgauditlogtofile hot path
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_BENCH_H
+#define PGAUDITLOGTOFILE_BENCH_H
+
+/* Allocations done through malloc, calloc and realloc since the start */
+extern uint64 bench_allocs;
+extern uint64 bench_alloc_bytes;
+
+/* Fills the backend globals used by the formatter with a client session */
+void bench_stubs_init(void);
+void bench_stubs_set_session(char *user_name, char *database_name, char *remote_host, char *remote_port, char *app_name);
+
+#endif
@@ -0,0 +1,263 @@
+/*-------------------------------------------------------------------------
+ *
+ * bench_format.c
+ *      microbenchmarks of the audit line formatter and the classifier
+ *
+ * Drives the code of logtofile_format.c with a corpus of messages, the
+ * built-in one or one message per line read from a file, and reports the
+ * time, allocations and bytes per record of:
+ *
+ *   classify         prefix checks done by emit_log for every message
+ *   format_log_time  timestamp of every audit line
+ *   create_line      audit line of every pgaudit message, including the
+ *                    StringInfo handling done by write_audit
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "logtofile_format.h"
+#include "bench.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/* Defines */
+#define BENCH_DEFAULT_RECORDS 1000000
+#define BENCH_MAX_LINE 65536
+
+/* Built-in corpus: pgaudit records of an OLTP load plus the server noise */
+static const char *bench_corpus[] = {
+  "AUDIT: SESSION,1,1,READ,SELECT,,,SELECT abalance FROM pgbench_accounts WHERE aid = $1;,<not logged>",
+  "AUDIT: SESSION,2,1,WRITE,UPDATE,,,UPDATE pgbench_accounts SET abalance = abalance + $1 WHERE aid = $2;,<not logged>",
+  "AUDIT: SESSION,3,1,WRITE,INSERT,,,\"INSERT INTO pgbench_history (tid, bid, aid, delta, mtime) VALUES ($1, $2, $3, $4, CURRENT_TIMESTAMP);\",<not logged>",
+  "AUDIT: OBJECT,4,1,READ,SELECT,TABLE,public.pgbench_branches,\"SELECT b.bbalance, t.tbalance FROM pgbench_branches b JOIN pgbench_tellers t ON t.bid = b.bid WHERE b.bid = 1, t.tid = 7\",<not logged>",
+  "AUDIT: SESSION,5,1,DDL,CREATE TABLE,TABLE,public.orders,\"CREATE TABLE public.orders (id bigserial PRIMARY KEY, customer_id bigint NOT NULL REFERENCES public.customers (id), created_at timestamptz NOT NULL DEFAULT now(), status text NOT NULL CHECK (status IN ('new', 'paid', 'shipped')), total numeric(12,2))\",<not logged>",
+  "AUDIT: SESSION,6,1,ROLE,GRANT,,,\"GRANT SELECT, INSERT, UPDATE ON public.orders TO app_rw\",<not logged>",
+  "AUDIT: SESSION,7,1,MISC,SET,,,SET search_path = app;,<not logged>",
+  "AUDIT: SESSION,8,2,FUNCTION,EXECUTE,FUNCTION,public.place_order,SELECT public.place_order(42, '{\"\"sku\"\": \"\"A-1\"\", \"\"qty\"\": 3}');,\"42,{\"\"sku\"\": \"\"A-1\"\", \"\"qty\"\": 3}\"",
+  "connection received: host=192.168.10.25 port=51234",
+  "connection authorized: user=bench_user database=bench_db application_name=pgbench",
+  "disconnection: session time: 0:00:12.345 user=bench_user database=bench_db host=192.168.10.25 port=51234",
+  "duration: 0.412 ms",
+  "checkpoint starting: time",
+  "automatic vacuum of table \"bench_db.public.pgbench_accounts\": index scans: 1",
+};
+
+/* Corpus in use */
+static char **messages = NULL;
+static int num_messages = 0;
+
+/* Internal functions */
+static void bench_load_builtin(void);
+static void bench_load_file(const char *path);
+static uint64 bench_now_ns(void);
+static void bench_report(const char *name, uint64 records, uint64 elapsed_ns, uint64 allocs, uint64 alloc_bytes, uint64 out_bytes);
+static void bench_classify(uint64 records, pgAuditLogToFilePrefix **conn, size_t num_conn, pgAuditLogToFilePrefix **disconn, size_t num_disconn);
+static void bench_create_line(uint64 records);
+static void bench_format_log_time(uint64 records);
+
+
+/*
+ * Monotonic clock in nanoseconds
+ */
+static inline uint64 bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Uses the built-in corpus
+ */
+static void bench_load_builtin(void) {
+  int i;
+
+  num_messages = lengthof(bench_corpus);
+  messages = palloc(num_messages * sizeof(char *));
+  for (i = 0; i < num_messages; i++)
+    messages[i] = pstrdup(bench_corpus[i]);
+}
+
+/*
+ * Reads a corpus with one message per line
+ */
+static void bench_load_file(const char *path) {
+  FILE *fp;
+  char *line;
+  int max_messages = 1024;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open corpus \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  line = palloc(BENCH_MAX_LINE);
+  messages = palloc(max_messages * sizeof(char *));
+  while (fgets(line, BENCH_MAX_LINE, fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+
+    if (num_messages == max_messages) {
+      max_messages *= 2;
+      messages = repalloc(messages, max_messages * sizeof(char *));
+    }
+    messages[num_messages++] = pstrdup(line);
+  }
+  fclose(fp);
+  pfree(line);
+
+  if (num_messages == 0) {
+    fprintf(stderr, "corpus \"%s\" is empty\n", path);
+    exit(1);
+  }
+}
+
+/*
+ * Prints one row of results
+ */
+static void bench_report(const char *name, uint64 records, uint64 elapsed_ns, uint64 allocs, uint64 alloc_bytes, uint64 out_bytes) {
+  printf("%-16s %12llu %12.1f %14.2f %16.1f %14.1f\n",
+         name,
+         (unsigned long long) records,
+         (double) elapsed_ns / records,
+         (double) allocs / records,
+         (double) alloc_bytes / records,
+         (double) out_bytes / records);
+}
+
+/*
+ * Prefix checks of emit_log, with connections and disconnections enabled
+ */
+static void bench_classify(uint64 records, pgAuditLogToFilePrefix **conn, size_t num_conn, pgAuditLogToFilePrefix **disconn, size_t num_disconn) {
+  uint64 i, start, allocs, alloc_bytes, matched = 0;
+
+  allocs = bench_allocs;
+  alloc_bytes = bench_alloc_bytes;
+  start = bench_now_ns();
+  for (i = 0; i < records; i++) {
+    const char *msg = messages[i % num_messages];
+
+    if (pg_strncasecmp(msg, PGAUDIT_PREFIX_LINE, PGAUDIT_PREFIX_LINE_LENGTH) == 0 ||
+        pgauditlogtofile_match_prefix(msg, conn, num_conn) ||
+        pgauditlogtofile_match_prefix(msg, disconn, num_disconn))
+      matched++;
+  }
+  bench_report("classify", records, bench_now_ns() - start,
+               bench_allocs - allocs, bench_alloc_bytes - alloc_bytes, 0);
+  fprintf(stderr, "classify: %llu of %llu messages intercepted\n",
+          (unsigned long long) matched, (unsigned long long) records);
+}
+
+/*
+ * Timestamp of the audit lines
+ */
+static void bench_format_log_time(uint64 records) {
+  uint64 i, start, allocs, alloc_bytes;
+
+  allocs = bench_allocs;
+  alloc_bytes = bench_alloc_bytes;
+  start = bench_now_ns();
+  for (i = 0; i < records; i++)
+    pgauditlogtofile_format_log_time();
+  bench_report("format_log_time", records, bench_now_ns() - start,
+               bench_allocs - allocs, bench_alloc_bytes - alloc_bytes, 0);
+}
+
+/*
+ * Audit lines of the pgaudit messages of the corpus, as done by write_audit
+ */
+static void bench_create_line(uint64 records) {
+  ErrorData *edata;
+  int *exclude_nchars;
+  int num_audit = 0;
+  uint64 i, start, allocs, alloc_bytes, out_bytes = 0;
+  int j;
+
+  edata = palloc0(num_messages * sizeof(ErrorData));
+  exclude_nchars = palloc(num_messages * sizeof(int));
+  for (j = 0; j < num_messages; j++) {
+    if (pg_strncasecmp(messages[j], PGAUDIT_PREFIX_LINE, PGAUDIT_PREFIX_LINE_LENGTH) != 0)
+      continue;
+
+    /* pgaudit reports LOG messages with errhidestmt */
+    edata[num_audit].elevel = LOG;
+    edata[num_audit].message = messages[j];
+    edata[num_audit].hide_stmt = true;
+    exclude_nchars[num_audit] = PGAUDIT_PREFIX_LINE_LENGTH;
+    num_audit++;
+  }
+
+  if (num_audit == 0) {
+    fprintf(stderr, "create_line: the corpus has no pgaudit messages\n");
+    return;
+  }
+
+  allocs = bench_allocs;
+  alloc_bytes = bench_alloc_bytes;
+  start = bench_now_ns();
+  for (i = 0; i < records; i++) {
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    pgauditlogtofile_create_audit_line(&buf, &edata[i % num_audit], exclude_nchars[i % num_audit]);
+    out_bytes += buf.len;
+    pfree(buf.data);
+  }
+  bench_report("create_line", records, bench_now_ns() - start,
+               bench_allocs - allocs, bench_alloc_bytes - alloc_bytes, out_bytes);
+
+  pfree(edata);
+  pfree(exclude_nchars);
+}
+
+int main(int argc, char **argv) {
+  pgAuditLogToFilePrefix **conn, **disconn;
+  size_t num_conn, num_disconn;
+  uint64 records = BENCH_DEFAULT_RECORDS;
+  const char *corpus = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "f:n:")) != -1) {
+    switch (c) {
+    case 'f':
+      corpus = optarg;
+      break;
+    case 'n':
+      records = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n records] [-f corpus]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (records == 0)
+    records = BENCH_DEFAULT_RECORDS;
+
+  bench_stubs_init();
+  if (corpus)
+    bench_load_file(corpus);
+  else
+    bench_load_builtin();
+
+  conn = pgauditlogtofile_build_prefixes(false, &num_conn, palloc);
+  disconn = pgauditlogtofile_build_prefixes(true, &num_disconn, palloc);
+
+  /* First line of a session formats the start time too */
+  pgauditlogtofile_format_start_time();
+
+  printf("%-16s %12s %12s %14s %16s %14s\n",
+         "benchmark", "records", "ns/record", "allocs/record", "alloc B/record", "out B/record");
+  bench_classify(records, conn, num_conn, disconn, num_disconn);
+  bench_format_log_time(records);
+  bench_create_line(records);
+
+  return 0;
+}
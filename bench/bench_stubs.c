@@ -0,0 +1,190 @@
+/*-------------------------------------------------------------------------
+ *
+ * bench_stubs.c
+ *      minimal backend environment for the formatter microbenchmarks
+ *
+ * logtofile_format.o is linked as built for the extension, so the backend
+ * symbols it references are defined here with the values of an ordinary
+ * client session. palloc, StringInfo and snprintf come from the frontend
+ * libpgcommon and libpgport, and the timezone routines use the C library,
+ * so the timestamps follow TZ instead of log_timezone.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "pgtime.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/ps_status.h"
+
+#include "logtofile_clock.h"
+#include "bench.h"
+
+#include <time.h>
+
+/* Allocation accounting, see -Wl,--wrap in the Makefile */
+uint64 bench_allocs = 0;
+uint64 bench_alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+
+/* Backend globals */
+struct Port *MyProcPort = NULL;
+PGPROC *MyProc = NULL;
+int MyProcPid = 0;
+pg_time_t MyStartTime = 0;
+const char *debug_query_string = NULL;
+char *application_name = NULL;
+int Log_error_verbosity = PGERROR_DEFAULT;
+pg_tz *log_timezone = NULL;
+
+static Port bench_port;
+static PGPROC bench_proc;
+static const char *bench_ps_display = "bench_user bench_db 192.168.10.25(51234) SELECT";
+
+
+void *__wrap_malloc(size_t size) {
+  bench_allocs++;
+  bench_alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  bench_allocs++;
+  bench_alloc_bytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  bench_alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  __real_free(ptr);
+}
+
+/*
+ * Fills the backend globals used by the formatter with a client session
+ */
+void bench_stubs_init(void) {
+  memset(&bench_port, 0, sizeof(bench_port));
+  bench_port.user_name = "bench_user";
+  bench_port.database_name = "bench_db";
+  bench_port.remote_host = "192.168.10.25";
+  bench_port.remote_port = "51234";
+
+  memset(&bench_proc, 0, sizeof(bench_proc));
+  bench_proc.backendId = 3;
+  bench_proc.lxid = 4242;
+
+  MyProcPort = &bench_port;
+  MyProc = &bench_proc;
+  MyProcPid = getpid();
+  MyStartTime = (pg_time_t) time(NULL);
+  debug_query_string = "SELECT abalance FROM pgbench_accounts WHERE aid = 42;";
+  application_name = "pgbench";
+}
+
+/*
+ * Switches the client session seen by the formatter
+ */
+void bench_stubs_set_session(char *user_name, char *database_name, char *remote_host, char *remote_port, char *app_name) {
+  bench_port.user_name = user_name;
+  bench_port.database_name = database_name;
+  bench_port.remote_host = remote_host;
+  bench_port.remote_port = remote_port;
+  application_name = app_name;
+}
+
+#ifdef PGAUDITLOGTOFILE_TEST_CLOCK
+/*
+ * The formatter benchmarks use the real clock
+ */
+void pgauditlogtofile_gettimeofday(struct timeval *tv) {
+  gettimeofday(tv, NULL);
+}
+#endif
+
+const char *get_ps_display(int *displen) {
+  *displen = strlen(bench_ps_display);
+  return bench_ps_display;
+}
+
+TransactionId GetTopTransactionIdIfAny(void) {
+  return InvalidTransactionId;
+}
+
+/*
+ * Same as the backend version in elog.c
+ */
+char *unpack_sql_state(int sql_state) {
+  static char buf[12];
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    buf[i] = PGUNSIXBIT(sql_state);
+    sql_state >>= 6;
+  }
+
+  buf[i] = '\0';
+  return buf;
+}
+
+struct pg_tm *pg_localtime(const pg_time_t *timep, const pg_tz *tz) {
+  static struct pg_tm result;
+  struct tm tm;
+  time_t t = (time_t) *timep;
+
+  localtime_r(&t, &tm);
+  result.tm_sec = tm.tm_sec;
+  result.tm_min = tm.tm_min;
+  result.tm_hour = tm.tm_hour;
+  result.tm_mday = tm.tm_mday;
+  result.tm_mon = tm.tm_mon;
+  result.tm_year = tm.tm_year;
+  result.tm_wday = tm.tm_wday;
+  result.tm_yday = tm.tm_yday;
+  result.tm_isdst = tm.tm_isdst;
+  result.tm_gmtoff = tm.tm_gmtoff;
+  result.tm_zone = tm.tm_zone;
+
+  return &result;
+}
+
+size_t pg_strftime(char *s, size_t maxsize, const char *format, const struct pg_tm *t) {
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_sec = t->tm_sec;
+  tm.tm_min = t->tm_min;
+  tm.tm_hour = t->tm_hour;
+  tm.tm_mday = t->tm_mday;
+  tm.tm_mon = t->tm_mon;
+  tm.tm_year = t->tm_year;
+  tm.tm_wday = t->tm_wday;
+  tm.tm_yday = t->tm_yday;
+  tm.tm_isdst = t->tm_isdst;
+  tm.tm_gmtoff = t->tm_gmtoff;
+  tm.tm_zone = t->tm_zone;
+
+  return strftime(s, maxsize, format, &tm);
+}
@@ -0,0 +1,164 @@
+#!/usr/bin/env bash
+#
+# common.sh
+#      helpers shared by the end to end benchmarks: a throwaway cluster in a
+#      temporary directory, configured for each way of writing the audit log
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+PG_BINDIR=$("$PG_CONFIG" --bindir)
+export PATH="$PG_BINDIR:$PATH"
+
+BENCH_PORT=${BENCH_PORT:-54329}
+BENCH_WORKDIR=${BENCH_WORKDIR:-}
+BENCH_KEEP=${BENCH_KEEP:-0}
+
+# Modes in which the audit records can be written
+#   none              pgaudit not loaded, baseline
+#   stderr            pgaudit, server log written by pg_ctl -l
+#   csvlog            pgaudit, csvlog with logging_collector
+#   pgauditlogtofile  pgaudit with pgauditlogtofile
+BENCH_ALL_MODES="none stderr csvlog pgauditlogtofile"
+
+bench_log() {
+  echo "$(date '+%H:%M:%S') $*" >&2
+}
+
+bench_die() {
+  bench_log "ERROR: $*"
+  exit 1
+}
+
+#
+# Creates the cluster, removed on exit unless BENCH_KEEP=1
+#
+bench_init_cluster() {
+  if [ -z "$BENCH_WORKDIR" ]; then
+    BENCH_WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/pgauditlogtofile-bench.XXXXXX")
+  fi
+  BENCH_DATA="$BENCH_WORKDIR/data"
+  BENCH_AUDIT_DIR="$BENCH_WORKDIR/audit"
+  BENCH_SERVER_LOG="$BENCH_WORKDIR/server.log"
+  mkdir -p "$BENCH_AUDIT_DIR"
+  trap bench_cleanup EXIT
+
+  bench_log "initdb in $BENCH_WORKDIR"
+  initdb -D "$BENCH_DATA" -A trust -U postgres --no-sync > "$BENCH_WORKDIR/initdb.log" 2>&1 ||
+    bench_die "initdb failed, see $BENCH_WORKDIR/initdb.log"
+
+  cat >> "$BENCH_DATA/postgresql.conf" <<EOF
+listen_addresses = ''
+port = $BENCH_PORT
+unix_socket_directories = '$BENCH_WORKDIR'
+max_connections = ${BENCH_MAX_CONNECTIONS:-300}
+shared_buffers = ${BENCH_SHARED_BUFFERS:-256MB}
+include_if_exists = 'bench.conf'
+EOF
+
+  export PGHOST="$BENCH_WORKDIR" PGPORT="$BENCH_PORT" PGUSER=postgres PGDATABASE=postgres
+}
+
+bench_cleanup() {
+  bench_stop
+  if [ "$BENCH_KEEP" = "1" ]; then
+    bench_log "cluster kept in $BENCH_WORKDIR"
+  else
+    rm -rf "$BENCH_WORKDIR"
+  fi
+}
+
+#
+# Starts the cluster writing the audit in mode $1 with pgaudit.log = $2 and
+# extra settings in $3
+#
+bench_start() {
+  local mode=$1 pgaudit_log=$2 extra=${3:-}
+
+  {
+    case "$mode" in
+      none)
+        ;;
+      stderr)
+        echo "shared_preload_libraries = 'pgaudit'"
+        echo "logging_collector = off"
+        echo "log_destination = 'stderr'"
+        ;;
+      csvlog)
+        echo "shared_preload_libraries = 'pgaudit'"
+        echo "logging_collector = on"
+        echo "log_destination = 'csvlog'"
+        echo "log_directory = '$BENCH_AUDIT_DIR'"
+        ;;
+      pgauditlogtofile)
+        echo "shared_preload_libraries = 'pgaudit,pgauditlogtofile'"
+        echo "logging_collector = off"
+        echo "pgaudit.log_directory = '$BENCH_AUDIT_DIR'"
+        ;;
+      *)
+        bench_die "unknown mode $mode"
+        ;;
+    esac
+    if [ "$mode" != "none" ]; then
+      echo "pgaudit.log = '$pgaudit_log'"
+    fi
+    printf '%s\n' "$extra"
+  } > "$BENCH_DATA/bench.conf"
+
+  rm -rf "$BENCH_AUDIT_DIR"/* "$BENCH_SERVER_LOG"
+  pg_ctl -D "$BENCH_DATA" -l "$BENCH_SERVER_LOG" -w -s start ||
+    bench_die "server did not start in mode $mode, see $BENCH_SERVER_LOG"
+
+  if [ "$mode" != "none" ]; then
+    psql -Xq -c "CREATE EXTENSION IF NOT EXISTS pgaudit" > /dev/null
+  fi
+  BENCH_MODE=$mode
+}
+
+bench_stop() {
+  if [ -n "${BENCH_DATA:-}" ] && [ -f "$BENCH_DATA/postmaster.pid" ]; then
+    pg_ctl -D "$BENCH_DATA" -m fast -w -s stop || true
+  fi
+}
+
+#
+# Bytes written so far to the destination of the audit records
+#
+bench_audit_bytes() {
+  case "$BENCH_MODE" in
+    stderr)
+      stat -c %s "$BENCH_SERVER_LOG" 2> /dev/null || echo 0
+      ;;
+    csvlog|pgauditlogtofile)
+      find "$BENCH_AUDIT_DIR" -type f -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }'
+      ;;
+    *)
+      echo 0
+      ;;
+  esac
+}
+
+#
+# Percentiles $2... (0-100) of the numbers in file $1, one per line
+#
+bench_percentiles() {
+  local file=$1
+  shift
+  sort -n "$file" | awk -v pcts="$*" '
+    { v[NR] = $1 }
+    END {
+      n = split(pcts, p, " ")
+      for (i = 1; i <= n; i++) {
+        if (NR == 0) { printf "%s%s", (i > 1 ? "\t" : ""), "NaN"; continue }
+        k = int(NR * p[i] / 100 + 0.999999)
+        if (k < 1) k = 1
+        if (k > NR) k = NR
+        printf "%s%s", (i > 1 ? "\t" : ""), v[k]
+      }
+      printf "\n"
+    }'
+}
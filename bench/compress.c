@@ -0,0 +1,341 @@
+/*-------------------------------------------------------------------------
+ *
+ * compress.c
+ *      zlib throughput, ratio and latency over a corpus of audit files
+ *
+ * The records of the corpus are grouped in blocks of whole records of up to
+ * the block size, and every block is compressed on its own, as a writer
+ * compressing the audit file by blocks would do, for every combination of
+ * level, block size and preset dictionary. The dictionary is built with
+ * records sampled across the corpus.
+ *
+ * For each combination it prints one tab separated line with the ratio, the
+ * compression speed of one core, the latency added to the record that
+ * closes a block, the decompression speed and the time to read one random
+ * record through a block index (seek).
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+/* Defines */
+#define COMPRESS_DICT_SIZE 32768
+#define COMPRESS_DICT_SAMPLES 256
+
+typedef struct compress_block {
+  size_t first_record;
+  size_t num_records;
+  size_t raw_offset;
+  size_t raw_len;
+  unsigned char *data;
+  size_t len;
+} compress_block;
+
+/* Corpus */
+static char *corpus = NULL;
+static size_t corpus_len = 0;
+static size_t *record_offsets = NULL; /* num_records + 1 entries */
+static size_t num_records = 0;
+
+/* Preset dictionary */
+static unsigned char dictionary[COMPRESS_DICT_SIZE];
+static size_t dictionary_len = 0;
+
+/* Internal functions */
+static uint64_t compress_now_ns(void);
+static void compress_load(const char *path);
+static void compress_build_dictionary(void);
+static int compress_cmp_u64(const void *lhs, const void *rhs);
+static void compress_run(int level, size_t block_size, bool use_dict, int num_seeks);
+
+
+static uint64_t compress_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compress_cmp_u64(const void *lhs, const void *rhs) {
+  uint64_t l = *(const uint64_t *) lhs;
+  uint64_t r = *(const uint64_t *) rhs;
+
+  return (l > r) - (l < r);
+}
+
+/*
+ * Appends an audit file to the corpus, a record ends in a newline outside
+ * quotes
+ */
+static void compress_load(const char *path) {
+  FILE *fp;
+  struct stat st;
+  size_t i, start, max_records;
+  bool quoted = false;
+
+  fp = fopen(path, "r");
+  if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+  corpus = realloc(corpus, corpus_len + st.st_size);
+  if (corpus == NULL || fread(corpus + corpus_len, 1, st.st_size, fp) != (size_t) st.st_size) {
+    fprintf(stderr, "could not read \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fclose(fp);
+
+  start = corpus_len;
+  corpus_len += st.st_size;
+  max_records = num_records + st.st_size / 32 + 2;
+  record_offsets = realloc(record_offsets, max_records * sizeof(size_t));
+
+  for (i = start; i < corpus_len; i++) {
+    if (corpus[i] == '"')
+      quoted = !quoted;
+    else if (corpus[i] == '\n' && !quoted) {
+      record_offsets[num_records++] = start;
+      start = i + 1;
+      if (num_records + 1 >= max_records) {
+        max_records *= 2;
+        record_offsets = realloc(record_offsets, max_records * sizeof(size_t));
+      }
+    }
+  }
+  if (start < corpus_len)
+    record_offsets[num_records++] = start;
+  record_offsets[num_records] = corpus_len;
+}
+
+/*
+ * Dictionary with records sampled across the corpus, zlib prefers the most
+ * useful strings at the end
+ */
+static void compress_build_dictionary(void) {
+  size_t i, step, len;
+
+  step = num_records / COMPRESS_DICT_SAMPLES + 1;
+  for (i = 0; i < num_records && dictionary_len < COMPRESS_DICT_SIZE; i += step) {
+    len = record_offsets[i + 1] - record_offsets[i];
+    if (len > COMPRESS_DICT_SIZE - dictionary_len)
+      len = COMPRESS_DICT_SIZE - dictionary_len;
+    memcpy(dictionary + dictionary_len, corpus + record_offsets[i], len);
+    dictionary_len += len;
+  }
+}
+
+/*
+ * Compresses the corpus by blocks and reads it back
+ */
+static void compress_run(int level, size_t block_size, bool use_dict, int num_seeks) {
+  compress_block *blocks;
+  size_t num_blocks = 0, i, r, compressed = 0;
+  uint64_t *latency, start, compress_ns = 0, decompress_ns, seek_ns;
+  unsigned char *out;
+  z_stream zs;
+  int s;
+
+  blocks = calloc(num_records, sizeof(compress_block));
+  latency = calloc(num_records, sizeof(uint64_t));
+  out = malloc(corpus_len > block_size ? corpus_len : block_size);
+
+  /* blocks of whole records */
+  for (r = 0; r < num_records; num_blocks++) {
+    compress_block *block = &blocks[num_blocks];
+
+    block->first_record = r;
+    block->raw_offset = record_offsets[r];
+    do {
+      r++;
+    } while (r < num_records && record_offsets[r + 1] - block->raw_offset <= block_size);
+    block->num_records = r - block->first_record;
+    block->raw_len = record_offsets[r] - block->raw_offset;
+  }
+
+  for (i = 0; i < num_blocks; i++) {
+    compress_block *block = &blocks[i];
+    uLong bound;
+
+    start = compress_now_ns();
+    memset(&zs, 0, sizeof(zs));
+    deflateInit(&zs, level);
+    if (use_dict)
+      deflateSetDictionary(&zs, dictionary, dictionary_len);
+    bound = deflateBound(&zs, block->raw_len);
+    block->data = malloc(bound);
+    zs.next_in = (unsigned char *) corpus + block->raw_offset;
+    zs.avail_in = block->raw_len;
+    zs.next_out = block->data;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+      fprintf(stderr, "deflate failed: %s\n", zs.msg ? zs.msg : "");
+      exit(1);
+    }
+    block->len = zs.total_out;
+    deflateEnd(&zs);
+    latency[i] = compress_now_ns() - start;
+    compress_ns += latency[i];
+    compressed += block->len;
+  }
+
+  /* sequential read of the whole file */
+  start = compress_now_ns();
+  for (i = 0; i < num_blocks; i++) {
+    compress_block *block = &blocks[i];
+
+    memset(&zs, 0, sizeof(zs));
+    inflateInit(&zs);
+    zs.next_in = block->data;
+    zs.avail_in = block->len;
+    zs.next_out = out;
+    zs.avail_out = block->raw_len;
+    s = inflate(&zs, Z_FINISH);
+    if (s == Z_NEED_DICT) {
+      inflateSetDictionary(&zs, dictionary, dictionary_len);
+      s = inflate(&zs, Z_FINISH);
+    }
+    if (s != Z_STREAM_END || zs.total_out != block->raw_len) {
+      fprintf(stderr, "inflate failed: %s\n", zs.msg ? zs.msg : "");
+      exit(1);
+    }
+    inflateEnd(&zs);
+  }
+  decompress_ns = compress_now_ns() - start;
+
+  /* random records through the block index */
+  srandom(42);
+  start = compress_now_ns();
+  for (s = 0; s < num_seeks; s++) {
+    size_t target = random() % num_records;
+    size_t lo = 0, hi = num_blocks - 1, mid;
+    compress_block *block;
+    int ret;
+
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (blocks[mid].first_record <= target)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    block = &blocks[lo];
+
+    memset(&zs, 0, sizeof(zs));
+    inflateInit(&zs);
+    zs.next_in = block->data;
+    zs.avail_in = block->len;
+    zs.next_out = out;
+    /* only up to the end of the record */
+    zs.avail_out = record_offsets[target + 1] - block->raw_offset;
+    ret = inflate(&zs, Z_SYNC_FLUSH);
+    if (ret == Z_NEED_DICT) {
+      inflateSetDictionary(&zs, dictionary, dictionary_len);
+      ret = inflate(&zs, Z_SYNC_FLUSH);
+    }
+    if (ret < 0 || memcmp(out + record_offsets[target] - block->raw_offset,
+                          corpus + record_offsets[target],
+                          record_offsets[target + 1] - record_offsets[target]) != 0) {
+      fprintf(stderr, "seek to record %zu failed\n", target);
+      exit(1);
+    }
+    inflateEnd(&zs);
+  }
+  seek_ns = compress_now_ns() - start;
+
+  qsort(latency, num_blocks, sizeof(uint64_t), compress_cmp_u64);
+
+  printf("%d\t%zu\t%s\t%zu\t%zu\t%.2f\t%.3f\t%.0f\t%.1f\t%.1f\t%.1f\t%.3f\t%.1f\t%.1f\n",
+         level, block_size, use_dict ? "yes" : "no",
+         num_records, num_blocks,
+         corpus_len / 1048576.0,
+         (double) corpus_len / compressed,
+         num_records / (compress_ns / 1e9),
+         corpus_len / 1048576.0 / (compress_ns / 1e9),
+         latency[num_blocks / 2] / 1000.0,
+         latency[(size_t) (num_blocks * 0.99)] / 1000.0,
+         compress_ns / 1000.0 / num_records,
+         corpus_len / 1048576.0 / (decompress_ns / 1e9),
+         num_seeks > 0 ? seek_ns / 1000.0 / num_seeks : 0);
+
+  for (i = 0; i < num_blocks; i++)
+    free(blocks[i].data);
+  free(blocks);
+  free(latency);
+  free(out);
+}
+
+int main(int argc, char **argv) {
+  const char *levels = "1 3 6 9";
+  const char *block_sizes = "4096 16384 65536 262144 1048576";
+  const char *dict_modes = "no yes";
+  int num_seeks = 10000;
+  char *list, *level, *size, *dict, *s1, *s2, *s3;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "b:d:l:s:")) != -1) {
+    switch (c) {
+    case 'b':
+      block_sizes = optarg;
+      break;
+    case 'd':
+      dict_modes = optarg;
+      break;
+    case 'l':
+      levels = optarg;
+      break;
+    case 's':
+      num_seeks = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b \"block sizes\"] [-d \"no yes\"] [-l \"levels\"] [-s seeks] audit_file...\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-b \"block sizes\"] [-d \"no yes\"] [-l \"levels\"] [-s seeks] audit_file...\n", argv[0]);
+    exit(1);
+  }
+
+  for (i = optind; i < argc; i++)
+    compress_load(argv[i]);
+  if (num_records == 0) {
+    fprintf(stderr, "no records found\n");
+    exit(1);
+  }
+  compress_build_dictionary();
+
+  printf("level\tblock_bytes\tdictionary\trecords\tblocks\tinput_MB\tratio\tcompress_records_per_s\tcompress_MB_per_s\tblock_latency_p50_us\tblock_latency_p99_us\tcompress_us_per_record\tdecompress_MB_per_s\tseek_us\n");
+
+  list = strdup(levels);
+  for (level = strtok_r(list, " ,", &s1); level; level = strtok_r(NULL, " ,", &s1)) {
+    char *sizes = strdup(block_sizes);
+
+    for (size = strtok_r(sizes, " ,", &s2); size; size = strtok_r(NULL, " ,", &s2)) {
+      char *dicts = strdup(dict_modes);
+
+      for (dict = strtok_r(dicts, " ,", &s3); dict; dict = strtok_r(NULL, " ,", &s3)) {
+        compress_run(atoi(level), strtoul(size, NULL, 10), strcmp(dict, "yes") == 0, num_seeks);
+        fflush(stdout);
+      }
+      free(dicts);
+    }
+    free(sizes);
+  }
+  free(list);
+
+  return 0;
+}
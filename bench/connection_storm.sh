@@ -0,0 +1,139 @@
+#!/usr/bin/env bash
+#
+# connection_storm.sh
+#      connection rate and latency of short lived connections with and
+#      without auditing of connections and disconnections
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+. "$BENCH_DIR/common.sh"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -c CLIENTS   concurrent connecting threads (default "1 8 32 64")
+  -k CONFIGS   configurations (default "off server audit")
+  -o FILE      results table (default stdout)
+  -q QUERY     query to run in every connection (default none)
+  -S           count the syscalls of the cluster with strace -f -c
+  -T SECONDS   duration of every run (default 20)
+EOF
+  exit 1
+}
+
+CLIENTS="1 8 32 64"
+CONFIGS="off server audit"
+OUTPUT=
+QUERY=
+STRACE=0
+DURATION=20
+
+while getopts "c:k:o:q:ST:" opt; do
+  case "$opt" in
+    c) CLIENTS=$OPTARG ;;
+    k) CONFIGS=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    q) QUERY=$OPTARG ;;
+    S) STRACE=1 ;;
+    T) DURATION=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+if [ "$STRACE" = "1" ] && ! command -v strace > /dev/null; then
+  bench_die "strace not found"
+fi
+
+CONNSTORM="$BENCH_DIR/connstorm"
+if [ ! -x "$CONNSTORM" ]; then
+  bench_log "building $CONNSTORM"
+  make -s -C "$BENCH_DIR/.." PG_CONFIG="$PG_CONFIG" bench/connstorm > /dev/null ||
+    bench_die "could not build bench/connstorm"
+fi
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+#
+# Settings of every configuration
+#   off     pgauditlogtofile loaded, connections not logged
+#   server  connections logged to the server log by PostgreSQL
+#   audit   connections intercepted and written to the audit file
+#
+config_settings() {
+  case "$1" in
+    off)
+      printf '%s\n' "log_connections = off" "log_disconnections = off"
+      ;;
+    server)
+      printf '%s\n' "log_connections = on" "log_disconnections = on" \
+        "pgaudit.log_connections = off" "pgaudit.log_disconnections = off"
+      ;;
+    audit)
+      printf '%s\n' "log_connections = on" "log_disconnections = on" \
+        "pgaudit.log_connections = on" "pgaudit.log_disconnections = on"
+      ;;
+    *)
+      bench_die "unknown configuration $1"
+      ;;
+  esac
+}
+
+#
+# Bytes written to the audit file and the server log, where the connection
+# messages go when they are not intercepted
+#
+log_bytes() {
+  echo $(( $(bench_audit_bytes) + $(stat -c %s "$BENCH_SERVER_LOG" 2> /dev/null || echo 0) ))
+}
+
+bench_init_cluster
+
+printf 'config\tclients\tconnections\tfailures\tconnections_per_s\tlatency_p50_ms\tlatency_p99_ms\tlatency_p999_ms\tlatency_max_ms\tlog_bytes\tsyscalls_per_conn\topen_per_conn\twrite_per_conn\n'
+
+for config in $CONFIGS; do
+  bench_start pgauditlogtofile none "$(config_settings "$config")"
+
+  for clients in $CLIENTS; do
+    bench_log "$config clients=$clients"
+
+    strace_pid=
+    if [ "$STRACE" = "1" ]; then
+      strace -f -c -o "$BENCH_WORKDIR/strace" -p "$(head -1 "$BENCH_DATA/postmaster.pid")" 2> /dev/null &
+      strace_pid=$!
+      sleep 1
+    fi
+
+    bytes_before=$(log_bytes)
+    result=$("$CONNSTORM" -c "$clients" -T "$DURATION" ${QUERY:+-q "$QUERY"} \
+               -d "host=$PGHOST port=$PGPORT user=$PGUSER dbname=$PGDATABASE")
+    bytes_after=$(log_bytes)
+
+    syscalls="NaN	NaN	NaN"
+    if [ -n "$strace_pid" ]; then
+      kill -INT "$strace_pid"
+      wait "$strace_pid" || true
+      connections=$(echo "$result" | cut -f1)
+      syscalls=$(awk -v conns="$connections" '
+        $1 ~ /^[0-9.]+$/ && $NF != "total" { total += $4 }
+        $NF == "open" || $NF == "openat" { open += $4 }
+        $NF == "write" || $NF == "writev" || $NF == "pwrite64" { write += $4 }
+        END {
+          if (conns == 0) conns = 1
+          printf "%.1f\t%.2f\t%.2f", total / conns, open / conns, write / conns
+        }' "$BENCH_WORKDIR/strace")
+    fi
+
+    printf '%s\t%s\t%s\t%s\t%s\n' "$config" "$clients" "$result" \
+      "$(( bytes_after - bytes_before ))" "$syscalls"
+  done
+
+  bench_stop
+done
@@ -0,0 +1,193 @@
+/*-------------------------------------------------------------------------
+ *
+ * connstorm.c
+ *      opens and closes short lived connections as fast as possible
+ *
+ * Every thread connects, optionally runs one query, and disconnects in a
+ * loop for the duration of the run. The time spent in PQconnectdb, which
+ * covers the fork of the backend, the authentication and the connection
+ * messages, is kept for every connection.
+ *
+ * Prints one tab separated line: connections, failures, connections per
+ * second and the p50, p99, p99.9 and max connection latency in ms.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+/* Defines */
+#define CONNSTORM_INITIAL_SAMPLES 4096
+
+typedef struct connstorm_thread {
+  pthread_t thread;
+  double *latency_ms;
+  long num_samples;
+  long max_samples;
+  long failures;
+} connstorm_thread;
+
+/* Options */
+static const char *conninfo = "";
+static const char *query = NULL;
+static int duration = 10;
+static int num_threads = 8;
+
+static double deadline;
+
+/* Internal functions */
+static double connstorm_now(void);
+static int connstorm_cmp(const void *lhs, const void *rhs);
+static double connstorm_percentile(const double *sorted, long n, double pct);
+static void *connstorm_run(void *arg);
+
+
+/*
+ * Monotonic clock in seconds
+ */
+static double connstorm_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connstorm_cmp(const void *lhs, const void *rhs) {
+  double l = *(const double *) lhs;
+  double r = *(const double *) rhs;
+
+  return (l > r) - (l < r);
+}
+
+static double connstorm_percentile(const double *sorted, long n, double pct) {
+  long k;
+
+  if (n == 0)
+    return 0;
+
+  k = (long) (n * pct / 100.0 + 0.999999);
+  if (k < 1)
+    k = 1;
+  if (k > n)
+    k = n;
+  return sorted[k - 1];
+}
+
+/*
+ * Connection loop of a thread
+ */
+static void *connstorm_run(void *arg) {
+  connstorm_thread *self = arg;
+  PGconn *conn;
+  PGresult *res;
+  double start;
+
+  while ((start = connstorm_now()) < deadline) {
+    conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+      if (self->failures++ == 0)
+        fprintf(stderr, "connection failed: %s", PQerrorMessage(conn));
+      PQfinish(conn);
+      continue;
+    }
+
+    if (self->num_samples == self->max_samples) {
+      self->max_samples *= 2;
+      self->latency_ms = realloc(self->latency_ms, self->max_samples * sizeof(double));
+      if (self->latency_ms == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+    self->latency_ms[self->num_samples++] = (connstorm_now() - start) * 1000;
+
+    if (query) {
+      res = PQexec(conn, query);
+      if (PQresultStatus(res) != PGRES_TUPLES_OK && PQresultStatus(res) != PGRES_COMMAND_OK)
+        self->failures++;
+      PQclear(res);
+    }
+
+    PQfinish(conn);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  connstorm_thread *threads;
+  double *all;
+  long total = 0, failures = 0, n;
+  double elapsed, start;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "c:d:q:T:")) != -1) {
+    switch (c) {
+    case 'c':
+      num_threads = atoi(optarg);
+      break;
+    case 'd':
+      conninfo = optarg;
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    case 'T':
+      duration = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c threads] [-d conninfo] [-q query] [-T seconds]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (num_threads <= 0 || duration <= 0) {
+    fprintf(stderr, "threads and seconds must be greater than 0\n");
+    exit(1);
+  }
+
+  threads = calloc(num_threads, sizeof(connstorm_thread));
+  start = connstorm_now();
+  deadline = start + duration;
+  for (i = 0; i < num_threads; i++) {
+    threads[i].max_samples = CONNSTORM_INITIAL_SAMPLES;
+    threads[i].latency_ms = malloc(threads[i].max_samples * sizeof(double));
+    if (pthread_create(&threads[i].thread, NULL, connstorm_run, &threads[i]) != 0) {
+      fprintf(stderr, "could not create thread: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    total += threads[i].num_samples;
+    failures += threads[i].failures;
+  }
+  elapsed = connstorm_now() - start;
+
+  all = malloc((total > 0 ? total : 1) * sizeof(double));
+  for (i = 0, n = 0; i < num_threads; i++) {
+    memcpy(all + n, threads[i].latency_ms, threads[i].num_samples * sizeof(double));
+    n += threads[i].num_samples;
+  }
+  qsort(all, total, sizeof(double), connstorm_cmp);
+
+  printf("%ld\t%ld\t%.1f\t%.3f\t%.3f\t%.3f\t%.3f\n",
+         total, failures, total / elapsed,
+         connstorm_percentile(all, total, 50),
+         connstorm_percentile(all, total, 99),
+         connstorm_percentile(all, total, 99.9),
+         total > 0 ? all[total - 1] : 0);
+
+  return failures > 0 && total == 0;
+}
@@ -0,0 +1,152 @@
+#!/usr/bin/env bash
+#
+# fault_injection.sh
+#      backend throughput, server log volume and recovery time while the
+#      audit file operations fail or are slow
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+. "$BENCH_DIR/common.sh"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -B SECONDS   before the fault (default 10)
+  -c CLIENTS   pgbench clients (default 16)
+  -d US        delay of the slow mode (default 10000)
+  -F SECONDS   with the fault (default 20)
+  -m MODES     faults (default "none enospc eio eacces slow")
+  -o FILE      results table (default stdout)
+  -R SECONDS   after the fault (default 20)
+  -s SCALE     pgbench scale factor (default 10)
+EOF
+  exit 1
+}
+
+BEFORE=10
+CLIENTS=16
+SLOW_US=10000
+DURING=20
+MODES="none enospc eio eacces slow"
+OUTPUT=
+AFTER=20
+SCALE=10
+
+while getopts "B:c:d:F:m:o:R:s:" opt; do
+  case "$opt" in
+    B) BEFORE=$OPTARG ;;
+    c) CLIENTS=$OPTARG ;;
+    d) SLOW_US=$OPTARG ;;
+    F) DURING=$OPTARG ;;
+    m) MODES=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    R) AFTER=$OPTARG ;;
+    s) SCALE=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+FAULTFS="$BENCH_DIR/faultfs.so"
+if [ ! -f "$FAULTFS" ]; then
+  make -s -C "$BENCH_DIR/.." bench/faultfs.so > /dev/null
+fi
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+NPROC=$(nproc 2> /dev/null || echo 4)
+TOTAL=$(( BEFORE + DURING + AFTER ))
+
+bench_init_cluster
+CONTROL="$BENCH_WORKDIR/faultfs.control"
+
+bench_start none ""
+bench_log "pgbench -i -s $SCALE"
+pgbench -i -q -s "$SCALE" > "$BENCH_WORKDIR/pgbench_init.log" 2>&1 ||
+  bench_die "pgbench -i failed, see $BENCH_WORKDIR/pgbench_init.log"
+bench_stop
+
+fault_now_ms() {
+  date +%s%3N
+}
+
+fault_log_bytes() {
+  stat -c %s "$BENCH_SERVER_LOG" 2> /dev/null || echo 0
+}
+
+printf 'fault\tclients\tbefore_tps\tduring_tps\tafter_tps\tduring_pct\tlog_bytes_per_s\tlog_warnings_per_s\tdropped_records\taudit_resume_ms\ttps_recovery_s\n'
+
+for fault in $MODES; do
+  case "$fault" in
+    none|enospc|eio|eacces) control=$fault ;;
+    slow) control="slow $SLOW_US" ;;
+    *) bench_die "unknown fault $fault" ;;
+  esac
+
+  echo none > "$CONTROL"
+  LD_PRELOAD="$FAULTFS" FAULTFS_PATH="$BENCH_AUDIT_DIR" FAULTFS_CONTROL="$CONTROL" \
+    bench_start pgauditlogtofile read
+  psql -Xq -c "CREATE EXTENSION IF NOT EXISTS pgauditlogtofile" > /dev/null
+
+  bench_log "$fault: $CLIENTS clients, ${BEFORE}s + ${DURING}s with the fault + ${AFTER}s"
+  pgbench -n -S -M prepared -c "$CLIENTS" -j "$(( CLIENTS < NPROC ? CLIENTS : NPROC ))" -T "$TOTAL" -P 1 \
+    > "$BENCH_WORKDIR/pgbench.log" 2> "$BENCH_WORKDIR/progress.log" &
+  pgbench_pid=$!
+
+  sleep "$BEFORE"
+  # The fault starts with a rotation, so every backend opens a new file
+  log_start=$(fault_log_bytes)
+  echo "$control" > "$CONTROL"
+  echo "pgaudit.log_filename = 'audit-fault-%Y%m%d_%H%M.log'" >> "$BENCH_DATA/bench.conf"
+  pg_ctl -D "$BENCH_DATA" -s reload
+
+  sleep "$DURING"
+  log_end=$(fault_log_bytes)
+  audit_bytes=$(bench_audit_bytes)
+  echo none > "$CONTROL"
+  cleared=$(fault_now_ms)
+
+  # First write to the audit files after the fault
+  resume_ms=NaN
+  while kill -0 "$pgbench_pid" 2> /dev/null; do
+    if [ "$(bench_audit_bytes)" -gt "$audit_bytes" ]; then
+      resume_ms=$(( $(fault_now_ms) - cleared ))
+      break
+    fi
+    sleep 0.05
+  done
+
+  wait "$pgbench_pid" || bench_die "pgbench failed, see $BENCH_WORKDIR/pgbench.log"
+  warnings=$(tail -c +"$(( log_start + 1 ))" "$BENCH_SERVER_LOG" | head -c "$(( log_end - log_start ))" | grep -c WARNING || true)
+  dropped=$(psql -XAtc "SELECT dropped_records FROM pgauditlogtofile_stats" 2> /dev/null || echo NaN)
+  bench_stop
+
+  # progress: 12.0 s, 1234.5 tps, lat ...
+  awk -v fault="$fault" -v clients="$CLIENTS" -v before="$BEFORE" -v during="$DURING" \
+    -v log_bytes="$(( log_end - log_start ))" -v warnings="$warnings" -v dropped="$dropped" -v resume="$resume_ms" '
+    $1 == "progress:" {
+      t = $2 + 0; tps = $4 + 0
+      if (t <= before) { b += tps; nb++ }
+      else if (t <= before + during) { d += tps; nd++ }
+      else {
+        a += tps; na++
+        after[t] = tps
+      }
+    }
+    END {
+      b = nb ? b / nb : 0; d = nd ? d / nd : 0; a = na ? a / na : 0
+      recovery = "NaN"
+      for (t = before + during + 1; (t in after); t++)
+        if (after[t] >= 0.9 * b) { recovery = t - before - during; break }
+      printf "%s\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.0f\t%.1f\t%s\t%s\t%s\n",
+        fault, clients, b, d, a, (b > 0 ? d * 100 / b : 0),
+        log_bytes / during, warnings / during, dropped, resume, recovery
+    }' "$BENCH_WORKDIR/progress.log"
+done
@@ -0,0 +1,224 @@
+/*-------------------------------------------------------------------------
+ *
+ * faultfs.c
+ *      LD_PRELOAD shim injecting failures in the audit file operations
+ *
+ * Intercepts fopen, fwrite and fclose of the files under FAULTFS_PATH and
+ * fails or delays them as the control file FAULTFS_CONTROL says. The control
+ * file has one line, and can be rewritten while the server runs:
+ *
+ *   none         no faults
+ *   enospc       fwrite fails, and fopen of a file that does not exist
+ *   eio          fwrite fails
+ *   eacces       fopen fails
+ *   slow <us>    fwrite sleeps <us> microseconds before writing
+ *
+ * The control file is read again when its modification time changes, at
+ * most every 10ms.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defines */
+#define FAULTFS_MAX_STREAMS 16
+#define FAULTFS_CHECK_NS 10000000
+
+typedef enum faultfs_mode {
+  FAULTFS_NONE,
+  FAULTFS_ENOSPC,
+  FAULTFS_EIO,
+  FAULTFS_EACCES,
+  FAULTFS_SLOW
+} faultfs_mode;
+
+/* Real functions */
+static FILE *(*real_fopen)(const char *, const char *) = NULL;
+static FILE *(*real_fopen64)(const char *, const char *) = NULL;
+static size_t (*real_fwrite)(const void *, size_t, size_t, FILE *) = NULL;
+static int (*real_fclose)(FILE *) = NULL;
+
+/* Configuration */
+static const char *faultfs_path = NULL;
+static size_t faultfs_path_len = 0;
+static const char *faultfs_control = NULL;
+
+/* Current fault */
+static faultfs_mode mode = FAULTFS_NONE;
+static long slow_us = 0;
+static struct timespec control_mtime;
+static uint64_t next_check_ns = 0;
+
+/* Audit streams open in this process */
+static FILE *streams[FAULTFS_MAX_STREAMS];
+
+/* Internal functions */
+static void faultfs_init(void);
+static void faultfs_refresh(void);
+static bool faultfs_is_audit_path(const char *path);
+static bool faultfs_is_audit_stream(FILE *fp);
+static FILE *faultfs_fopen(FILE *(*open_func)(const char *, const char *), const char *path, const char *fmode);
+
+
+static void faultfs_init(void) {
+  if (real_fwrite != NULL)
+    return;
+
+  real_fopen = dlsym(RTLD_NEXT, "fopen");
+  real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
+  real_fclose = dlsym(RTLD_NEXT, "fclose");
+  faultfs_path = getenv("FAULTFS_PATH");
+  faultfs_path_len = faultfs_path ? strlen(faultfs_path) : 0;
+  faultfs_control = getenv("FAULTFS_CONTROL");
+  /* last, it marks the shim as initialized */
+  real_fwrite = dlsym(RTLD_NEXT, "fwrite");
+}
+
+/*
+ * Reads the control file if it has changed
+ */
+static void faultfs_refresh(void) {
+  struct timespec now;
+  struct stat st;
+  uint64_t now_ns;
+  char line[64];
+  int fd;
+  ssize_t len;
+
+  if (faultfs_control == NULL)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  now_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  if (now_ns < next_check_ns)
+    return;
+  next_check_ns = now_ns + FAULTFS_CHECK_NS;
+
+  if (stat(faultfs_control, &st) != 0 ||
+      (st.st_mtim.tv_sec == control_mtime.tv_sec && st.st_mtim.tv_nsec == control_mtime.tv_nsec))
+    return;
+  control_mtime = st.st_mtim;
+
+  /* read(2) keeps the stdio calls of this process away from the shim */
+  fd = open(faultfs_control, O_RDONLY);
+  if (fd < 0)
+    return;
+  len = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  line[len > 0 ? len : 0] = '\0';
+
+  slow_us = 0;
+  if (strncmp(line, "enospc", 6) == 0)
+    mode = FAULTFS_ENOSPC;
+  else if (strncmp(line, "eio", 3) == 0)
+    mode = FAULTFS_EIO;
+  else if (strncmp(line, "eacces", 6) == 0)
+    mode = FAULTFS_EACCES;
+  else if (strncmp(line, "slow", 4) == 0) {
+    mode = FAULTFS_SLOW;
+    slow_us = strtol(line + 4, NULL, 10);
+  }
+  else
+    mode = FAULTFS_NONE;
+}
+
+static bool faultfs_is_audit_path(const char *path) {
+  return faultfs_path_len > 0 && strncmp(path, faultfs_path, faultfs_path_len) == 0;
+}
+
+static bool faultfs_is_audit_stream(FILE *fp) {
+  int i;
+
+  for (i = 0; i < FAULTFS_MAX_STREAMS; i++)
+    if (streams[i] == fp)
+      return true;
+  return false;
+}
+
+static FILE *faultfs_fopen(FILE *(*open_func)(const char *, const char *), const char *path, const char *fmode) {
+  FILE *fp;
+  int i;
+
+  if (!faultfs_is_audit_path(path))
+    return open_func(path, fmode);
+
+  faultfs_refresh();
+  if (mode == FAULTFS_EACCES) {
+    errno = EACCES;
+    return NULL;
+  }
+  if (mode == FAULTFS_ENOSPC && access(path, F_OK) != 0) {
+    errno = ENOSPC;
+    return NULL;
+  }
+
+  fp = open_func(path, fmode);
+  if (fp != NULL) {
+    for (i = 0; i < FAULTFS_MAX_STREAMS; i++) {
+      if (streams[i] == NULL) {
+        streams[i] = fp;
+        break;
+      }
+    }
+  }
+  return fp;
+}
+
+FILE *fopen(const char *path, const char *fmode) {
+  faultfs_init();
+  return faultfs_fopen(real_fopen, path, fmode);
+}
+
+FILE *fopen64(const char *path, const char *fmode) {
+  faultfs_init();
+  return faultfs_fopen(real_fopen64, path, fmode);
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp) {
+  faultfs_init();
+
+  if (faultfs_is_audit_stream(fp)) {
+    faultfs_refresh();
+    switch (mode) {
+    case FAULTFS_ENOSPC:
+      errno = ENOSPC;
+      return 0;
+    case FAULTFS_EIO:
+      errno = EIO;
+      return 0;
+    case FAULTFS_SLOW:
+      usleep(slow_us);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return real_fwrite(ptr, size, nmemb, fp);
+}
+
+int fclose(FILE *fp) {
+  int i;
+
+  faultfs_init();
+  for (i = 0; i < FAULTFS_MAX_STREAMS; i++)
+    if (streams[i] == fp)
+      streams[i] = NULL;
+
+  return real_fclose(fp);
+}
@@ -0,0 +1,149 @@
+#!/usr/bin/env bash
+#
+# memory_footprint.sh
+#      memory of the backends attributable to pgauditlogtofile, with idle and
+#      active auditing sessions, and its shared memory
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+. "$BENCH_DIR/common.sh"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -c SESSIONS  idle and active sessions, each (default "10 100 1000")
+  -o FILE      results table (default stdout)
+  -s SCALE     pgbench scale factor (default 10)
+  -T SECONDS   the active sessions run before measuring (default 10)
+  -w WORKLOAD  of the active sessions, builtin script or file in
+               bench/pgbench without .sql (default long_statement)
+EOF
+  exit 1
+}
+
+SESSIONS="10 100 1000"
+OUTPUT=
+SCALE=10
+WARMUP=10
+WORKLOAD=long_statement
+
+while getopts "c:o:s:T:w:" opt; do
+  case "$opt" in
+    c) SESSIONS=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    s) SCALE=$OPTARG ;;
+    T) WARMUP=$OPTARG ;;
+    w) WORKLOAD=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+if [ -f "$BENCH_DIR/pgbench/$WORKLOAD.sql" ]; then
+  script_opt=(-f "$BENCH_DIR/pgbench/$WORKLOAD.sql")
+else
+  script_opt=(-b "$WORKLOAD")
+fi
+
+NPROC=$(nproc 2> /dev/null || echo 4)
+max_sessions=$(printf '%s\n' $SESSIONS | sort -n | tail -1)
+BENCH_MAX_CONNECTIONS=$(( 2 * max_sessions + 20 ))
+
+bench_init_cluster
+RESULTS="$BENCH_WORKDIR/results"
+: > "$RESULTS"
+
+bench_start none ""
+bench_log "pgbench -i -s $SCALE"
+pgbench -i -q -s "$SCALE" > "$BENCH_WORKDIR/pgbench_init.log" 2>&1 ||
+  bench_die "pgbench -i failed, see $BENCH_WORKDIR/pgbench_init.log"
+bench_stop
+
+#
+# Waits until $2 sessions of application $1 are connected
+#
+memory_wait_sessions() {
+  local app=$1 sessions=$2 tries=0
+
+  while [ "$(psql -XAtc "SELECT count(*) FROM pg_stat_activity WHERE application_name = '$app'")" -lt "$sessions" ]; do
+    tries=$(( tries + 1 ))
+    [ "$tries" -lt 600 ] || bench_die "only some of the $sessions $app sessions connected"
+    sleep 0.5
+  done
+}
+
+#
+# Average Rss, Pss and private kB of the backends of application $1, from
+# /proc/<pid>/smaps_rollup
+#
+memory_backends() {
+  local app=$1 pid
+
+  for pid in $(psql -XAtc "SELECT pid FROM pg_stat_activity WHERE application_name = '$app'"); do
+    cat "/proc/$pid/smaps_rollup" 2> /dev/null || true
+  done | awk '
+    $1 == "Rss:" { rss += $2; n++ }
+    $1 == "Pss:" { pss += $2 }
+    $1 == "Private_Clean:" || $1 == "Private_Dirty:" { priv += $2 }
+    END { printf "%d %.1f %.1f %.1f\n", n, n ? rss / n : 0, n ? pss / n : 0, n ? priv / n : 0 }'
+}
+
+# pgaudit alone writing to the server log is the baseline
+for mode in stderr pgauditlogtofile; do
+  for sessions in $SESSIONS; do
+    bench_start "$mode" read
+    if [ "$mode" = "pgauditlogtofile" ]; then
+      psql -Xq -c "CREATE EXTENSION IF NOT EXISTS pgauditlogtofile" > /dev/null
+    fi
+    threads=$(( sessions < NPROC ? sessions : NPROC ))
+
+    bench_log "$mode $sessions idle and $sessions active sessions"
+    PGAPPNAME=bench_idle pgbench -n -c "$sessions" -j "$threads" -T 3600 \
+      -f "$BENCH_DIR/pgbench/idle.sql" > "$BENCH_WORKDIR/idle.log" 2>&1 &
+    idle_pid=$!
+    memory_wait_sessions bench_idle "$sessions"
+
+    PGAPPNAME=bench_active pgbench -n -M prepared -c "$sessions" -j "$threads" -T 3600 \
+      "${script_opt[@]}" > "$BENCH_WORKDIR/active.log" 2>&1 &
+    active_pid=$!
+    memory_wait_sessions bench_active "$sessions"
+    sleep "$WARMUP"
+
+    echo "$mode $sessions idle $(memory_backends bench_idle)" >> "$RESULTS"
+    echo "$mode $sessions active $(memory_backends bench_active)" >> "$RESULTS"
+    if [ "$mode" = "pgauditlogtofile" ]; then
+      # pg_shmem_allocations exists from PostgreSQL 13
+      shmem=$(psql -XAtc "SELECT coalesce(sum(allocated_size), 0) FROM pg_shmem_allocations WHERE name LIKE 'pgauditlogtofile%'" 2> /dev/null || echo NaN)
+      memory=$(psql -XAtc "SELECT memory_bytes FROM pgauditlogtofile_stats" 2> /dev/null || echo NaN)
+      echo "$mode $sessions shared $shmem $memory" >> "$RESULTS"
+    fi
+
+    kill "$idle_pid" "$active_pid" 2> /dev/null || true
+    wait "$idle_pid" "$active_pid" 2> /dev/null || true
+    bench_stop
+  done
+done
+
+printf 'sessions\tstate\tbackends\trss_kB\tpss_kB\tprivate_kB\trss_delta_kB\tpss_delta_kB\tprivate_delta_kB\tshmem_bytes\taudit_context_bytes\n'
+awk '
+  $3 == "shared" { shmem[$2] = $4; memory[$2] = $5; next }
+  $1 == "stderr" { base[$2, $3] = $5 " " $6 " " $7; next }
+  { rows[++n] = $0 }
+  END {
+    for (i = 1; i <= n; i++) {
+      split(rows[i], r, " ")
+      split(base[r[2], r[3]], b, " ")
+      printf "%s\t%s\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%s\t%s\n",
+        r[2], r[3], r[4], r[5], r[6], r[7], r[5] - b[1], r[6] - b[2], r[7] - b[3],
+        shmem[r[2]], memory[r[2]]
+    }
+  }' "$RESULTS"
@@ -0,0 +1,4 @@
+-- One audited read and then idle, the session keeps its audit state
+\set aid random(1, 100000 * :scale)
+SELECT abalance FROM pgbench_accounts WHERE aid = :aid;
+\sleep 3600 s
@@ -0,0 +1,4 @@
+-- Reads with a long statement text, the audit line is dominated by the SQL
+\set aid random(1, 100000 * :scale)
+\set bid random(1, 1 * :scale)
+SELECT a.aid, a.bid, a.abalance, b.bbalance, substr(a.filler, 1, 10) AS account_filler, substr(b.filler, 1, 10) AS branch_filler, (SELECT count(*) FROM pgbench_tellers t WHERE t.bid = b.bid AND t.tbalance > 0) AS active_tellers, CASE WHEN a.abalance > 0 THEN 'credit' WHEN a.abalance < 0 THEN 'debit' ELSE 'zero' END AS balance_state FROM pgbench_accounts a JOIN pgbench_branches b ON b.bid = a.bid WHERE a.aid = :aid AND b.bid = :bid OR a.aid = :aid + 1;
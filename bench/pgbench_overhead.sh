@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+#
+# pgbench_overhead.sh
+#      TPS and latency cost of writing the audit log, per destination,
+#      pgaudit.log setting, workload and number of clients
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+. "$BENCH_DIR/common.sh"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -c CLIENTS   client counts (default "1 2 4 8 16 32 64 128 256")
+  -l SETTINGS  pgaudit.log settings (default "read,write all")
+  -m MODES     audit destinations (default "$BENCH_ALL_MODES")
+  -o FILE      results table (default stdout)
+  -s SCALE     pgbench scale factor (default 10)
+  -T SECONDS   duration of every run (default 30)
+  -w WORKLOADS builtin scripts or files in bench/pgbench without .sql
+               (default "tpcb-like select-only long_statement")
+EOF
+  exit 1
+}
+
+CLIENTS="1 2 4 8 16 32 64 128 256"
+SETTINGS="read,write all"
+MODES=$BENCH_ALL_MODES
+OUTPUT=
+SCALE=10
+DURATION=30
+WORKLOADS="tpcb-like select-only long_statement"
+
+while getopts "c:l:m:o:s:T:w:" opt; do
+  case "$opt" in
+    c) CLIENTS=$OPTARG ;;
+    l) SETTINGS=$OPTARG ;;
+    m) MODES=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    s) SCALE=$OPTARG ;;
+    T) DURATION=$OPTARG ;;
+    w) WORKLOADS=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+NPROC=$(nproc 2> /dev/null || echo 4)
+
+bench_init_cluster
+
+# Same data for every run
+bench_start none ""
+bench_log "pgbench -i -s $SCALE"
+pgbench -i -q -s "$SCALE" > "$BENCH_WORKDIR/pgbench_init.log" 2>&1 ||
+  bench_die "pgbench -i failed, see $BENCH_WORKDIR/pgbench_init.log"
+bench_stop
+
+printf 'mode\tpgaudit_log\tworkload\tclients\ttps\tlatency_p50_ms\tlatency_p99_ms\taudit_bytes\taudit_bytes_per_s\n'
+
+for mode in $MODES; do
+  if [ "$mode" = "none" ]; then
+    mode_settings="-"
+  else
+    mode_settings=$SETTINGS
+  fi
+
+  for setting in $mode_settings; do
+    bench_start "$mode" "$setting"
+
+    for workload in $WORKLOADS; do
+      if [ -f "$BENCH_DIR/pgbench/$workload.sql" ]; then
+        script_opt=(-f "$BENCH_DIR/pgbench/$workload.sql")
+      else
+        script_opt=(-b "$workload")
+      fi
+
+      for clients in $CLIENTS; do
+        threads=$(( clients < NPROC ? clients : NPROC ))
+        logdir="$BENCH_WORKDIR/pgbench_log"
+        rm -rf "$logdir"
+        mkdir -p "$logdir"
+
+        bench_log "$mode pgaudit.log=$setting $workload clients=$clients"
+        bytes_before=$(bench_audit_bytes)
+        out=$(cd "$logdir" && pgbench -n -M prepared -c "$clients" -j "$threads" -T "$DURATION" \
+                -l --log-prefix=tx "${script_opt[@]}" 2>&1) ||
+          bench_die "pgbench failed: $out"
+        bytes_after=$(bench_audit_bytes)
+
+        # last tps line excludes the connection time in every version
+        tps=$(echo "$out" | awk '/^tps = / { tps = $3 } END { print tps }')
+        # third column of the transaction log is the latency in us
+        cat "$logdir"/tx.* | awk '{ print $3 / 1000 }' > "$logdir/latency"
+        percentiles=$(bench_percentiles "$logdir/latency" 50 99)
+        audit_bytes=$(( bytes_after - bytes_before ))
+
+        printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+          "$mode" "$setting" "$workload" "$clients" "$tps" "$percentiles" \
+          "$audit_bytes" "$(( audit_bytes / DURATION ))"
+      done
+    done
+
+    bench_stop
+  done
+done
@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+#
+# pgo.sh
+#      profile guided build of pgauditlogtofile trained with the formatter
+#      and replay benchmarks, and its speedup over the regular build
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SRC_DIR=$(cd "$BENCH_DIR/.." && pwd)
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -f CORPUS      corpus of bench/bench_format (default built-in)
+  -n RECORDS     records per bench/bench_format benchmark (default 1000000)
+  -o FILE        results table (default stdout)
+  -r FILES       audit files replayed by bench/replay (default none)
+  -R RUNS        runs of every benchmark, the best one is kept (default 3)
+EOF
+  exit 1
+}
+
+CORPUS=
+RECORDS=1000000
+OUTPUT=
+REPLAY_FILES=
+RUNS=3
+
+while getopts "f:n:o:r:R:" opt; do
+  case "$opt" in
+    f) CORPUS=$OPTARG ;;
+    n) RECORDS=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    r) REPLAY_FILES=$OPTARG ;;
+    R) RUNS=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/pgauditlogtofile-pgo.XXXXXX")
+trap 'rm -rf "$WORKDIR"' EXIT
+
+FORMAT_OPTS="-n $RECORDS"
+if [ -n "$CORPUS" ]; then
+  FORMAT_OPTS="$FORMAT_OPTS -f $CORPUS"
+fi
+
+pgo_log() {
+  echo "$(date '+%H:%M:%S') $*" >&2
+}
+
+pgo_make() {
+  make -s -C "$SRC_DIR" clean > /dev/null
+  make -s -C "$SRC_DIR" "$@" all bench/bench_format bench/replay > "$WORKDIR/make.log" 2>&1 || {
+    cat "$WORKDIR/make.log" >&2
+    exit 1
+  }
+}
+
+#
+# Runs the workloads, as "benchmark metric value" lines keeping the best run
+#
+pgo_run() {
+  local build=$1 run
+
+  for run in $(seq "$RUNS"); do
+    # shellcheck disable=SC2086
+    "$BENCH_DIR/bench_format" $FORMAT_OPTS 2> /dev/null |
+      awk 'NR > 1 { print $1, "ns/record", $3 }'
+    if [ -n "$REPLAY_FILES" ]; then
+      # shellcheck disable=SC2086
+      "$BENCH_DIR/replay" -F $REPLAY_FILES 2> /dev/null |
+        awk 'BEGIN { FS = "\t" } NR > 1 { print "replay", "format_ns/record", $8; print "replay", "write_ns/record", $9 }'
+    fi
+  done | awk '
+    !(($1, $2) in best) || $3 < best[$1, $2] { best[$1, $2] = $3 }
+    END { for (k in best) { split(k, p, SUBSEP); print p[1], p[2], best[k] } }' |
+    sort > "$WORKDIR/$build"
+}
+
+pgo_log "regular build"
+pgo_make
+pgo_run baseline
+
+pgo_log "instrumented build"
+rm -rf "$SRC_DIR/pgo-profile"
+pgo_make PGO=generate
+pgo_log "training"
+RUNS=1 pgo_run training
+if ls "$SRC_DIR"/pgo-profile/*.profraw > /dev/null 2>&1; then
+  llvm-profdata merge -output="$SRC_DIR/pgo-profile/default.profdata" "$SRC_DIR"/pgo-profile/*.profraw
+fi
+
+pgo_log "profile guided build"
+pgo_make PGO=use
+pgo_run pgo
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+printf 'benchmark\tmetric\tregular\tpgo\tdelta_pct\n'
+join <(awk '{ print $1 ":" $2, $3 }' "$WORKDIR/baseline") <(awk '{ print $1 ":" $2, $3 }' "$WORKDIR/pgo") |
+  awk '{
+    split($1, k, ":")
+    printf "%s\t%s\t%.1f\t%.1f\t%+.1f\n", k[1], k[2], $2, $3, ($2 > 0 ? ($3 - $2) * 100 / $2 : 0)
+  }'
+
+pgo_log "the tree is left with the profile guided build, install it with: make install PGO=use"
@@ -0,0 +1,582 @@
+/*-------------------------------------------------------------------------
+ *
+ * replay.c
+ *      replays the records of existing audit files through the formatter
+ *      and the writer of the emit_log path
+ *
+ * The audit files are loaded and parsed before the replay starts. Every
+ * record becomes an ErrorData with its original message (pgaudit messages
+ * get their "AUDIT: " prefix back) and the session of the record (user,
+ * database, remote host and application) is set before formatting it, so
+ * the statement sizes and the interleaving of the sessions are kept. The
+ * sessions are spread over -j worker processes appending to the same file,
+ * and every record goes through the classifier, create_audit_line and an
+ * fwrite + fflush, as done by the extension.
+ *
+ * By default the records are replayed with their original inter-arrival
+ * times (-x speeds them up), -F replays them as fast as possible.
+ *
+ * The process id and the session start time of the output lines are the
+ * ones of the worker, and the line numbers count the records of the worker.
+ *
+ * A number after the application name is taken as the sequence number of
+ * pgaudit.log_sequence and left out, so numeric application names are not
+ * kept. The records written in the minimal layout of pgaudit.log_degrade_*
+ * have no statement to replay and are skipped.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "logtofile_format.h"
+#include "bench.h"
+
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defines */
+#define REPLAY_FILE_BUFFER_SIZE 131072
+/* Fields of an audit line before and after the message */
+#define REPLAY_PREFIX_FIELDS 12
+#define REPLAY_SUFFIX_FIELDS 9
+#define REPLAY_FIELD_USER 1
+#define REPLAY_FIELD_DATABASE 2
+#define REPLAY_FIELD_HOST 4
+#define REPLAY_FIELD_SESSION 5
+/* Fields of a record in the minimal layout, without sequence number */
+#define REPLAY_MINIMAL_FIELDS 10
+#define REPLAY_MINIMAL_FIELD_SESSION 1
+#define REPLAY_MAX_FIELDS 256
+/* Write latency histogram, bucket i counts latencies below 2^i us */
+#define REPLAY_LATENCY_BUCKETS 32
+
+typedef struct replay_session {
+  char *id;
+  char *user_name;
+  char *database_name;
+  char *remote_host;
+  char *remote_port;
+  char *application_name;
+} replay_session;
+
+typedef struct replay_record {
+  int64 offset_us; /* since the first record */
+  int64 seq;       /* order in the files, for records with the same time */
+  int session;
+  char *message;
+  int exclude_nchars;
+} replay_record;
+
+/* Results of a worker, in shared memory */
+typedef struct replay_result {
+  uint64 records;
+  uint64 in_bytes;
+  uint64 out_bytes;
+  uint64 format_ns;
+  uint64 write_ns;
+  uint64 lag_max_us;
+  uint64 write_latency[REPLAY_LATENCY_BUCKETS];
+  int failed;
+} replay_result;
+
+/* Options */
+static bool fast = false;
+static double speed = 1.0;
+static int num_workers = 1;
+static const char *output = "/dev/null";
+
+/* Corpus */
+static replay_record *records = NULL;
+static int64 num_records = 0;
+static int64 max_records = 0;
+static replay_session *sessions = NULL;
+static int num_sessions = 0;
+static int max_sessions = 0;
+/* Open addressing hash of the session ids */
+static int *session_hash = NULL;
+static int session_hash_size = 0;
+
+/* Internal functions */
+static int64 replay_now_us(void);
+static int replay_split(char *record, char **fields, int *lengths);
+static char *replay_field(char *field, int len);
+static bool replay_is_number(const char *field, int len);
+static bool replay_is_minimal(char **fields, int *lengths, int num_fields);
+static int64 replay_parse_time(const char *field);
+static uint32 replay_session_hash(const char *id, int len);
+static int replay_session_lookup(char **fields, int *lengths, int num_fields);
+static void replay_load_file(const char *path);
+static int replay_record_cmp(const void *lhs, const void *rhs);
+static void replay_worker(int worker, replay_result *result);
+static double replay_latency_percentile(const uint64 *buckets, double pct);
+
+
+/*
+ * Real time clock in microseconds
+ */
+static inline int64 replay_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Splits an audit line in its fields, keeping the quotes. Returns the number
+ * of fields.
+ */
+static int replay_split(char *record, char **fields, int *lengths) {
+  char *p = record;
+  int n = 0;
+
+  while (n < REPLAY_MAX_FIELDS) {
+    fields[n] = p;
+    if (*p == '"') {
+      for (p++; *p != '\0'; p++) {
+        if (*p == '"') {
+          if (p[1] != '"') {
+            p++;
+            break;
+          }
+          p++;
+        }
+      }
+    }
+    while (*p != '\0' && *p != ',')
+      p++;
+    lengths[n] = p - fields[n];
+    n++;
+
+    if (*p == '\0')
+      break;
+    p++;
+  }
+
+  return n;
+}
+
+static char *replay_field(char *field, int len) {
+  return pnstrdup(field, len);
+}
+
+/*
+ * Checks if a field is an unsigned number
+ */
+static bool replay_is_number(const char *field, int len) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (!isdigit((unsigned char) field[i]))
+      return false;
+  }
+  return len > 0;
+}
+
+/*
+ * Checks if a record is in the minimal layout: the session id, hex start
+ * time . hex process id, in place of the user name
+ */
+static bool replay_is_minimal(char **fields, int *lengths, int num_fields) {
+  const char *id = fields[REPLAY_MINIMAL_FIELD_SESSION];
+  int len = lengths[REPLAY_MINIMAL_FIELD_SESSION];
+  int i, dots = 0;
+
+  if (num_fields != REPLAY_MINIMAL_FIELDS && num_fields != REPLAY_MINIMAL_FIELDS + 1)
+    return false;
+
+  for (i = 0; i < len; i++) {
+    if (id[i] == '.')
+      dots++;
+    else if (!isxdigit((unsigned char) id[i]))
+      return false;
+  }
+  return dots == 1 && len > 2;
+}
+
+/*
+ * Microseconds since the epoch of "YYYY-MM-DD HH:MM:SS.mmm", the timezone
+ * is ignored since only the differences are used
+ */
+static int64 replay_parse_time(const char *field) {
+  struct tm tm;
+  int ms = 0;
+
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(field, "%d-%d-%d %d:%d:%d.%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) < 6)
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+
+  return (int64) timegm(&tm) * 1000000 + ms * 1000;
+}
+
+/*
+ * djb2 hash of a session id
+ */
+static uint32 replay_session_hash(const char *id, int len) {
+  uint32 h = 5381;
+  int i;
+
+  for (i = 0; i < len; i++)
+    h = h * 33 + (unsigned char) id[i];
+  return h;
+}
+
+/*
+ * Index of the session of a record, adding it if it is new
+ */
+static int replay_session_lookup(char **fields, int *lengths, int num_fields) {
+  const char *id = fields[REPLAY_FIELD_SESSION];
+  int len = lengths[REPLAY_FIELD_SESSION];
+  int slot;
+  replay_session *session;
+  char *host, *port;
+
+  if (num_sessions * 2 >= session_hash_size) {
+    /* grow and rehash */
+    int j;
+
+    if (session_hash)
+      pfree(session_hash);
+    session_hash_size = session_hash_size ? session_hash_size * 2 : 1024;
+    session_hash = palloc(session_hash_size * sizeof(int));
+    memset(session_hash, -1, session_hash_size * sizeof(int));
+    for (j = 0; j < num_sessions; j++) {
+      for (slot = replay_session_hash(sessions[j].id, strlen(sessions[j].id)) % session_hash_size;
+           session_hash[slot] >= 0;
+           slot = (slot + 1) % session_hash_size)
+        ;
+      session_hash[slot] = j;
+    }
+  }
+
+  for (slot = replay_session_hash(id, len) % session_hash_size; session_hash[slot] >= 0; slot = (slot + 1) % session_hash_size) {
+    session = &sessions[session_hash[slot]];
+    if (strncmp(session->id, id, len) == 0 && session->id[len] == '\0')
+      return session_hash[slot];
+  }
+
+  if (num_sessions == max_sessions) {
+    max_sessions = max_sessions ? max_sessions * 2 : 1024;
+    sessions = sessions ? repalloc(sessions, max_sessions * sizeof(replay_session)) : palloc(max_sessions * sizeof(replay_session));
+  }
+
+  session = &sessions[num_sessions];
+  session->id = replay_field(fields[REPLAY_FIELD_SESSION], len);
+  session->user_name = replay_field(fields[REPLAY_FIELD_USER], lengths[REPLAY_FIELD_USER]);
+  session->database_name = replay_field(fields[REPLAY_FIELD_DATABASE], lengths[REPLAY_FIELD_DATABASE]);
+  host = replay_field(fields[REPLAY_FIELD_HOST], lengths[REPLAY_FIELD_HOST]);
+  port = strrchr(host, ':');
+  if (port != NULL)
+    *port++ = '\0';
+  session->remote_host = host;
+  session->remote_port = port ? port : "";
+  session->application_name = replay_field(fields[num_fields - 1], lengths[num_fields - 1]);
+  session_hash[slot] = num_sessions;
+
+  return num_sessions++;
+}
+
+/*
+ * Loads the records of an audit file
+ */
+static void replay_load_file(const char *path) {
+  FILE *fp;
+  struct stat st;
+  char *data, *p, *end, *record;
+  char *fields[REPLAY_MAX_FIELDS];
+  int lengths[REPLAY_MAX_FIELDS];
+  bool quoted;
+  int64 minimal = 0;
+  int n;
+
+  fp = fopen(path, "r");
+  if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+  data = palloc(st.st_size + 1);
+  if (fread(data, 1, st.st_size, fp) != (size_t) st.st_size) {
+    fprintf(stderr, "could not read \"%s\": %s\n", path, strerror(errno));
+    exit(1);
+  }
+  data[st.st_size] = '\0';
+  fclose(fp);
+
+  for (p = data, end = data + st.st_size; p < end; p++) {
+    /* a record ends at a newline outside quotes */
+    record = p;
+    for (quoted = false; p < end && (quoted || *p != '\n'); p++) {
+      if (*p == '"')
+        quoted = !quoted;
+    }
+    *p = '\0';
+
+    n = replay_split(record, fields, lengths);
+    if (replay_is_minimal(fields, lengths, n)) {
+      minimal++;
+      continue;
+    }
+    /* the sequence number of pgaudit.log_sequence */
+    if (n > REPLAY_PREFIX_FIELDS + 1 + REPLAY_SUFFIX_FIELDS && replay_is_number(fields[n - 1], lengths[n - 1]))
+      n--;
+    if (n < REPLAY_PREFIX_FIELDS + 1 + REPLAY_SUFFIX_FIELDS) {
+      fprintf(stderr, "%s: skipping record with %d fields\n", path, n);
+      continue;
+    }
+
+    if (num_records == max_records) {
+      max_records = max_records ? max_records * 2 : 65536;
+      records = records ? repalloc(records, max_records * sizeof(replay_record)) : palloc(max_records * sizeof(replay_record));
+    }
+
+    records[num_records].offset_us = replay_parse_time(fields[0]);
+    if (records[num_records].offset_us < 0) {
+      fprintf(stderr, "%s: skipping record without timestamp\n", path);
+      continue;
+    }
+    records[num_records].seq = num_records;
+    records[num_records].session = replay_session_lookup(fields, lengths, n);
+
+    /* the message spans from the 13th field to the last 9 */
+    {
+      char *msg_start = fields[REPLAY_PREFIX_FIELDS];
+      char *msg_end = fields[n - REPLAY_SUFFIX_FIELDS - 1] + lengths[n - REPLAY_SUFFIX_FIELDS - 1];
+      int msg_len = msg_end - msg_start;
+
+      if (strncmp(msg_start, "SESSION,", 8) == 0 || strncmp(msg_start, "OBJECT,", 7) == 0) {
+        records[num_records].message = psprintf("%s%.*s", PGAUDIT_PREFIX_LINE, msg_len, msg_start);
+        records[num_records].exclude_nchars = PGAUDIT_PREFIX_LINE_LENGTH;
+      } else {
+        records[num_records].message = pnstrdup(msg_start, msg_len);
+        records[num_records].exclude_nchars = 0;
+      }
+    }
+    num_records++;
+  }
+
+  if (minimal > 0)
+    fprintf(stderr, "%s: skipped " INT64_FORMAT " records in the minimal layout of pgaudit.log_degrade_*, their statements are not in the file\n",
+            path, minimal);
+
+  pfree(data);
+}
+
+/*
+ * Orders by time and then by position in the files
+ */
+static int replay_record_cmp(const void *lhs, const void *rhs) {
+  const replay_record *l = lhs;
+  const replay_record *r = rhs;
+
+  if (l->offset_us != r->offset_us)
+    return l->offset_us < r->offset_us ? -1 : 1;
+  return l->seq < r->seq ? -1 : (l->seq > r->seq);
+}
+
+/*
+ * Replays the records of the sessions of a worker
+ */
+static void replay_worker(int worker, replay_result *result) {
+  pgAuditLogToFilePrefix **conn, **disconn;
+  size_t num_conn, num_disconn;
+  ErrorData edata;
+  FILE *fp;
+  char *file_buffer;
+  int64 start_us, now_us, target_us, t0, t1, t2;
+  int64 i;
+  int bucket;
+
+  fp = fopen(output, "a");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\": %s\n", output, strerror(errno));
+    result->failed = 1;
+    return;
+  }
+  file_buffer = palloc(REPLAY_FILE_BUFFER_SIZE);
+  setvbuf(fp, file_buffer, _IOFBF, REPLAY_FILE_BUFFER_SIZE);
+
+  bench_stubs_init();
+  conn = pgauditlogtofile_build_prefixes(false, &num_conn, palloc);
+  disconn = pgauditlogtofile_build_prefixes(true, &num_disconn, palloc);
+
+  memset(&edata, 0, sizeof(edata));
+  edata.elevel = LOG;
+  edata.hide_stmt = true;
+
+  start_us = replay_now_us();
+  for (i = 0; i < num_records; i++) {
+    replay_record *record = &records[i];
+    replay_session *session = &sessions[record->session];
+    StringInfoData buf;
+
+    if (record->session % num_workers != worker)
+      continue;
+
+    if (!fast) {
+      target_us = start_us + (int64) (record->offset_us / speed);
+      now_us = replay_now_us();
+      if (now_us < target_us)
+        usleep(target_us - now_us);
+      else if ((uint64) (now_us - target_us) > result->lag_max_us)
+        result->lag_max_us = now_us - target_us;
+    }
+
+    bench_stubs_set_session(session->user_name, session->database_name,
+                            session->remote_host, session->remote_port,
+                            session->application_name);
+    edata.message = record->message;
+
+    t0 = replay_now_us();
+    /* classification done by emit_log */
+    if (pg_strncasecmp(edata.message, PGAUDIT_PREFIX_LINE, PGAUDIT_PREFIX_LINE_LENGTH) != 0 &&
+        !pgauditlogtofile_match_prefix(edata.message, conn, num_conn) &&
+        !pgauditlogtofile_match_prefix(edata.message, disconn, num_disconn))
+      continue;
+
+    initStringInfo(&buf);
+    pgauditlogtofile_create_audit_line(&buf, &edata, record->exclude_nchars);
+    t1 = replay_now_us();
+    if (fwrite(buf.data, 1, buf.len, fp) != (size_t) buf.len || fflush(fp) != 0) {
+      fprintf(stderr, "could not write \"%s\": %s\n", output, strerror(errno));
+      result->failed = 1;
+      break;
+    }
+    t2 = replay_now_us();
+
+    result->records++;
+    result->in_bytes += strlen(edata.message + record->exclude_nchars);
+    result->out_bytes += buf.len;
+    result->format_ns += (t1 - t0) * 1000;
+    result->write_ns += (t2 - t1) * 1000;
+    for (bucket = 0; bucket < REPLAY_LATENCY_BUCKETS - 1 && (t2 - t1) >= (INT64CONST(1) << bucket); bucket++)
+      ;
+    result->write_latency[bucket]++;
+    pfree(buf.data);
+  }
+
+  fclose(fp);
+}
+
+/*
+ * Upper bound in us of the bucket holding the percentile
+ */
+static double replay_latency_percentile(const uint64 *buckets, double pct) {
+  uint64 total = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < REPLAY_LATENCY_BUCKETS; i++)
+    total += buckets[i];
+  for (i = 0; i < REPLAY_LATENCY_BUCKETS; i++) {
+    seen += buckets[i];
+    if (total > 0 && seen >= total * pct / 100)
+      return (double) (INT64CONST(1) << i);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  replay_result *results, total;
+  int64 start_us, elapsed_us, first_us, k;
+  int c, i, j, status;
+
+  while ((c = getopt(argc, argv, "Fj:o:x:")) != -1) {
+    switch (c) {
+    case 'F':
+      fast = true;
+      break;
+    case 'j':
+      num_workers = atoi(optarg);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'x':
+      speed = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-F] [-j workers] [-o output] [-x speed] audit_file...\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind >= argc || num_workers <= 0 || speed <= 0) {
+    fprintf(stderr, "usage: %s [-F] [-j workers] [-o output] [-x speed] audit_file...\n", argv[0]);
+    exit(1);
+  }
+
+  for (i = optind; i < argc; i++)
+    replay_load_file(argv[i]);
+  if (num_records == 0) {
+    fprintf(stderr, "no records found\n");
+    exit(1);
+  }
+  qsort(records, num_records, sizeof(replay_record), replay_record_cmp);
+  /* offsets relative to the first record of all the files */
+  for (first_us = records[0].offset_us, k = 0; k < num_records; k++)
+    records[k].offset_us -= first_us;
+  fprintf(stderr, "loaded " INT64_FORMAT " records of %d sessions, " INT64_FORMAT " s of audit\n",
+          num_records, num_sessions, records[num_records - 1].offset_us / 1000000);
+
+  results = mmap(NULL, num_workers * sizeof(replay_result), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    fprintf(stderr, "could not map results: %s\n", strerror(errno));
+    exit(1);
+  }
+  memset(results, 0, num_workers * sizeof(replay_result));
+
+  fflush(stdout);
+  fflush(stderr);
+  start_us = replay_now_us();
+  for (i = 0; i < num_workers; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      fprintf(stderr, "could not fork: %s\n", strerror(errno));
+      exit(1);
+    } else if (pid == 0) {
+      replay_worker(i, &results[i]);
+      exit(results[i].failed);
+    }
+  }
+  for (i = 0; i < num_workers; i++)
+    wait(&status);
+  elapsed_us = replay_now_us() - start_us;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < num_workers; i++) {
+    total.records += results[i].records;
+    total.in_bytes += results[i].in_bytes;
+    total.out_bytes += results[i].out_bytes;
+    total.format_ns += results[i].format_ns;
+    total.write_ns += results[i].write_ns;
+    total.lag_max_us = Max(total.lag_max_us, results[i].lag_max_us);
+    total.failed |= results[i].failed;
+    for (j = 0; j < REPLAY_LATENCY_BUCKETS; j++)
+      total.write_latency[j] += results[i].write_latency[j];
+  }
+
+  printf("records\tsessions\tworkers\telapsed_s\trecords_per_s\tin_bytes_per_record\tout_bytes_per_record\tformat_ns_per_record\twrite_ns_per_record\twrite_p99_us\twrite_p999_us\tlag_max_ms\n");
+  printf(UINT64_FORMAT "\t%d\t%d\t%.3f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.0f\t%.0f\t%.3f\n",
+         total.records, num_sessions, num_workers,
+         elapsed_us / 1e6,
+         total.records / (elapsed_us / 1e6),
+         total.records ? (double) total.in_bytes / total.records : 0,
+         total.records ? (double) total.out_bytes / total.records : 0,
+         total.records ? (double) total.format_ns / total.records : 0,
+         total.records ? (double) total.write_ns / total.records : 0,
+         replay_latency_percentile(total.write_latency, 99),
+         replay_latency_percentile(total.write_latency, 99.9),
+         total.lag_max_us / 1000.0);
+
+  return total.failed;
+}
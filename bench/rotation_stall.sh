@@ -0,0 +1,127 @@
+#!/usr/bin/env bash
+#
+# rotation_stall.sh
+#      latency of the audit hook around file rotations under many writers
+#
+# Needs pgauditlogtofile built and installed with the test clock:
+#   make install TEST_CLOCK=1
+#
+# Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+#
+# This code is released under the PostgreSQL licence, as given at
+#  http://www.postgresql.org/about/licence/
+#
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+. "$BENCH_DIR/common.sh"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [options]
+  -c CLIENTS   concurrent writers (default 500)
+  -o FILE      results table (default stdout)
+  -r SCALE     test clock speed, a rotation every 60/SCALE seconds (default 20)
+  -s SCALE     pgbench scale factor (default 10)
+  -T SECONDS   duration of the run (default 60)
+  -W MS        real milliseconds at each side of a rotation considered
+               around the boundary (default 250)
+EOF
+  exit 1
+}
+
+CLIENTS=500
+OUTPUT=
+CLOCK_SCALE=20
+SCALE=10
+DURATION=60
+WINDOW_MS=250
+
+while getopts "c:o:r:s:T:W:" opt; do
+  case "$opt" in
+    c) CLIENTS=$OPTARG ;;
+    o) OUTPUT=$OPTARG ;;
+    r) CLOCK_SCALE=$OPTARG ;;
+    s) SCALE=$OPTARG ;;
+    T) DURATION=$OPTARG ;;
+    W) WINDOW_MS=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+
+if [ -n "$OUTPUT" ]; then
+  exec > "$OUTPUT"
+fi
+
+NPROC=$(nproc 2> /dev/null || echo 4)
+# pgaudit.log_rotation_age = 1 minute of the test clock
+PERIOD_US=60000000
+
+BENCH_MAX_CONNECTIONS=$(( CLIENTS + 20 ))
+bench_init_cluster
+TRACE_DIR="$BENCH_WORKDIR/trace"
+mkdir -p "$TRACE_DIR"
+
+bench_start none ""
+bench_log "pgbench -i -s $SCALE"
+pgbench -i -q -s "$SCALE" > "$BENCH_WORKDIR/pgbench_init.log" 2>&1 ||
+  bench_die "pgbench -i failed, see $BENCH_WORKDIR/pgbench_init.log"
+bench_stop
+
+bench_start pgauditlogtofile read "$(printf '%s\n' \
+  "log_timezone = 'UTC'" \
+  "pgaudit.log_rotation_age = 1" \
+  "pgaudit.log_filename = 'audit-%Y%m%d_%H%M.log'" \
+  "pgaudit.log_test_clock_scale = $CLOCK_SCALE" \
+  "pgaudit.log_test_trace_directory = '$TRACE_DIR'")"
+
+if [ "$(psql -XAtc "SELECT count(*) FROM pg_settings WHERE name = 'pgaudit.log_test_clock_scale'")" != "1" ]; then
+  bench_die "pgauditlogtofile was not built with TEST_CLOCK=1"
+fi
+
+psql -Xq -c "CREATE EXTENSION IF NOT EXISTS pgauditlogtofile" > /dev/null
+
+bench_log "$CLIENTS writers for $DURATION s, a rotation every $(( 60 / CLOCK_SCALE )) s"
+pgbench -n -S -M prepared -c "$CLIENTS" -j "$(( CLIENTS < NPROC ? CLIENTS : NPROC ))" -T "$DURATION" \
+  > "$BENCH_WORKDIR/pgbench.log" 2>&1 || bench_die "pgbench failed, see $BENCH_WORKDIR/pgbench.log"
+file_opens=$(psql -XAtc "SELECT file_opens FROM pgauditlogtofile_stats" 2> /dev/null || echo NaN)
+bench_stop
+
+# Trace lines: test clock us, hook latency us, files opened
+window_us=$(( WINDOW_MS * 1000 * CLOCK_SCALE ))
+cat "$TRACE_DIR"/trace.* | awk -v period="$PERIOD_US" -v window="$window_us" \
+  -v near="$BENCH_WORKDIR/near" -v far="$BENCH_WORKDIR/far" '
+  {
+    d = $1 % period
+    if (d < window || d > period - window)
+      print $2 / 1000 > near
+    else
+      print $2 / 1000 > far
+  }'
+touch "$BENCH_WORKDIR/near" "$BENCH_WORKDIR/far"
+records=$(cat "$TRACE_DIR"/trace.* | wc -l)
+opens=$(cat "$TRACE_DIR"/trace.* | awk '{ s += $3 } END { print s + 0 }')
+files=$(find "$BENCH_AUDIT_DIR" -type f -name 'audit-*.log' | wc -l)
+rotations=$(( files > 1 ? files - 1 : 0 ))
+
+# Every line must start with a timestamp of the minute in the file name
+wrong_file=$(find "$BENCH_AUDIT_DIR" -type f -name 'audit-*.log' -print0 | xargs -0 -r awk '
+  FNR == 1 {
+    name = FILENAME
+    sub(/.*audit-/, "", name)
+    expected = substr(name, 1, 4) "-" substr(name, 5, 2) "-" substr(name, 7, 2) " " \
+               substr(name, 10, 2) ":" substr(name, 12, 2)
+  }
+  /^[0-9][0-9][0-9][0-9]-[0-9][0-9]-[0-9][0-9] / {
+    if (substr($0, 1, 16) != expected) wrong++
+  }
+  END { print wrong + 0 }')
+
+printf 'clients\tclock_scale\trecords\trotations\topens\topens_per_file\tfile_opens_counter\tnear_p999_ms\tnear_max_ms\tfar_p999_ms\tfar_max_ms\twrong_file_records\n'
+printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+  "$CLIENTS" "$CLOCK_SCALE" "$records" "$rotations" "$opens" \
+  "$(awk -v o="$opens" -v f="$files" 'BEGIN { printf "%.1f", (f > 0 ? o / f : 0) }')" \
+  "$file_opens" \
+  "$(bench_percentiles "$BENCH_WORKDIR/near" 99.9 100)" \
+  "$(bench_percentiles "$BENCH_WORKDIR/far" 99.9 100)" \
+  "$wrong_file"
@@ -11,21 +11,31 @@
  *-------------------------------------------------------------------------
  */
 #include "postgres.h"
-#include "access/xact.h"
-#include "libpq/libpq-be.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "postmaster/syslogger.h"
 #include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/pg_shmem.h"
 #include "storage/proc.h"
-#include "tcop/tcopprot.h"
 #include "utils/guc.h"
 #include "utils/memutils.h"
 #include "utils/palloc.h"
-#include "utils/ps_status.h"
 
 #include "logtofile.h"
+#include "logtofile_bgw.h"
+#include "logtofile_block.h"
+#include "logtofile_checkpoint.h"
+#include "logtofile_clock.h"
+#include "logtofile_degrade.h"
+#include "logtofile_digest.h"
+#include "logtofile_format.h"
+#include "logtofile_hold.h"
+#include "logtofile_reorder.h"
+#include "logtofile_seq.h"
+#include "logtofile_stats.h"
+#include "logtofile_tail.h"
+#include "logtofile_topk.h"
 
 #include <sys/stat.h>
 #include <time.h>
@@ -33,9 +43,7 @@
 #include <zlib.h>
 
 /* Defines */
-#define PGAUDIT_PREFIX_LINE "AUDIT: "
-#define PGAUDIT_PREFIX_LINE_LENGTH sizeof(PGAUDIT_PREFIX_LINE) - 1
-#define FORMATTED_TS_LEN 128
+#define AUDIT_FILE_BUFFER_SIZE 131072
 
 /*
  * We really want line-buffered mode for logfile output, but Windows does
@@ -49,50 +57,7 @@
 #endif
 
 
-/* Extracted from src/backend/po */
-static const char * postgresConnMsg[] = {
-  "connection received: host=%s port=%s",
-  "connection received: host=%s",
-  "connection authorized: user=%s",
-  "connection authenticated: identity=\"%s\" method=%s (%s:%d)",
-  "replication connection authorized: user=%s",
-  "replication connection authorized: user=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
-  "replication connection authorized: user=%s application_name=%s",
-  "replication connection authorized: user=%s application_name=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
-  "password authentication failed for user \"%s\"",
-  "authentication failed for user \"%s\": host rejected",
-  "\"trust\" authentication failed for user \"%s\"",
-  "Ident authentication failed for user \"%s\"",
-  "Peer authentication failed for user \"%s\"",
-  "password authentication failed for user \"%s\"",
-  "SSPI authentication failed for user \"%s\"",
-  "PAM authentication failed for user \"%s\"",
-  "BSD authentication failed for user \"%s\"",
-  "LDAP authentication failed for user \"%s\"",
-  "certificate authentication failed for user \"%s\"",
-  "RADIUS authentication failed for user \"%s\"",
-  "authentication failed for user \"%s\": invalid authentication method",
-  "connection authorized: user=%s database=%s",
-  "connection authorized: user=%s database=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
-  "connection authorized: user=%s database=%s application_name=%s",
-  "connection authorized: user=%s database=%s application_name=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
-};
-
-/* Extracted from src/backend/po */
-static const char * postgresDisconnMsg[] = {
-  "disconnection: session time: %d:%02d:%02d.%03d user=%s database=%s host=%s%s%s"
-};
-
-/* Buffers for formatted timestamps */
-static char formatted_start_time[FORMATTED_TS_LEN];
-static char formatted_log_time[FORMATTED_TS_LEN];
-
 /* SHM structure */
-typedef struct pgAuditLogToFilePrefix {
-  char *prefix;
-  int length;
-} pgAuditLogToFilePrefix;
-
 typedef struct pgAuditLogToFileShm {
   LWLock *lock;
   bool force_rotation;
@@ -107,10 +72,17 @@ static bool pgAuditLogToFileShutdown = false;
 
 /* Audit log file handler */
 static FILE *file_handler = NULL;
+static char *file_buffer = NULL;
 static char filename_in_use[MAXPGPATH];
 static char filename[MAXPGPATH];
 pg_time_t next_rotation_time;
 
+/* Memory used by the audit records of this backend */
+static MemoryContext AuditMemoryContext = NULL;
+static MemoryContext AuditRecordMemoryContext = NULL;
+static int64 memory_reported = 0;
+static int memory_pid = 0;
+
 /* GUC variables */
 char *guc_pgaudit_log_directory = NULL;
 char *guc_pgaudit_log_filename = NULL;
@@ -134,7 +106,6 @@ static void pgauditlogtofile_shmem_request(void);
 #endif
 
 /* Internal functions */
-static char ** pgauditlogtofile_unique_prefixes(const char **messages, const size_t num_messages, size_t *num_unique);
 
 static void guc_assign_directory(const char *newval, void *extra);
 static void guc_assign_filename(const char *newval, void *extra);
@@ -145,17 +116,19 @@ static void pgauditlogtofile_request_rotation(void);
 static void pgauditlogtofile_calculate_filename(void);
 static void pgauditlogtofile_calculate_next_rotation_time(void);
 static void pgauditlogtofile_close_file(void);
-static void pgauditlogtofile_create_audit_line(StringInfo buf, const ErrorData *edata, int exclude_nchars);
-static void pgauditlogtofile_format_log_time(void);
-static void pgauditlogtofile_format_start_time(void);
 static bool pgauditlogtofile_is_enabled(void);
 static bool pgauditlogtofile_is_open_file(void);
 static bool pgauditlogtofile_is_prefixed(const char *msg);
 static bool pgauditlogtofile_needs_rotate_file(void);
 static bool pgauditlogtofile_open_file(void);
+static void pgauditlogtofile_init_memory(void);
+static void pgauditlogtofile_memory_shutdown(int code, Datum arg);
 static bool pgauditlogtofile_record_audit(const ErrorData *edata, int exclude_nchars);
+static void pgauditlogtofile_report_memory(void);
+static void pgauditlogtofile_request_shmem(void);
 static void pgauditlogtofile_shmem_shutdown(int code, Datum arg);
 static bool pgauditlogtofile_write_audit(const ErrorData *edata, int exclude_nchars);
+static bool pgauditlogtofile_write_file(const char *data, int len, bool flush);
 
 
 static void pgauditlogtofile_request_rotation(void) {
@@ -240,14 +213,154 @@ void _PG_init(void) {
     &guc_pgaudit_log_disconnections, false, PGC_SIGHUP,
     GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
 
+  DefineCustomIntVariable(
+    "pgaudit.log_stats_max",
+    "Maximum number of statements tracked by the audit statement statistics", NULL,
+    &guc_pgaudit_log_stats_max, 1000, 0, INT_MAX / 2, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_topk",
+    "Number of audit producers tracked in each bucket of the heavy hitters window", NULL,
+    &guc_pgaudit_log_topk, 64, 0, 4096, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_topk_window",
+    "Sliding window in seconds of the audit heavy hitters", NULL,
+    &guc_pgaudit_log_topk_window, 5 * SECS_PER_MINUTE, 10, SECS_PER_DAY, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_S | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_tail_records",
+    "Number of recent audit records kept in memory for pgauditlogtofile_tail", NULL,
+    &guc_pgaudit_log_tail_records, 1000, 0, 1000000, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+    "pgaudit.log_metrics_file",
+    "File where the audit counters are written in Prometheus text format", NULL,
+    &guc_pgaudit_log_metrics_file, "", PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_metrics_interval",
+    "Seconds between writes of the metrics file", NULL,
+    &guc_pgaudit_log_metrics_interval, 15, 1, SECS_PER_MINUTE * MINS_PER_HOUR, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_S | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(
+    "pgaudit.log_sequence",
+    "Appends a cluster wide sequence number to every audit record", NULL,
+    &guc_pgaudit_log_sequence, false, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_sequence_tick",
+    "Seconds without audit records after which a tick record is written", NULL,
+    &guc_pgaudit_log_sequence_tick, 60, 0, SECS_PER_MINUTE * MINS_PER_HOUR, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_S | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_reorder_window",
+    "Milliseconds the audit records are held to write them in timestamp order", NULL,
+    &guc_pgaudit_log_reorder_window, 0, 0, 10000, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_MS | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_reorder_buffer",
+    "Memory used to hold the audit records of the reorder window", NULL,
+    &guc_pgaudit_log_reorder_buffer, 1024, 64, 1048576, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_KB | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_flush_latency",
+    "Longest time the worker batches the audit records due before flushing them", NULL,
+    &guc_pgaudit_log_flush_latency, 0, 0, 10000, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_MS | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_digest_block",
+    "Size of the audit file blocks digested by the background worker", NULL,
+    &guc_pgaudit_log_digest_block, 0, 0, 65536, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_KB | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+    "pgaudit.log_digest_key_file",
+    "File with the HMAC key that signs the digests of each audit file", NULL,
+    &guc_pgaudit_log_digest_key_file, "", PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(
+    "pgaudit.log_compression",
+    "Compression of the blocks of audit records", NULL,
+    &guc_pgaudit_log_compression, PGAUDIT_COMPRESSION_NONE, pgauditlogtofile_compression_options, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_compression_level",
+    "Compression level of the blocks of audit records", NULL,
+    &guc_pgaudit_log_compression_level, PGAUDIT_COMPRESSION_LEVEL_DEFAULT, -1, 22, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(
+    "pgaudit.log_compression_adaptive",
+    "Lowers the compression level of the blocks while the worker falls behind", NULL,
+    &guc_pgaudit_log_compression_adaptive, false, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+    "pgaudit.log_encryption_key_file",
+    "File with the AES-256 key that encrypts the blocks of audit records", NULL,
+    &guc_pgaudit_log_encryption_key_file, "", PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_block_size",
+    "Size of the records in each compressed or encrypted block of the audit file", NULL,
+    &guc_pgaudit_log_block_size, 256, 4, 16384, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_KB | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_checkpoint",
+    "Bytes of the text audit file covered by each CRC32C checkpoint record", NULL,
+    &guc_pgaudit_log_checkpoint, 0, 0, 1048576, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_UNIT_KB | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+    "pgaudit.log_hold_directory",
+    "Directory where the legal hold snapshots of the audit files are kept", NULL,
+    &guc_pgaudit_log_hold_directory, "hold", PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_degrade_backlog",
+    "Percentage of the ring of the worker in use that switches to minimal audit records", NULL,
+    &guc_pgaudit_log_degrade_backlog, 0, 0, 100, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomIntVariable(
+    "pgaudit.log_degrade_latency",
+    "Average microseconds of the logging hook that switch to minimal audit records", NULL,
+    &guc_pgaudit_log_degrade_latency, 0, 0, 10000000, PGC_SIGHUP,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+#ifdef PGAUDITLOGTOFILE_TEST_CLOCK
+  pgauditlogtofile_testclock_init();
+#endif
+
   EmitWarningsOnPlaceholders("pgauditlogtofile");
 
+  if (process_shared_preload_libraries_in_progress) {
+    pgauditlogtofile_block_check();
+    pgauditlogtofile_bgw_register();
+  }
+
 #if (PG_VERSION_NUM >= 150000)
 	prev_shmem_request_hook = shmem_request_hook;
 	shmem_request_hook = pgauditlogtofile_shmem_request;
 #else
-  RequestAddinShmemSpace(MAXALIGN(sizeof(pgAuditLogToFileShm)));
-  RequestNamedLWLockTranche("pgauditlogtofile", 1);
+  pgauditlogtofile_request_shmem();
 #endif
 
   prev_shmem_startup_hook = shmem_startup_hook;
@@ -269,18 +382,29 @@ static void pgauditlogtofile_shmem_request(void) {
   if (prev_shmem_request_hook)
 		prev_shmem_request_hook();
 
+  pgauditlogtofile_request_shmem();
+}
+#endif
+
+/*
+ * Request the SHMEM and locks used by the extension
+ */
+static void pgauditlogtofile_request_shmem(void) {
   RequestAddinShmemSpace(MAXALIGN(sizeof(pgAuditLogToFileShm)));
   RequestNamedLWLockTranche("pgauditlogtofile", 1);
+  pgauditlogtofile_stats_shmem_request();
+  pgauditlogtofile_topk_shmem_request();
+  pgauditlogtofile_tail_shmem_request();
+  pgauditlogtofile_seq_shmem_request();
+  pgauditlogtofile_reorder_shmem_request();
+  pgauditlogtofile_degrade_shmem_request();
 }
-#endif
 
 /*
  * SHMEM startup hook - Initialize SHMEM structure
  */
 static void pgauditlogtofile_shmem_startup(void) {
   bool found;
-  size_t num_messages, i, j;
-  char **prefixes = NULL;
 
   if (prev_shmem_startup_hook)
     prev_shmem_startup_hook();
@@ -292,35 +416,8 @@ static void pgauditlogtofile_shmem_startup(void) {
   pgaudit_log_shm = ShmemInitStruct("pgauditlogtofile", sizeof(pgAuditLogToFileShm), &found);
   if (!found) {
     // Get unique prefixes and copy them to SHMEM
-    num_messages = sizeof(postgresConnMsg) / sizeof(char *);
-    prefixes = pgauditlogtofile_unique_prefixes(postgresConnMsg, num_messages, &pgaudit_log_shm->num_prefixes_connection);
-    pgaudit_log_shm->prefixes_connection = ShmemAlloc(pgaudit_log_shm->num_prefixes_connection * sizeof(pgAuditLogToFilePrefix *));
-    for (i = 0, j = 0; i < num_messages; i++) {
-      if (prefixes != NULL && prefixes[i] != NULL) {
-        pgaudit_log_shm->prefixes_connection[j] = ShmemAlloc(sizeof(pgAuditLogToFilePrefix));
-        pgaudit_log_shm->prefixes_connection[j]->length = strlen(prefixes[i]);
-        pgaudit_log_shm->prefixes_connection[j]->prefix = ShmemAlloc( (pgaudit_log_shm->prefixes_connection[j]->length + 1) * sizeof(char) );
-        strcpy(pgaudit_log_shm->prefixes_connection[j]->prefix, prefixes[i]);
-        pfree(prefixes[i]);
-        j++;
-      }
-    }
-    pfree(prefixes);
-
-    num_messages = sizeof(postgresDisconnMsg) / sizeof(char *);
-    prefixes = pgauditlogtofile_unique_prefixes(postgresDisconnMsg, num_messages, &pgaudit_log_shm->num_prefixes_disconnection);
-    pgaudit_log_shm->prefixes_disconnection = ShmemAlloc(pgaudit_log_shm->num_prefixes_disconnection * sizeof(pgAuditLogToFilePrefix *));
-    for (i = 0, j = 0; i < num_messages; i++) {
-      if (prefixes != NULL && prefixes[i] != NULL) {
-        pgaudit_log_shm->prefixes_disconnection[j] = ShmemAlloc(sizeof(pgAuditLogToFilePrefix));
-        pgaudit_log_shm->prefixes_disconnection[j]->length = strlen(prefixes[i]);
-        pgaudit_log_shm->prefixes_disconnection[j]->prefix = ShmemAlloc( (pgaudit_log_shm->prefixes_disconnection[j]->length + 1) * sizeof(char) );
-        strcpy(pgaudit_log_shm->prefixes_disconnection[j]->prefix, prefixes[i]);
-        pfree(prefixes[i]);
-        j++;
-      }
-    }
-    pfree(prefixes);
+    pgaudit_log_shm->prefixes_connection = pgauditlogtofile_build_prefixes(false, &pgaudit_log_shm->num_prefixes_connection, ShmemAlloc);
+    pgaudit_log_shm->prefixes_disconnection = pgauditlogtofile_build_prefixes(true, &pgaudit_log_shm->num_prefixes_disconnection, ShmemAlloc);
 
     pgaudit_log_shm->lock = &(GetNamedLWLockTranche("pgauditlogtofile"))->lock;
     pgaudit_log_shm->force_rotation = false;
@@ -328,6 +425,12 @@ static void pgauditlogtofile_shmem_startup(void) {
       pgauditlogtofile_calculate_next_rotation_time();
     pgauditlogtofile_calculate_filename();
   }
+  pgauditlogtofile_stats_shmem_startup();
+  pgauditlogtofile_topk_shmem_startup();
+  pgauditlogtofile_tail_shmem_startup();
+  pgauditlogtofile_seq_shmem_startup();
+  pgauditlogtofile_reorder_shmem_startup();
+  pgauditlogtofile_degrade_shmem_startup();
   LWLockRelease(AddinShmemInitLock);
 
   if (!IsUnderPostmaster)
@@ -338,58 +441,6 @@ static void pgauditlogtofile_shmem_startup(void) {
   }
 }
 
-static char ** pgauditlogtofile_unique_prefixes(const char **messages, const size_t num_messages, size_t *num_unique) {
-  bool is_unique;
-  char **prefixes = NULL;
-  char *message, *prefix, *dup;
-  size_t i, j;
-
-  *num_unique = 0;
-
-  prefixes = palloc(num_messages * sizeof(char *));
-  if (prefixes != NULL) {
-    for (i = 0; i < num_messages; i++) {
-  #ifdef ENABLE_NLS
-      // Get translation - static copy
-      message = gettext(messages[i]);
-  #else
-      // Pointer to original = static copy
-      message = messages[i];
-  #endif
-      // Get a copy that we can modify
-      dup = pstrdup(message);
-      if (dup != NULL) {
-        prefix = strtok(dup, "%");
-        if (prefix != NULL) {
-          // Search duplicated
-          is_unique = true;
-          for (j = 0; j < i; j++) {
-            if (prefixes[j] != NULL) {
-              if (strcmp(prefixes[j], prefix) == 0) {
-                // Skip - prefix already present
-                is_unique = false;
-              }
-            }
-          }
-
-          if (is_unique) {
-            prefixes[i] = palloc((strlen(prefix) + 1) * sizeof(char));
-            if (prefixes[i] != NULL) {
-              strcpy(prefixes[i], prefix);
-              *num_unique += 1;
-            }
-          } else {
-            prefixes[i] = NULL;
-          }
-        }
-        pfree(dup);
-      }
-    }
-  }
-
-  return prefixes;
-}
-
 /*
  * Hook to emit_log - write the record to the audit or send it to the default
  * logger
@@ -414,14 +465,34 @@ static void pgauditlogtofile_emit_log(ErrorData *edata) {
 
     // Scenarios not contemplated above will be ignored
     if (exclude_nchars >= 0) {
+      instr_time start, duration;
+      MemoryContext oldcontext;
+
+      INSTR_TIME_SET_CURRENT(start);
+
+      pgauditlogtofile_init_memory();
+      oldcontext = MemoryContextSwitchTo(AuditRecordMemoryContext);
+
       if (!pgauditlogtofile_record_audit(edata, exclude_nchars)) {
         // ERROR: failed to record in audit, record in server log
         edata->output_to_server = true;
+        pgauditlogtofile_counters_add_dropped();
       }
 
       if (close_file) {
         pgauditlogtofile_close_file();
       }
+
+      MemoryContextSwitchTo(oldcontext);
+      MemoryContextReset(AuditRecordMemoryContext);
+      pgauditlogtofile_report_memory();
+
+      INSTR_TIME_SET_CURRENT(duration);
+      INSTR_TIME_SUBTRACT(duration, start);
+      pgauditlogtofile_counters_add_latency(INSTR_TIME_GET_MICROSEC(duration));
+#ifdef PGAUDITLOGTOFILE_TEST_CLOCK
+      pgauditlogtofile_testclock_trace(INSTR_TIME_GET_MICROSEC(duration));
+#endif
     }
   }
 
@@ -429,6 +500,64 @@ static void pgauditlogtofile_emit_log(ErrorData *edata) {
     prev_emit_log_hook(edata);
 }
 
+/*
+ * Creates the memory contexts of the audit records, so they can be seen in
+ * pg_backend_memory_contexts
+ */
+static void pgauditlogtofile_init_memory(void) {
+  if (AuditMemoryContext != NULL)
+    return;
+
+  /* Lives as long as the backend: file buffer */
+  AuditMemoryContext = AllocSetContextCreate(TopMemoryContext,
+                                             "pgauditlogtofile",
+                                             ALLOCSET_DEFAULT_SIZES);
+  /* Reset after every record */
+  AuditRecordMemoryContext = AllocSetContextCreate(AuditMemoryContext,
+                                                   "pgauditlogtofile record",
+                                                   ALLOCSET_DEFAULT_SIZES);
+  /* Like ErrorContext, messages can be emitted in critical sections */
+  MemoryContextAllowInCriticalSection(AuditMemoryContext, true);
+  MemoryContextAllowInCriticalSection(AuditRecordMemoryContext, true);
+}
+
+/*
+ * Publishes the change of the memory used by this backend in the global
+ * counters
+ */
+static void pgauditlogtofile_report_memory(void) {
+#if (PG_VERSION_NUM >= 130000)
+  int64 allocated;
+
+  /*
+   * The postmaster does not report, its children inherit its contexts. Nor
+   * processes that already left shared memory (disconnection messages).
+   */
+  if (!IsUnderPostmaster || MyProc == NULL)
+    return;
+
+  if (memory_pid != MyProcPid) {
+    memory_pid = MyProcPid;
+    memory_reported = 0;
+    before_shmem_exit(pgauditlogtofile_memory_shutdown, (Datum) 0);
+  }
+
+  allocated = MemoryContextMemAllocated(AuditMemoryContext, true);
+  if (allocated != memory_reported) {
+    pgauditlogtofile_counters_add_memory(allocated - memory_reported);
+    memory_reported = allocated;
+  }
+#endif
+}
+
+/*
+ * Removes the memory of this backend from the global counters
+ */
+static void pgauditlogtofile_memory_shutdown(int code, Datum arg) {
+  pgauditlogtofile_counters_add_memory(-memory_reported);
+  memory_reported = 0;
+}
+
 /*
  * Checks if pgauditlogtofile is completely started and configured
  */
@@ -448,19 +577,6 @@ static inline bool pgauditlogtofile_is_enabled(void) {
  * Records an audit log
  */
 static bool pgauditlogtofile_record_audit(const ErrorData *edata, int exclude_nchars) {
-  if (pgauditlogtofile_needs_rotate_file()) {
-    // calculate_filename will generate a new global file
-    pgauditlogtofile_calculate_filename();
-    pgauditlogtofile_close_file();
-  }
-
-  if (!pgauditlogtofile_is_open_file()) {
-    if (!pgauditlogtofile_open_file()) {
-      // ERROR: unable to open file
-      return false;
-    }
-  }
-
   return pgauditlogtofile_write_audit(edata, exclude_nchars);
 }
 
@@ -489,19 +605,12 @@ static inline bool pgauditlogtofile_is_open_file(void) {
  */
 static inline bool pgauditlogtofile_is_prefixed(const char *msg) {
   bool found = false;
-  size_t i;
 
-  if (guc_pgaudit_log_connections) {
-    for (i = 0; !found && i < pgaudit_log_shm->num_prefixes_connection; i++) {
-      found = pg_strncasecmp(msg, pgaudit_log_shm->prefixes_connection[i]->prefix, pgaudit_log_shm->prefixes_connection[i]->length) == 0;
-    }
-  }
+  if (guc_pgaudit_log_connections)
+    found = pgauditlogtofile_match_prefix(msg, pgaudit_log_shm->prefixes_connection, pgaudit_log_shm->num_prefixes_connection);
 
-  if (!found && guc_pgaudit_log_disconnections) {
-    for (i = 0; !found && i < pgaudit_log_shm->num_prefixes_disconnection; i++) {
-      found = pg_strncasecmp(msg, pgaudit_log_shm->prefixes_disconnection[i]->prefix, pgaudit_log_shm->prefixes_disconnection[i]->length) == 0;
-    }
-  }
+  if (!found && guc_pgaudit_log_disconnections)
+    found = pgauditlogtofile_match_prefix(msg, pgaudit_log_shm->prefixes_disconnection, pgaudit_log_shm->num_prefixes_disconnection);
 
   return found;
 }
@@ -515,14 +624,22 @@ static bool pgauditlogtofile_needs_rotate_file(void) {
     LWLockAcquire(pgaudit_log_shm->lock, LW_EXCLUSIVE);
     pgaudit_log_shm->force_rotation = false;
     LWLockRelease(pgaudit_log_shm->lock);
+    pgauditlogtofile_counters_add_rotation(0, 0);
     return true;
   }
 
   /* Rotate if rotation_age is exceeded, and this backend is the first in notice
    * it */
-  if (guc_pgaudit_log_rotation_age > 0 && (pg_time_t)time(NULL) >= next_rotation_time) {
-    pgauditlogtofile_calculate_next_rotation_time();
-    return true;
+  if (guc_pgaudit_log_rotation_age > 0) {
+    struct timeval tv;
+
+    pgauditlogtofile_gettimeofday(&tv);
+    if ((pg_time_t)tv.tv_sec >= next_rotation_time) {
+      pgauditlogtofile_counters_add_rotation(next_rotation_time,
+        ((pg_time_t)tv.tv_sec - next_rotation_time) * 1000 + tv.tv_usec / 1000);
+      pgauditlogtofile_calculate_next_rotation_time();
+      return true;
+    }
   }
 
   /* Rotate if the global name is different to this backend copy: it has been
@@ -538,7 +655,7 @@ static bool pgauditlogtofile_needs_rotate_file(void) {
  * Calculates next rotation time
  */
 static void pgauditlogtofile_calculate_next_rotation_time(void) {
-  pg_time_t now = (pg_time_t)time(NULL);
+  pg_time_t now = pgauditlogtofile_time();
   struct pg_tm *tm = pg_localtime(&now, log_timezone);
   int rotinterval =
       guc_pgaudit_log_rotation_age * SECS_PER_MINUTE; /* Convert to seconds */
@@ -579,13 +696,19 @@ static bool pgauditlogtofile_open_file(void) {
 
   if (file_handler) {
     /* 128K buffer and flush on demand or when full -> attempt to use only 1 IO operation per record */
-    setvbuf(file_handler, NULL, _IOFBF, 131072);
+    if (file_buffer == NULL)
+      file_buffer = MemoryContextAlloc(AuditMemoryContext, AUDIT_FILE_BUFFER_SIZE);
+    setvbuf(file_handler, file_buffer, _IOFBF, AUDIT_FILE_BUFFER_SIZE);
 #ifdef WIN32
     /* use CRLF line endings on Windows */
     _setmode(_fileno(file_handler), _O_TEXT);
 #endif
     // File open, we update the pgaudit_log_shm->filename we are using
     strcpy(filename_in_use, filename);
+    pgauditlogtofile_counters_add_open(filename);
+#ifdef PGAUDITLOGTOFILE_TEST_CLOCK
+    pgauditlogtofile_testclock_count_open();
+#endif
   } else {
     int save_errno = errno;
     opened = false;
@@ -609,7 +732,7 @@ static void pgauditlogtofile_calculate_filename(void) {
          next_rotation_time -
          guc_pgaudit_log_rotation_age * SECS_PER_MINUTE;
   } else {
-    current_rotation_time = (pg_time_t)time(NULL);
+    current_rotation_time = pgauditlogtofile_time();
   }
 
 
@@ -628,225 +751,135 @@ static void pgauditlogtofile_calculate_filename(void) {
  */
 static bool pgauditlogtofile_write_audit(const ErrorData *edata, int exclude_nchars) {
   StringInfoData buf;
-  int rc;
+  uint64 seq;
+  bool written_ok;
+  bool reordered;
+  bool degraded;
+  bool track_stats = pgauditlogtofile_stats_enabled();
+  instr_time start, formatted, written;
+
+  if (track_stats)
+    INSTR_TIME_SET_CURRENT(start);
 
   initStringInfo(&buf);
-  /* create the log line */
-  pgauditlogtofile_create_audit_line(&buf, edata, exclude_nchars);
+  /* create the log line, minimal while the pipeline is overloaded */
+  degraded = pgauditlogtofile_degrade_line(&buf, edata, exclude_nchars);
+  if (!degraded)
+    pgauditlogtofile_create_audit_line(&buf, edata, exclude_nchars);
+  seq = pgauditlogtofile_seq_stamp(&buf);
+
+  if (track_stats)
+    INSTR_TIME_SET_CURRENT(formatted);
+
+  /* the background worker writes it when the reorder window or the blocks are on */
+  written_ok = reordered = pgauditlogtofile_reorder_store(buf.data, buf.len, pgauditlogtofile_log_time_ms(), seq);
+  if (!written_ok && pgauditlogtofile_block_enabled()) {
+    StringInfoData block;
+
+    initStringInfo(&block);
+    written_ok = pgauditlogtofile_block_encode(buf.data, buf.len, &block) &&
+                 pgauditlogtofile_write_file(block.data, block.len, true);
+    pfree(block.data);
+  } else if (!written_ok) {
+    written_ok = pgauditlogtofile_write_file(buf.data, buf.len, true);
+  }
+  if (written_ok)
+    pgauditlogtofile_counters_add_record(buf.len);
+  if (written_ok && degraded)
+    pgauditlogtofile_counters_add_degraded();
+  /* written among the records sorted by the worker */
+  if (written_ok && !reordered && guc_pgaudit_log_reorder_window > 0)
+    pgauditlogtofile_counters_add_unordered();
+
+  /* the records that went to the server log are counted as dropped only */
+  if (track_stats && written_ok) {
+    INSTR_TIME_SET_CURRENT(written);
+    INSTR_TIME_SUBTRACT(written, formatted);
+    INSTR_TIME_SUBTRACT(formatted, start);
+    pgauditlogtofile_stats_store(buf.len, INSTR_TIME_GET_MILLISEC(formatted), INSTR_TIME_GET_MILLISEC(written));
+  }
+  /* the records that went to the server log are not in the audit file */
+  if (written_ok) {
+    pgauditlogtofile_topk_store(buf.len);
+    pgauditlogtofile_tail_store(edata, exclude_nchars, buf.data, buf.len);
+  }
 
-  fseek(file_handler, 0L, SEEK_END);
-  rc = fwrite(buf.data, 1, buf.len, file_handler);
   pfree(buf.data);
-  fflush(file_handler);
-
-  /* If we failed to write the audit to our audit log, use PostgreSQL logger */
-  if (rc != buf.len) {
-    int save_errno = errno;
-    ereport(WARNING, (errcode_for_file_access(),
-                      errmsg("could not write audit log file \"%s\": %m",
-                             filename)));
-    errno = save_errno;
-  }
 
-  return rc == buf.len;
+  return written_ok;
 }
 
 /*
- * Formats an audit log line
+ * Appends data to the audit log file, rotating and opening it as needed
  */
-static void pgauditlogtofile_create_audit_line(StringInfo buf, const ErrorData *edata, int exclude_nchars) {
-  bool print_stmt = false;
-
-  /* static counter for line numbers */
-  static long log_line_number = 0;
-
-  /* has counter been reset in current process? */
-  static int log_my_pid = 0;
+static bool pgauditlogtofile_write_file(const char *data, int len, bool flush) {
+  int rc;
 
-  /*
-   * This is one of the few places where we'd rather not inherit a static
-   * variable's value from the postmaster.  But since we will, reset it when
-   * MyProcPid changes.
-   */
-  if (log_my_pid != MyProcPid) {
-    /* new session */
-    log_line_number = 0;
-    log_my_pid = MyProcPid;
-    /* start session timestamp */
-    pgauditlogtofile_format_start_time();
+  if (pgauditlogtofile_needs_rotate_file()) {
+    // calculate_filename will generate a new global file
+    pgauditlogtofile_calculate_filename();
+    pgauditlogtofile_close_file();
   }
-  log_line_number++;
-
-  /* timestamp with milliseconds */
-  pgauditlogtofile_format_log_time();
-  appendStringInfoString(buf, formatted_log_time);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* username */
-  if (MyProcPort && MyProcPort->user_name)
-    appendStringInfoString(buf, MyProcPort->user_name);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* database name */
-  if (MyProcPort && MyProcPort->database_name)
-    appendStringInfoString(buf, MyProcPort->database_name);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* Process id  */
-  appendStringInfo(buf, "%d", log_my_pid);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* Remote host and port */
-  if (MyProcPort && MyProcPort->remote_host) {
-    appendStringInfoString(buf, MyProcPort->remote_host);
-    if (MyProcPort->remote_port && MyProcPort->remote_port[0] != '\0') {
-      appendStringInfoCharMacro(buf, ':');
-      appendStringInfoString(buf, MyProcPort->remote_port);
+
+  if (!pgauditlogtofile_is_open_file()) {
+    if (!pgauditlogtofile_open_file()) {
+      // ERROR: unable to open file
+      return false;
     }
   }
-  appendStringInfoCharMacro(buf, ',');
-
-  /* session id - hex representation of start time . session process id */
-  appendStringInfo(buf, "%lx.%x", (long)MyStartTime, log_my_pid);
-  appendStringInfoCharMacro(buf, ',');
 
-  /* Line number */
-  appendStringInfo(buf, "%ld", log_line_number);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* PS display */
-  if (MyProcPort) {
-    StringInfoData msgbuf;
-    const char *psdisp;
-    int displen;
-
-    initStringInfo(&msgbuf);
-
-    psdisp = get_ps_display(&displen);
-    appendBinaryStringInfo(&msgbuf, psdisp, displen);
-    appendStringInfoString(buf, msgbuf.data);
-
-    pfree(msgbuf.data);
-  }
-  appendStringInfoCharMacro(buf, ',');
-
-  /* session start timestamp */
-  appendStringInfoString(buf, formatted_start_time);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* Virtual transaction id */
-  /* keep VXID format in sync with lockfuncs.c */
-  if (MyProc != NULL && MyProc->backendId != InvalidBackendId)
-    appendStringInfo(buf, "%d/%u", MyProc->backendId, MyProc->lxid);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* Transaction id */
-  appendStringInfo(buf, "%u", GetTopTransactionIdIfAny());
-  appendStringInfoCharMacro(buf, ',');
-
-  /* SQL state code */
-  appendStringInfoString(buf, unpack_sql_state(edata->sqlerrcode));
-  appendStringInfoCharMacro(buf, ',');
-
-  /* errmessage - PGAUDIT formatted text, +7 exclude "AUDIT: " prefix */
-  appendStringInfoString(buf, edata->message + exclude_nchars);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* errdetail or errdetail_log */
-  if (edata->detail_log)
-    appendStringInfoString(buf, edata->detail_log);
-  else if (edata->detail)
-    appendStringInfoString(buf, edata->detail);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* errhint */
-  if (edata->hint)
-    appendStringInfoString(buf, edata->hint);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* internal query */
-  if (edata->internalquery)
-    appendStringInfoString(buf, edata->internalquery);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* if printed internal query, print internal pos too */
-  if (edata->internalpos > 0 && edata->internalquery != NULL)
-    appendStringInfo(buf, "%d", edata->internalpos);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* errcontext */
-  if (edata->context)
-    appendStringInfoString(buf, edata->context);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* user query --- only reported if not disabled by the caller */
-  if (debug_query_string != NULL && !edata->hide_stmt)
-    print_stmt = true;
-  if (print_stmt)
-    appendStringInfoString(buf, debug_query_string);
-  appendStringInfoCharMacro(buf, ',');
-  if (print_stmt && edata->cursorpos > 0)
-    appendStringInfo(buf, "%d", edata->cursorpos);
-  appendStringInfoCharMacro(buf, ',');
-
-  /* file error location */
-  if (Log_error_verbosity >= PGERROR_VERBOSE) {
-    StringInfoData msgbuf;
-
-    initStringInfo(&msgbuf);
-
-    if (edata->funcname && edata->filename)
-      appendStringInfo(&msgbuf, "%s, %s:%d", edata->funcname, edata->filename,
-                       edata->lineno);
-    else if (edata->filename)
-      appendStringInfo(&msgbuf, "%s:%d", edata->filename, edata->lineno);
-    appendStringInfoString(buf, msgbuf.data);
-    pfree(msgbuf.data);
+  fseek(file_handler, 0L, SEEK_END);
+  if (len > AUDIT_FILE_BUFFER_SIZE) {
+    /* a single write, so the writes of other processes never split it */
+    fflush(file_handler);
+    rc = write(fileno(file_handler), data, len);
+  } else {
+    rc = fwrite(data, 1, len, file_handler);
+    if (flush)
+      fflush(file_handler);
   }
-  appendStringInfoCharMacro(buf, ',');
 
-  /* application name */
-  if (application_name)
-    appendStringInfoString(buf, application_name);
+  /* If we failed to write the audit to our audit log, use PostgreSQL logger */
+  if (rc != len) {
+    int save_errno = errno;
+    ereport(WARNING, (errcode_for_file_access(),
+                      errmsg("could not write audit log file \"%s\": %m",
+                             filename)));
+    errno = save_errno;
+  }
 
-  appendStringInfoCharMacro(buf, '\n');
+  return rc == len;
 }
 
 /*
- * Formats the session start time
+ * Writes a record held by the reorder window, pgauditlogtofile_flush_file
+ * flushes them
  */
-static inline void pgauditlogtofile_format_start_time(void) {
-  /*
-   * Note: we expect that guc.c will ensure that log_timezone is set up (at
-   * least with a minimal GMT value) before Log_line_prefix can become
-   * nonempty or CSV mode can be selected.
-   */
-  pg_strftime(formatted_start_time, FORMATTED_TS_LEN, "%Y-%m-%d %H:%M:%S %Z",
-              pg_localtime((pg_time_t *)&MyStartTime, log_timezone));
+bool pgauditlogtofile_write_line(const char *line, int len) {
+  if (!pgauditlogtofile_is_enabled())
+    return false;
+
+  /* the worker does not go through the logging hook: file buffer context */
+  pgauditlogtofile_init_memory();
+
+  return pgauditlogtofile_write_file(line, len, false);
 }
 
 /*
- * Formats the record time
+ * Flushes the records written with pgauditlogtofile_write_line, false if
+ * they could not be written
  */
-static inline void pgauditlogtofile_format_log_time(void) {
-  struct timeval tv;
-  char msbuf[5];
-
-  gettimeofday(&tv, NULL);
+bool pgauditlogtofile_flush_file(void) {
+  if (file_handler != NULL && fflush(file_handler) != 0) {
+    int save_errno = errno;
+    ereport(WARNING, (errcode_for_file_access(),
+                      errmsg("could not write audit log file \"%s\": %m",
+                             filename)));
+    errno = save_errno;
+    return false;
+  }
 
-  /*
-   * Note: we expect that guc.c will ensure that log_timezone is set up (at
-   * least with a minimal GMT value) before Log_line_prefix can become
-   * nonempty or CSV mode can be selected.
-   */
-  pg_strftime(formatted_log_time, FORMATTED_TS_LEN,
-              /* leave room for milliseconds... */
-              "%Y-%m-%d %H:%M:%S     %Z",
-              pg_localtime((pg_time_t *)&(tv.tv_sec), log_timezone));
-
-  /* 'paste' milliseconds into place... */
-  sprintf(msbuf, ".%03d", (int)(tv.tv_usec / 1000));
-  memcpy(formatted_log_time + 19, msbuf, 4);
+  return true;
 }
 
 /*
@@ -854,4 +887,6 @@ static inline void pgauditlogtofile_format_log_time(void) {
  */
 static void pgauditlogtofile_shmem_shutdown(int code, Datum arg) {
   pgAuditLogToFileShutdown = true;
+  /* no process is left to take a sequence number */
+  pgauditlogtofile_seq_save(true);
 }
@@ -13,8 +13,22 @@
 #ifndef PGAUDITLOGTOFILE_H
 #define PGAUDITLOGTOFILE_H
 
+#include "funcapi.h"
+#include "utils/tuplestore.h"
+
+/* GUC variables */
+extern char *guc_pgaudit_log_directory;
+extern char *guc_pgaudit_log_filename;
+
 /* initialization functions */
 void _PG_fini(void);
 void _PG_init(void);
 
+/* Audit file writes of the reorder window */
+bool pgauditlogtofile_write_line(const char *line, int len);
+bool pgauditlogtofile_flush_file(void);
+
+/* SQL interface helpers */
+Tuplestorestate *pgauditlogtofile_materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
 #endif
@@ -0,0 +1,369 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_bgw.c
+ *      background worker of pgauditlogtofile
+ *
+ * The worker does not connect to any database, it only takes care of the
+ * periodic tasks that must not run in the backends: writing the global
+ * counters in Prometheus text format for a textfile collector, the tick
+ * records of the audit sequence, writing the records held by the reorder
+ * window, the block digests and the checkpoint records of the audit files,
+ * and the switches to the minimal records when the audit falls behind.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "logtofile.h"
+#include "logtofile_bgw.h"
+#include "logtofile_checkpoint.h"
+#include "logtofile_degrade.h"
+#include "logtofile_digest.h"
+#include "logtofile_reorder.h"
+#include "logtofile_seq.h"
+#include "logtofile_stats.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defines */
+/* Interval of the digests of the audit file being written */
+#define DIGEST_INTERVAL_MS 1000
+/* Interval of the reads of the audit file for the checkpoint records */
+#define CHECKPOINT_INTERVAL_MS 1000
+/* Interval of the writes of the sequence index */
+#define SEQ_INDEX_INTERVAL_MS 1000
+/* Interval of the checks of the backlog and the hook latency */
+#define DEGRADE_INTERVAL_MS 100
+
+/* GUC variables */
+char *guc_pgaudit_log_metrics_file = NULL;
+int guc_pgaudit_log_metrics_interval = 15;
+
+/* Flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* Internal functions */
+static void pgauditlogtofile_bgw_sighup(SIGNAL_ARGS);
+static void pgauditlogtofile_bgw_sigterm(SIGNAL_ARGS);
+static void pgauditlogtofile_metric(FILE *fh, const char *name, const char *type, const char *help);
+static bool pgauditlogtofile_metrics_enabled(void);
+static void pgauditlogtofile_write_metrics(void);
+
+
+/*
+ * Registers the worker - only while loading shared_preload_libraries
+ */
+void pgauditlogtofile_bgw_register(void) {
+  BackgroundWorker worker;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+  worker.bgw_restart_time = 10;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "pgauditlogtofile");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgauditlogtofile_bgw_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "pgauditlogtofile worker");
+#if (PG_VERSION_NUM >= 110000)
+  snprintf(worker.bgw_type, BGW_MAXLEN, "pgauditlogtofile worker");
+#endif
+  worker.bgw_main_arg = (Datum) 0;
+  worker.bgw_notify_pid = 0;
+
+  RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * SIGHUP: reload the configuration
+ */
+static void pgauditlogtofile_bgw_sighup(SIGNAL_ARGS) {
+  int save_errno = errno;
+
+  got_sighup = true;
+  SetLatch(MyLatch);
+
+  errno = save_errno;
+}
+
+/*
+ * SIGTERM: exit at the next loop
+ */
+static void pgauditlogtofile_bgw_sigterm(SIGNAL_ARGS) {
+  int save_errno = errno;
+
+  got_sigterm = true;
+  SetLatch(MyLatch);
+
+  errno = save_errno;
+}
+
+/*
+ * Worker entry point
+ */
+void pgauditlogtofile_bgw_main(Datum main_arg) {
+  TimestampTz next_metrics = 0;
+  TimestampTz next_tick = 0;
+  TimestampTz next_digest = 0;
+  TimestampTz next_checkpoint = 0;
+  TimestampTz next_degrade = 0;
+  TimestampTz next_seq_index = 0;
+
+  pqsignal(SIGHUP, pgauditlogtofile_bgw_sighup);
+  pqsignal(SIGTERM, pgauditlogtofile_bgw_sigterm);
+  BackgroundWorkerUnblockSignals();
+
+  if (pgauditlogtofile_reorder_enabled())
+    pgauditlogtofile_reorder_attach();
+
+  while (!got_sigterm) {
+    TimestampTz now;
+    long timeout = -1;
+    int rc;
+
+    if (got_sighup) {
+      got_sighup = false;
+      ProcessConfigFile(PGC_SIGHUP);
+      /* the intervals may have changed */
+      next_metrics = 0;
+      next_tick = 0;
+    }
+
+    now = GetCurrentTimestamp();
+
+    if (pgauditlogtofile_metrics_enabled()) {
+      if (now >= next_metrics) {
+        pgauditlogtofile_write_metrics();
+        next_metrics = TimestampTzPlusMilliseconds(now, guc_pgaudit_log_metrics_interval * 1000L);
+      }
+      timeout = (next_metrics - now) / 1000;
+    }
+
+    if (pgauditlogtofile_seq_tick_enabled()) {
+      long tick_timeout;
+
+      if (now >= next_tick) {
+        pgauditlogtofile_seq_tick();
+        next_tick = TimestampTzPlusMilliseconds(now, guc_pgaudit_log_sequence_tick * 1000L);
+      }
+      tick_timeout = (next_tick - now) / 1000;
+      if (timeout < 0 || tick_timeout < timeout)
+        timeout = tick_timeout;
+    }
+
+    if (pgauditlogtofile_seq_enabled()) {
+      long seq_index_timeout;
+
+      if (now >= next_seq_index) {
+        pgauditlogtofile_seq_save(false);
+        next_seq_index = TimestampTzPlusMilliseconds(now, SEQ_INDEX_INTERVAL_MS);
+      }
+      seq_index_timeout = (next_seq_index - now) / 1000;
+      if (timeout < 0 || seq_index_timeout < timeout)
+        timeout = seq_index_timeout;
+    }
+
+    if (pgauditlogtofile_digest_enabled()) {
+      long digest_timeout;
+
+      if (now >= next_digest) {
+        pgauditlogtofile_digest_run();
+        next_digest = TimestampTzPlusMilliseconds(now, DIGEST_INTERVAL_MS);
+      }
+      digest_timeout = (next_digest - now) / 1000;
+      if (timeout < 0 || digest_timeout < timeout)
+        timeout = digest_timeout;
+    }
+
+    if (pgauditlogtofile_checkpoint_enabled()) {
+      long checkpoint_timeout;
+
+      if (now >= next_checkpoint) {
+        pgauditlogtofile_checkpoint_run();
+        next_checkpoint = TimestampTzPlusMilliseconds(now, CHECKPOINT_INTERVAL_MS);
+      }
+      checkpoint_timeout = (next_checkpoint - now) / 1000;
+      if (timeout < 0 || checkpoint_timeout < timeout)
+        timeout = checkpoint_timeout;
+    }
+
+    /* before the flush, that empties the ring */
+    if (pgauditlogtofile_degrade_enabled()) {
+      long degrade_timeout;
+
+      if (now >= next_degrade) {
+        pgauditlogtofile_degrade_run();
+        next_degrade = TimestampTzPlusMilliseconds(now, DEGRADE_INTERVAL_MS);
+      }
+      degrade_timeout = (next_degrade - now) / 1000;
+      if (timeout < 0 || degrade_timeout < timeout)
+        timeout = degrade_timeout;
+    }
+
+    if (pgauditlogtofile_reorder_enabled()) {
+      long reorder_timeout = pgauditlogtofile_reorder_flush();
+
+      if (reorder_timeout >= 0 && (timeout < 0 || reorder_timeout < timeout))
+        timeout = reorder_timeout;
+    }
+
+    rc = WaitLatch(MyLatch,
+                   WL_LATCH_SET | WL_POSTMASTER_DEATH | (timeout >= 0 ? WL_TIMEOUT : 0),
+                   timeout, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+
+    if (rc & WL_POSTMASTER_DEATH) {
+      pgauditlogtofile_reorder_detach();
+      proc_exit(1);
+    }
+  }
+
+  /* the backends write their records themselves from now on */
+  pgauditlogtofile_reorder_detach();
+  proc_exit(0);
+}
+
+/*
+ * Checks if the metrics file is configured
+ */
+static inline bool pgauditlogtofile_metrics_enabled(void) {
+  return guc_pgaudit_log_metrics_file != NULL && strlen(guc_pgaudit_log_metrics_file) > 0;
+}
+
+/*
+ * Writes the HELP and TYPE lines of a metric
+ */
+static void pgauditlogtofile_metric(FILE *fh, const char *name, const char *type, const char *help) {
+  fprintf(fh, "# HELP %s %s\n", name, help);
+  fprintf(fh, "# TYPE %s %s\n", name, type);
+}
+
+/*
+ * Writes the global counters in Prometheus text format. The file is written
+ * in a temporary file and renamed, so the collector never reads a partial one.
+ */
+static void pgauditlogtofile_write_metrics(void) {
+  static bool last_failed = false;
+  pgAuditLogToFileCounters counters;
+  char tmpfilename[MAXPGPATH];
+  struct stat st;
+  FILE *fh;
+  uint64 cumulative = 0;
+  int i;
+
+  pgauditlogtofile_counters_snapshot(&counters);
+
+  snprintf(tmpfilename, MAXPGPATH, "%s.tmp", guc_pgaudit_log_metrics_file);
+  fh = AllocateFile(tmpfilename, "w");
+  if (fh == NULL) {
+    /* Don't flood the server log every interval */
+    if (!last_failed)
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not open metrics file \"%s\": %m", tmpfilename)));
+    last_failed = true;
+    return;
+  }
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_records_total", "counter",
+                          "Audit records written to the audit file.");
+  fprintf(fh, "pgauditlogtofile_records_total " UINT64_FORMAT "\n", counters.records);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_bytes_total", "counter",
+                          "Bytes written to the audit file.");
+  fprintf(fh, "pgauditlogtofile_bytes_total " UINT64_FORMAT "\n", counters.bytes);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_dropped_records_total", "counter",
+                          "Audit records that could not be written to the audit file and went to the server log.");
+  fprintf(fh, "pgauditlogtofile_dropped_records_total " UINT64_FORMAT "\n", counters.dropped);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_file_opens_total", "counter",
+                          "Opens of the audit file.");
+  fprintf(fh, "pgauditlogtofile_file_opens_total " UINT64_FORMAT "\n", counters.file_opens);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_rotations_total", "counter",
+                          "Rotations of the audit file, counted in every process writing it.");
+  fprintf(fh, "pgauditlogtofile_rotations_total " UINT64_FORMAT "\n", counters.rotations);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_rotation_lag_seconds", "gauge",
+                          "Biggest delay between the last scheduled rotation and a process noticing it.");
+  fprintf(fh, "pgauditlogtofile_rotation_lag_seconds %.3f\n", counters.rotation_lag_ms / 1000.0);
+
+  if (counters.filename[0] != '\0' && stat(counters.filename, &st) == 0) {
+    pgauditlogtofile_metric(fh, "pgauditlogtofile_file_size_bytes", "gauge",
+                            "Size of the current audit file.");
+    fprintf(fh, "pgauditlogtofile_file_size_bytes %lld\n", (long long) st.st_size);
+  }
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_memory_bytes", "gauge",
+                          "Memory allocated by the audit memory contexts of all the backends.");
+  fprintf(fh, "pgauditlogtofile_memory_bytes " INT64_FORMAT "\n", counters.memory);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_batch_bytes", "gauge",
+                          "Bytes of records the worker writes together before flushing them.");
+  fprintf(fh, "pgauditlogtofile_batch_bytes " UINT64_FORMAT "\n", counters.batch_bytes);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_flush_latency_seconds", "gauge",
+                          "Average time from a record due to the worker flushing it.");
+  fprintf(fh, "pgauditlogtofile_flush_latency_seconds %.6f\n", counters.flush_latency_us / 1000000.0);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_queue_depth_ratio", "gauge",
+                          "Part of the shared memory ring holding records not taken by the worker yet.");
+  fprintf(fh, "pgauditlogtofile_queue_depth_ratio %.4f\n", pgauditlogtofile_reorder_backlog());
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_degraded", "gauge",
+                          "1 while the audit records are written in the minimal layout.");
+  fprintf(fh, "pgauditlogtofile_degraded %d\n", pgauditlogtofile_degrade_active() ? 1 : 0);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_degraded_records_total", "counter",
+                          "Audit records written in the minimal layout.");
+  fprintf(fh, "pgauditlogtofile_degraded_records_total " UINT64_FORMAT "\n", counters.degraded);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_unordered_records_total", "counter",
+                          "Audit records written directly while the reorder window is on.");
+  fprintf(fh, "pgauditlogtofile_unordered_records_total " UINT64_FORMAT "\n", counters.unordered);
+
+  pgauditlogtofile_metric(fh, "pgauditlogtofile_hook_latency_seconds", "histogram",
+                          "Time spent by the logging hook writing each audit record.");
+  for (i = 0; i < PGAUDITLOGTOFILE_LATENCY_BUCKETS - 1; i++) {
+    cumulative += counters.latency_buckets[i];
+    fprintf(fh, "pgauditlogtofile_hook_latency_seconds_bucket{le=\"%g\"} " UINT64_FORMAT "\n",
+            pgauditlogtofile_latency_bounds_us[i] / 1000000.0, cumulative);
+  }
+  cumulative += counters.latency_buckets[i];
+  fprintf(fh, "pgauditlogtofile_hook_latency_seconds_bucket{le=\"+Inf\"} " UINT64_FORMAT "\n", cumulative);
+  fprintf(fh, "pgauditlogtofile_hook_latency_seconds_sum %.6f\n", counters.latency_sum_us / 1000000.0);
+  fprintf(fh, "pgauditlogtofile_hook_latency_seconds_count " UINT64_FORMAT "\n", cumulative);
+
+  if (FreeFile(fh) != 0) {
+    if (!last_failed)
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not write metrics file \"%s\": %m", tmpfilename)));
+    last_failed = true;
+    unlink(tmpfilename);
+    return;
+  }
+
+  if (rename(tmpfilename, guc_pgaudit_log_metrics_file) != 0) {
+    if (!last_failed)
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not rename metrics file \"%s\" to \"%s\": %m",
+                           tmpfilename, guc_pgaudit_log_metrics_file)));
+    last_failed = true;
+    unlink(tmpfilename);
+    return;
+  }
+
+  last_failed = false;
+}
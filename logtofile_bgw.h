@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_bgw.h
+ *      background worker of pgauditlogtofile
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_BGW_H
+#define PGAUDITLOGTOFILE_BGW_H
+
+/* GUC variables */
+extern char *guc_pgaudit_log_metrics_file;
+extern int guc_pgaudit_log_metrics_interval;
+
+/* Background worker */
+void pgauditlogtofile_bgw_register(void);
+PGDLLEXPORT void pgauditlogtofile_bgw_main(Datum main_arg);
+
+#endif
@@ -0,0 +1,481 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_block.c
+ *      compressed and encrypted blocks of audit records
+ *
+ * With pgaudit.log_compression or pgaudit.log_encryption_key_file the audit
+ * file is a sequence of self-describing blocks instead of text: the records
+ * are compressed first, with zlib, an LZ4 frame or a zstd frame, and then
+ * encrypted with AES-256-GCM, so the cost of the cipher and of its tag is
+ * shared by all the records of a block. The background worker builds blocks
+ * of up to pgaudit.log_block_size from the records the backends leave in the
+ * reorder ring; a backend that writes its record itself writes a block with
+ * that record only. Blocks are written with a single write, so the blocks of
+ * several processes never mix.
+ *
+ * With pgaudit.log_compression_adaptive the worker lowers the level of its
+ * blocks when the backends fill the ring faster than it compresses, down to
+ * the fastest level and then to LZ4 if the server has it, and raises it
+ * back once the ring stays empty. Every block records its compression and
+ * level, so the readers do not depend on them.
+ *
+ * tools/auditcat decrypts and decompresses the files.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "common/sha2.h"
+#include "portability/instr_time.h"
+#include "utils/guc.h"
+
+#include "logtofile_block.h"
+
+#include <zlib.h>
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+/* Defines */
+#define BLOCK_ZLIB_DEFAULT_LEVEL 6
+#define BLOCK_LZ4_MAX_LEVEL 12
+/* Adaptive level: part of the ring in use that lowers it at once, and below which it can be raised */
+#define BLOCK_ADAPT_BACKLOG_HIGH 0.5
+#define BLOCK_ADAPT_BACKLOG_LOW 0.05
+/* Compression speed wanted over the rate the records arrive */
+#define BLOCK_ADAPT_HEADROOM 2.0
+/* Time at a level before lowering it again, and before raising it */
+#define BLOCK_ADAPT_DOWN_MS 500
+#define BLOCK_ADAPT_UP_MS 5000
+/* Weight of the last block in the compression speed */
+#define BLOCK_ADAPT_SPEED_WEIGHT 0.25
+
+/* GUC variables */
+int guc_pgaudit_log_block_size = 256;
+int guc_pgaudit_log_compression = PGAUDIT_COMPRESSION_NONE;
+int guc_pgaudit_log_compression_level = PGAUDIT_COMPRESSION_LEVEL_DEFAULT;
+bool guc_pgaudit_log_compression_adaptive = false;
+char *guc_pgaudit_log_encryption_key_file = NULL;
+
+const struct config_enum_entry pgauditlogtofile_compression_options[] = {
+  {"none", PGAUDIT_COMPRESSION_NONE, false},
+  {"zlib", PGAUDIT_COMPRESSION_ZLIB, false},
+#ifdef USE_LZ4
+  {"lz4", PGAUDIT_COMPRESSION_LZ4, false},
+#endif
+#ifdef USE_ZSTD
+  {"zstd", PGAUDIT_COMPRESSION_ZSTD, false},
+#endif
+  {NULL, 0, false}
+};
+
+#ifdef USE_ZSTD
+/* Reused by every block, it keeps the tables of the compressor */
+static ZSTD_CCtx *zstd_ctx = NULL;
+#endif
+
+/* Compression and level chosen by the adaptive worker, -1 when not adapting */
+static int adaptive_compression = -1;
+static int adaptive_level = 0;
+static double adaptive_speed = 0;  /* bytes per second compressed at this level */
+static instr_time adaptive_changed; /* last change of level */
+
+#ifdef USE_OPENSSL
+/* Key read from pgaudit.log_encryption_key_file */
+static bool key_loaded = false;
+static uint8 key[PGAUDIT_BLOCK_KEY_SIZE];
+static uint32 key_id = 0;
+static EVP_CIPHER_CTX *cipher_ctx = NULL;
+#endif
+
+/* Internal functions */
+static void pgauditlogtofile_block_adapt_set(int compression, int level);
+static bool pgauditlogtofile_block_compress(int compression, int level, const char *data, int len,
+                                            char **dest, int *dest_len);
+static int pgauditlogtofile_block_level(int compression);
+static int pgauditlogtofile_block_level_min(int compression);
+static inline bool pgauditlogtofile_block_encrypted(void);
+static void pgauditlogtofile_block_put_uint32(uint8 *dest, uint32 value);
+#ifdef USE_OPENSSL
+static bool pgauditlogtofile_block_load_key(int elevel);
+#endif
+
+
+/*
+ * Checks if the audit file is written in blocks
+ */
+bool pgauditlogtofile_block_enabled(void) {
+  return guc_pgaudit_log_compression != PGAUDIT_COMPRESSION_NONE || pgauditlogtofile_block_encrypted();
+}
+
+static inline bool pgauditlogtofile_block_encrypted(void) {
+  return guc_pgaudit_log_encryption_key_file != NULL && guc_pgaudit_log_encryption_key_file[0] != '\0';
+}
+
+/*
+ * Validates the encryption key while loading shared_preload_libraries, so
+ * the server does not start writing the records in clear
+ */
+void pgauditlogtofile_block_check(void) {
+  if (!pgauditlogtofile_block_encrypted())
+    return;
+
+#ifdef USE_OPENSSL
+  pgauditlogtofile_block_load_key(ERROR);
+#else
+  ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                  errmsg("pgaudit.log_encryption_key_file requires a server built with OpenSSL")));
+#endif
+}
+
+#ifdef USE_OPENSSL
+/*
+ * Reads the key: 64 hexadecimal digits
+ */
+static bool pgauditlogtofile_block_load_key(int elevel) {
+  char hex[PGAUDIT_BLOCK_KEY_SIZE * 2 + 2];
+  uint8 digest[PG_SHA256_DIGEST_LENGTH];
+  size_t len = 0;
+  FILE *fh;
+  int i;
+
+  if (key_loaded)
+    return true;
+
+  fh = fopen(guc_pgaudit_log_encryption_key_file, "r");
+  if (fh == NULL) {
+    ereport(elevel, (errcode_for_file_access(),
+                     errmsg("could not open encryption key file \"%s\": %m",
+                            guc_pgaudit_log_encryption_key_file)));
+    return false;
+  }
+  len = fread(hex, 1, sizeof(hex), fh);
+  fclose(fh);
+
+  /* a trailing line end is not part of the key */
+  while (len > 0 && (hex[len - 1] == '\n' || hex[len - 1] == '\r'))
+    len--;
+
+  for (i = 0; i < PGAUDIT_BLOCK_KEY_SIZE * 2 && len == PGAUDIT_BLOCK_KEY_SIZE * 2; i++) {
+    char c = hex[i];
+    int v;
+
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v = c - 'A' + 10;
+    else
+      break;
+    key[i / 2] = (i % 2 == 0) ? v << 4 : key[i / 2] | v;
+  }
+  explicit_bzero(hex, sizeof(hex));
+
+  if (i != PGAUDIT_BLOCK_KEY_SIZE * 2) {
+    ereport(elevel, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("encryption key file \"%s\" must contain 64 hexadecimal digits",
+                            guc_pgaudit_log_encryption_key_file)));
+    return false;
+  }
+
+  /* the id lets the reader tell a wrong key from a damaged block */
+  if (EVP_Digest(key, PGAUDIT_BLOCK_KEY_SIZE, digest, NULL, EVP_sha256(), NULL) != 1) {
+    ereport(elevel, (errmsg("could not compute the encryption key id")));
+    return false;
+  }
+  key_id = digest[0] | (digest[1] << 8) | (digest[2] << 16) | ((uint32) digest[3] << 24);
+  key_loaded = true;
+
+  return true;
+}
+#endif
+
+/*
+ * Level of pgaudit.log_compression_level for a compression, limited to the
+ * highest of the compression
+ */
+static int pgauditlogtofile_block_level(int compression) {
+  int level = guc_pgaudit_log_compression_level;
+
+  switch (compression) {
+    case PGAUDIT_COMPRESSION_ZLIB:
+      return level < 0 ? BLOCK_ZLIB_DEFAULT_LEVEL : Min(level, Z_BEST_COMPRESSION);
+#ifdef USE_LZ4
+    case PGAUDIT_COMPRESSION_LZ4:
+      /* levels from 3 use LZ4 HC, the default is the fast compressor */
+      return level < 0 ? 0 : Min(level, BLOCK_LZ4_MAX_LEVEL);
+#endif
+#ifdef USE_ZSTD
+    case PGAUDIT_COMPRESSION_ZSTD:
+      return level < 0 ? ZSTD_CLEVEL_DEFAULT : Min(level, ZSTD_maxCLevel());
+#endif
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Fastest level of a compression
+ */
+static int pgauditlogtofile_block_level_min(int compression) {
+  return compression == PGAUDIT_COMPRESSION_LZ4 ? 0 : 1;
+}
+
+/*
+ * Compresses the records into a palloc'd buffer
+ */
+static bool pgauditlogtofile_block_compress(int compression, int level, const char *data, int len,
+                                            char **dest, int *dest_len) {
+  switch (compression) {
+    case PGAUDIT_COMPRESSION_ZLIB: {
+      uLongf compressed_len = compressBound(len);
+
+      *dest = palloc(compressed_len);
+      if (compress2((Bytef *) *dest, &compressed_len, (const Bytef *) data, len, level) != Z_OK)
+        return false;
+      *dest_len = compressed_len;
+      return true;
+    }
+#ifdef USE_LZ4
+    case PGAUDIT_COMPRESSION_LZ4: {
+      LZ4F_preferences_t prefs;
+      size_t bound, rc;
+
+      memset(&prefs, 0, sizeof(prefs));
+      prefs.compressionLevel = level;
+      prefs.frameInfo.contentSize = len;
+
+      bound = LZ4F_compressFrameBound(len, &prefs);
+      *dest = palloc(bound);
+      rc = LZ4F_compressFrame(*dest, bound, data, len, &prefs);
+      if (LZ4F_isError(rc))
+        return false;
+      *dest_len = rc;
+      return true;
+    }
+#endif
+#ifdef USE_ZSTD
+    case PGAUDIT_COMPRESSION_ZSTD: {
+      size_t bound, rc;
+
+      if (zstd_ctx == NULL && (zstd_ctx = ZSTD_createCCtx()) == NULL)
+        return false;
+
+      bound = ZSTD_compressBound(len);
+      *dest = palloc(bound);
+      rc = ZSTD_compressCCtx(zstd_ctx, *dest, bound, data, len, level);
+      if (ZSTD_isError(rc))
+        return false;
+      *dest_len = rc;
+      return true;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+static void pgauditlogtofile_block_adapt_set(int compression, int level) {
+  if (compression != adaptive_compression || level != adaptive_level)
+    elog(DEBUG1, "pgauditlogtofile audit blocks compressed with %s level %d",
+         compression == PGAUDIT_COMPRESSION_LZ4 ? "lz4" :
+         compression == PGAUDIT_COMPRESSION_ZSTD ? "zstd" : "zlib", level);
+
+  adaptive_compression = compression;
+  adaptive_level = level;
+  adaptive_speed = 0;
+  INSTR_TIME_SET_CURRENT(adaptive_changed);
+}
+
+/*
+ * Chooses the compression and level of the next blocks of the worker from
+ * the part of the ring in use and the bytes per second that arrive to it.
+ * Lowering is quicker than raising, so the level does not swing with every
+ * burst.
+ */
+void pgauditlogtofile_block_adapt(double backlog, double arrival_speed) {
+  int compression = guc_pgaudit_log_compression;
+  int target = pgauditlogtofile_block_level(compression);
+  int fastest = pgauditlogtofile_block_level_min(compression);
+  instr_time elapsed;
+  double elapsed_ms;
+
+  if (!guc_pgaudit_log_compression_adaptive || compression == PGAUDIT_COMPRESSION_NONE) {
+    adaptive_compression = -1;
+    return;
+  }
+  /* first block, or pgaudit.log_compression_level lowered */
+  if (adaptive_compression < 0 ||
+      (adaptive_compression == compression && adaptive_level > target)) {
+    pgauditlogtofile_block_adapt_set(compression, target);
+    return;
+  }
+
+  INSTR_TIME_SET_CURRENT(elapsed);
+  INSTR_TIME_SUBTRACT(elapsed, adaptive_changed);
+  elapsed_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+
+  if (backlog >= BLOCK_ADAPT_BACKLOG_HIGH) {
+    /* falling behind: the fastest level, and then LZ4 */
+    if (adaptive_compression == compression && adaptive_level > fastest)
+      pgauditlogtofile_block_adapt_set(compression, fastest);
+#ifdef USE_LZ4
+    else if (adaptive_compression != PGAUDIT_COMPRESSION_LZ4 && elapsed_ms >= BLOCK_ADAPT_DOWN_MS)
+      pgauditlogtofile_block_adapt_set(PGAUDIT_COMPRESSION_LZ4, 0);
+#endif
+  } else if (adaptive_speed > 0 && adaptive_speed < arrival_speed * BLOCK_ADAPT_HEADROOM) {
+    /* keeping up with little margin: one level less */
+    if (adaptive_compression == compression && adaptive_level > fastest && elapsed_ms >= BLOCK_ADAPT_DOWN_MS)
+      pgauditlogtofile_block_adapt_set(compression, adaptive_level - 1);
+  } else if (backlog <= BLOCK_ADAPT_BACKLOG_LOW && elapsed_ms >= BLOCK_ADAPT_UP_MS) {
+    /* idle: one level more, back to the configured compression first */
+    if (adaptive_compression != compression)
+      pgauditlogtofile_block_adapt_set(compression, fastest);
+    else if (adaptive_level < target)
+      pgauditlogtofile_block_adapt_set(compression, adaptive_level + 1);
+  }
+}
+
+static void pgauditlogtofile_block_put_uint32(uint8 *dest, uint32 value) {
+  dest[0] = value & 0xff;
+  dest[1] = (value >> 8) & 0xff;
+  dest[2] = (value >> 16) & 0xff;
+  dest[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Appends a block with the records in data: compressed and then encrypted
+ * as configured. Returns false, with a WARNING, if it could not be built.
+ */
+bool pgauditlogtofile_block_encode(const char *data, int len, StringInfo block) {
+  uint8 header[PGAUDIT_BLOCK_HEADER_SIZE];
+  const char *payload = data;
+  int payload_len = len;
+  char *compressed = NULL;
+  bool encrypted = pgauditlogtofile_block_encrypted();
+  int compression = guc_pgaudit_log_compression;
+  int level = 0;
+
+  if (compression != PGAUDIT_COMPRESSION_NONE) {
+    instr_time start, duration;
+
+    /* the adaptive choice of the worker, the configured one otherwise */
+    if (adaptive_compression >= 0) {
+      compression = adaptive_compression;
+      level = adaptive_level;
+    } else {
+      level = pgauditlogtofile_block_level(compression);
+    }
+
+    INSTR_TIME_SET_CURRENT(start);
+    if (!pgauditlogtofile_block_compress(compression, level, data, len, &compressed, &payload_len)) {
+      ereport(WARNING, (errmsg("could not compress audit block")));
+      if (compressed)
+        pfree(compressed);
+      return false;
+    }
+    payload = compressed;
+
+    if (adaptive_compression >= 0) {
+      double seconds;
+
+      INSTR_TIME_SET_CURRENT(duration);
+      INSTR_TIME_SUBTRACT(duration, start);
+      seconds = INSTR_TIME_GET_DOUBLE(duration);
+      if (seconds > 0)
+        adaptive_speed = adaptive_speed > 0 ?
+                         adaptive_speed + BLOCK_ADAPT_SPEED_WEIGHT * (len / seconds - adaptive_speed) :
+                         len / seconds;
+    }
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, PGAUDIT_BLOCK_MAGIC, PGAUDIT_BLOCK_MAGIC_LENGTH);
+  header[4] = PGAUDIT_BLOCK_VERSION;
+  header[5] = compression;
+  header[6] = encrypted ? PGAUDIT_ENCRYPTION_AES_256_GCM : PGAUDIT_ENCRYPTION_NONE;
+  header[7] = Max(level, 0);
+  pgauditlogtofile_block_put_uint32(header + 8, len);
+  pgauditlogtofile_block_put_uint32(header + 12, payload_len);
+
+  if (!encrypted) {
+    appendBinaryStringInfo(block, (char *) header, PGAUDIT_BLOCK_HEADER_SIZE);
+    appendBinaryStringInfo(block, payload, payload_len);
+  } else {
+#ifdef USE_OPENSSL
+    uint8 *out;
+    int out_len = 0, final_len = 0;
+    bool ok;
+
+    if (!pgauditlogtofile_block_load_key(WARNING)) {
+      if (compressed)
+        pfree(compressed);
+      return false;
+    }
+    pgauditlogtofile_block_put_uint32(header + 16, key_id);
+    /* random nonces, a key is good for 2^32 blocks */
+    if (!pg_strong_random(header + 20, PGAUDIT_BLOCK_NONCE_SIZE)) {
+      ereport(WARNING, (errmsg("could not generate audit block nonce")));
+      if (compressed)
+        pfree(compressed);
+      return false;
+    }
+
+    if (cipher_ctx == NULL) {
+      cipher_ctx = EVP_CIPHER_CTX_new();
+      if (cipher_ctx == NULL ||
+          EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+          EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_SET_IVLEN, PGAUDIT_BLOCK_NONCE_SIZE, NULL) != 1) {
+        ereport(WARNING, (errmsg("could not initialize audit block encryption")));
+        EVP_CIPHER_CTX_free(cipher_ctx);
+        cipher_ctx = NULL;
+        if (compressed)
+          pfree(compressed);
+        return false;
+      }
+    }
+
+    appendBinaryStringInfo(block, (char *) header, PGAUDIT_BLOCK_HEADER_SIZE);
+    enlargeStringInfo(block, payload_len + PGAUDIT_BLOCK_TAG_SIZE);
+    out = (uint8 *) block->data + block->len;
+
+    ok = EVP_EncryptInit_ex(cipher_ctx, NULL, NULL, key, header + 20) == 1 &&
+         EVP_EncryptUpdate(cipher_ctx, NULL, &out_len, header, PGAUDIT_BLOCK_HEADER_SIZE) == 1 &&
+         EVP_EncryptUpdate(cipher_ctx, out, &out_len, (const uint8 *) payload, payload_len) == 1 &&
+         EVP_EncryptFinal_ex(cipher_ctx, out + out_len, &final_len) == 1 &&
+         EVP_CIPHER_CTX_ctrl(cipher_ctx, EVP_CTRL_GCM_GET_TAG, PGAUDIT_BLOCK_TAG_SIZE,
+                             out + out_len + final_len) == 1;
+    if (!ok) {
+      ereport(WARNING, (errmsg("could not encrypt audit block")));
+      block->len -= PGAUDIT_BLOCK_HEADER_SIZE;
+      block->data[block->len] = '\0';
+      if (compressed)
+        pfree(compressed);
+      return false;
+    }
+    block->len += out_len + final_len + PGAUDIT_BLOCK_TAG_SIZE;
+    block->data[block->len] = '\0';
+#else
+    ereport(WARNING, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                      errmsg("pgaudit.log_encryption_key_file requires a server built with OpenSSL")));
+    if (compressed)
+      pfree(compressed);
+    return false;
+#endif
+  }
+
+  if (compressed)
+    pfree(compressed);
+
+  return true;
+}
@@ -0,0 +1,75 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_block.h
+ *      compressed and encrypted blocks of audit records
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_BLOCK_H
+#define PGAUDITLOGTOFILE_BLOCK_H
+
+#include "lib/stringinfo.h"
+#include "utils/guc.h"
+
+/*
+ * Every block starts with a header of PGAUDIT_BLOCK_HEADER_SIZE bytes, all
+ * integers little endian:
+ *   0  magic "\0PAF", a NUL never appears in the text of the records
+ *   4  format version
+ *   5  compression
+ *   6  encryption
+ *   7  compression level, informative only, 0 if not known
+ *   8  bytes of the records
+ *  12  bytes stored after the header, without the tag
+ *  16  key id: first 4 bytes of the SHA-256 of the key, 0 without encryption
+ *  20  nonce of 12 bytes, zeroes without encryption
+ * followed by the stored bytes and, when encrypted, the 16 bytes GCM tag.
+ * The header is authenticated as additional data.
+ */
+#define PGAUDIT_BLOCK_MAGIC "\0PAF"
+#define PGAUDIT_BLOCK_MAGIC_LENGTH 4
+#define PGAUDIT_BLOCK_VERSION 1
+#define PGAUDIT_BLOCK_HEADER_SIZE 32
+#define PGAUDIT_BLOCK_NONCE_SIZE 12
+#define PGAUDIT_BLOCK_TAG_SIZE 16
+#define PGAUDIT_BLOCK_KEY_SIZE 32
+
+/*
+ * Compression of the blocks, zlib always and LZ4 frames and zstd frames when
+ * the server is built with them. The value is stored in every block header.
+ */
+typedef enum pgAuditLogToFileCompression {
+  PGAUDIT_COMPRESSION_NONE = 0,
+  PGAUDIT_COMPRESSION_ZLIB = 1,
+  PGAUDIT_COMPRESSION_LZ4 = 2,
+  PGAUDIT_COMPRESSION_ZSTD = 3
+} pgAuditLogToFileCompression;
+
+/* Default level of each compression */
+#define PGAUDIT_COMPRESSION_LEVEL_DEFAULT -1
+
+/* Encryption of the blocks */
+#define PGAUDIT_ENCRYPTION_NONE 0
+#define PGAUDIT_ENCRYPTION_AES_256_GCM 1
+
+/* GUC variables */
+extern int guc_pgaudit_log_block_size;
+extern int guc_pgaudit_log_compression;
+extern int guc_pgaudit_log_compression_level;
+extern bool guc_pgaudit_log_compression_adaptive;
+extern char *guc_pgaudit_log_encryption_key_file;
+extern const struct config_enum_entry pgauditlogtofile_compression_options[];
+
+/* Blocks */
+void pgauditlogtofile_block_check(void);
+bool pgauditlogtofile_block_enabled(void);
+bool pgauditlogtofile_block_encode(const char *data, int len, StringInfo block);
+
+/* Adaptive level, background worker only */
+void pgauditlogtofile_block_adapt(double backlog, double arrival_speed);
+
+#endif
@@ -0,0 +1,104 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_checkpoint.c
+ *      CRC32C checkpoint records of the text audit files
+ *
+ * The background worker reads back the text audit file being written and,
+ * once pgaudit.log_checkpoint bytes have been added since the previous
+ * checkpoint, writes a checkpoint record with the offset, length and
+ * CRC32C of those bytes. The checkpoint records are written like any other
+ * record, so they are covered by the next checkpoint too.
+ *
+ * The ranges are absolute, since the records of the backends can be
+ * written between the read and the checkpoint. After a restart of the
+ * worker the first checkpoint covers the file from its start again.
+ * tools/auditrecover checks the ranges and cuts a damaged tail.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+
+#include "logtofile.h"
+#include "logtofile_block.h"
+#include "logtofile_checkpoint.h"
+#include "logtofile_stats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Defines */
+#define CHECKPOINT_READ_SIZE 65536
+
+/* GUC variables */
+int guc_pgaudit_log_checkpoint = 0;
+
+/* Range of the audit file being checked */
+static char checkpoint_path[MAXPGPATH];
+static uint64 range_start = 0;
+static uint64 range_end = 0;
+static pg_crc32c range_crc;
+static char *read_buffer = NULL;
+
+
+/*
+ * Checks if the checkpoint records have to be written: text audit files only,
+ * the blocks are authenticated on their own
+ */
+bool pgauditlogtofile_checkpoint_enabled(void) {
+  return guc_pgaudit_log_checkpoint > 0 && !pgauditlogtofile_block_enabled();
+}
+
+/*
+ * Adds the new bytes of the audit file to the range, and writes the
+ * checkpoint record when it is long enough
+ */
+void pgauditlogtofile_checkpoint_run(void) {
+  pgAuditLogToFileCounters counters;
+  ssize_t len;
+  int fd;
+
+  if (read_buffer == NULL)
+    read_buffer = MemoryContextAlloc(TopMemoryContext, CHECKPOINT_READ_SIZE);
+
+  /* the last file opened by any process */
+  pgauditlogtofile_counters_snapshot(&counters);
+  if (counters.filename[0] == '\0')
+    return;
+
+  if (strcmp(checkpoint_path, counters.filename) != 0) {
+    strlcpy(checkpoint_path, counters.filename, MAXPGPATH);
+    range_start = range_end = 0;
+    INIT_CRC32C(range_crc);
+  }
+
+  fd = OpenTransientFile(checkpoint_path, O_RDONLY | PG_BINARY);
+  if (fd < 0)
+    return;
+
+  if (lseek(fd, range_end, SEEK_SET) == (off_t) range_end) {
+    while ((len = read(fd, read_buffer, CHECKPOINT_READ_SIZE)) > 0) {
+      COMP_CRC32C(range_crc, read_buffer, len);
+      range_end += len;
+    }
+  }
+  CloseTransientFile(fd);
+
+  if (range_end - range_start >= (uint64) guc_pgaudit_log_checkpoint * 1024) {
+    pg_crc32c crc = range_crc;
+
+    FIN_CRC32C(crc);
+    /* it goes through the logging hook like any pgaudit message */
+    ereport(LOG, (errmsg(PGAUDIT_CHECKPOINT_MESSAGE, range_start, range_end - range_start, crc),
+                  errhidestmt(true)));
+
+    range_start = range_end;
+    INIT_CRC32C(range_crc);
+  }
+}
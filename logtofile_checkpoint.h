@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_checkpoint.h
+ *      CRC32C checkpoint records of the text audit files
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_CHECKPOINT_H
+#define PGAUDITLOGTOFILE_CHECKPOINT_H
+
+/* Message of the checkpoint records, as pgaudit would write it */
+#define PGAUDIT_CHECKPOINT_MESSAGE "AUDIT: CHECKPOINT,,,,,,,offset=" UINT64_FORMAT " length=" UINT64_FORMAT " crc32c=%08x,"
+
+/* GUC variables */
+extern int guc_pgaudit_log_checkpoint;
+
+/* Background worker only */
+bool pgauditlogtofile_checkpoint_enabled(void);
+void pgauditlogtofile_checkpoint_run(void);
+
+#endif
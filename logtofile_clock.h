@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_clock.h
+ *      clock used for the audit timestamps and the file rotation
+ *
+ * Builds with PGAUDITLOGTOFILE_TEST_CLOCK (make TEST_CLOCK=1) replace it by
+ * a clock that runs pgaudit.log_test_clock_scale times faster, so rotations
+ * can be benchmarked every few seconds. Never use them in production.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_CLOCK_H
+#define PGAUDITLOGTOFILE_CLOCK_H
+
+#include "pgtime.h"
+
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef PGAUDITLOGTOFILE_TEST_CLOCK
+
+/* GUC variables */
+extern int guc_pgaudit_log_test_clock_scale;
+extern char *guc_pgaudit_log_test_trace_directory;
+
+void pgauditlogtofile_testclock_init(void);
+void pgauditlogtofile_gettimeofday(struct timeval *tv);
+void pgauditlogtofile_testclock_count_open(void);
+void pgauditlogtofile_testclock_trace(uint64 latency_us);
+
+static inline pg_time_t pgauditlogtofile_time(void) {
+  struct timeval tv;
+
+  pgauditlogtofile_gettimeofday(&tv);
+  return (pg_time_t) tv.tv_sec;
+}
+
+#else
+
+#define pgauditlogtofile_gettimeofday(tv) gettimeofday(tv, NULL)
+#define pgauditlogtofile_time() ((pg_time_t) time(NULL))
+
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_degrade.c
+ *      minimal audit records while the audit pipeline is overloaded
+ *
+ * The background worker watches the part of the ring of the worker in use
+ * and the average time the logging hook takes per record. When one of them
+ * goes over pgaudit.log_degrade_backlog or pgaudit.log_degrade_latency it
+ * writes a DEGRADED record and sets a flag in shared memory, and from then
+ * on the backends write the pgaudit records in a minimal layout:
+ *
+ *   timestamp,session id,audit type,statement id,substatement id,class,
+ *   command,object type,object name,statement hash
+ *
+ * The statement hash is the 64-bit hash of PostgreSQL of the statement
+ * field as pgaudit writes it, in hex, and the parameters are left out. No
+ * record is dropped and no backend waits for the full text to be written.
+ *
+ * Once both values stay under half their limit for DEGRADE_RESTORE_MS the
+ * flag is cleared and a RESTORED record is written. The switches go
+ * through the logging hook like any pgaudit message: the DEGRADED record
+ * is written before the first minimal record, while a record formatted as
+ * the flag is cleared can still follow the RESTORED one, so the readers
+ * tell them apart by the number of fields. The rest of the messages, as
+ * the connections or the records of the worker, are always written in
+ * full.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+#if (PG_VERSION_NUM >= 130000)
+#include "common/hashfn.h"
+#elif (PG_VERSION_NUM >= 120000)
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+
+#include "logtofile.h"
+#include "logtofile_degrade.h"
+#include "logtofile_format.h"
+#include "logtofile_reorder.h"
+#include "logtofile_stats.h"
+
+/* Defines */
+/* Time both values have to stay under half their limit to restore */
+#define DEGRADE_RESTORE_MS 5000
+#define DEGRADE_HASH_SEED 0
+
+/* SHM structure */
+typedef struct pgAuditLogToFileDegradeShm {
+  pg_atomic_uint32 active;
+} pgAuditLogToFileDegradeShm;
+
+static pgAuditLogToFileDegradeShm *pgaudit_degrade_shm = NULL;
+
+/* Worker state */
+static uint64 last_latency_sum_us = 0;
+static uint64 last_latency_count = 0;
+static TimestampTz calm_since = 0;
+
+/* GUC variables */
+int guc_pgaudit_log_degrade_backlog = 0;
+int guc_pgaudit_log_degrade_latency = 0;
+
+/* Internal functions */
+static uint64 pgauditlogtofile_degrade_hash(const char *data, int len);
+static uint64 pgauditlogtofile_degrade_latency(void);
+
+
+/*
+ * Request the SHMEM used by the flag, always: the limits can be set on reload
+ */
+void pgauditlogtofile_degrade_shmem_request(void) {
+  RequestAddinShmemSpace(MAXALIGN(sizeof(pgAuditLogToFileDegradeShm)));
+}
+
+/*
+ * Initialize the flag SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_degrade_shmem_startup(void) {
+  bool found;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_degrade_shm = NULL;
+
+  pgaudit_degrade_shm = ShmemInitStruct("pgauditlogtofile_degrade", sizeof(pgAuditLogToFileDegradeShm), &found);
+  if (!found)
+    pg_atomic_init_u32(&pgaudit_degrade_shm->active, 0);
+}
+
+/*
+ * Checks if the records are written in the minimal layout
+ */
+bool pgauditlogtofile_degrade_active(void) {
+  return pgaudit_degrade_shm != NULL && pg_atomic_read_u32(&pgaudit_degrade_shm->active) != 0;
+}
+
+/*
+ * Formats a pgaudit record in the minimal layout, false if it has to be
+ * written in full
+ */
+bool pgauditlogtofile_degrade_line(StringInfo buf, const ErrorData *edata, int exclude_nchars) {
+  const char *msg;
+  const char *statement;
+  int statement_len;
+
+  if (!pgauditlogtofile_degrade_active() || exclude_nchars <= 0)
+    return false;
+
+  /* SESSION and OBJECT records only */
+  msg = edata->message + exclude_nchars;
+  if (strncmp(msg, "SESSION,", 8) != 0 && strncmp(msg, "OBJECT,", 7) != 0)
+    return false;
+
+  statement_len = pgauditlogtofile_audit_field(msg, PGAUDIT_FIELD_STATEMENT, &statement);
+  if (statement_len < 0)
+    return false;
+
+  pgauditlogtofile_format_log_time();
+  appendStringInfoString(buf, pgauditlogtofile_formatted_log_time());
+  appendStringInfoCharMacro(buf, ',');
+
+  /* session id - hex representation of start time . session process id */
+  appendStringInfo(buf, "%lx.%x", (long)MyStartTime, MyProcPid);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* the fields before the statement, as pgaudit wrote them */
+  appendBinaryStringInfo(buf, msg, statement - msg);
+  appendStringInfo(buf, "%016" INT64_MODIFIER "x", pgauditlogtofile_degrade_hash(statement, statement_len));
+
+  appendStringInfoCharMacro(buf, '\n');
+  return true;
+}
+
+/*
+ * 64-bit hash of the statement
+ */
+static uint64 pgauditlogtofile_degrade_hash(const char *data, int len) {
+#if (PG_VERSION_NUM >= 130000)
+  return hash_bytes_extended((const unsigned char *) data, len, DEGRADE_HASH_SEED);
+#else
+  return DatumGetUInt64(hash_any_extended((const unsigned char *) data, len, DEGRADE_HASH_SEED));
+#endif
+}
+
+/*
+ * Checks if the worker has to watch the pipeline: a limit is set, or the
+ * minimal layout is still on after they were unset
+ */
+bool pgauditlogtofile_degrade_enabled(void) {
+  return pgaudit_degrade_shm != NULL &&
+         (guc_pgaudit_log_degrade_backlog > 0 || guc_pgaudit_log_degrade_latency > 0 ||
+          pgauditlogtofile_degrade_active());
+}
+
+/*
+ * Average microseconds of the logging hook since the previous call
+ */
+static uint64 pgauditlogtofile_degrade_latency(void) {
+  pgAuditLogToFileCounters counters;
+  uint64 count = 0;
+  uint64 latency_us = 0;
+  int i;
+
+  pgauditlogtofile_counters_snapshot(&counters);
+  for (i = 0; i < PGAUDITLOGTOFILE_LATENCY_BUCKETS; i++)
+    count += counters.latency_buckets[i];
+
+  if (count > last_latency_count)
+    latency_us = (counters.latency_sum_us - last_latency_sum_us) / (count - last_latency_count);
+
+  last_latency_sum_us = counters.latency_sum_us;
+  last_latency_count = count;
+  return latency_us;
+}
+
+/*
+ * Switches to the minimal layout when a limit is passed, and back to the
+ * full records when both values have been low for a while
+ */
+void pgauditlogtofile_degrade_run(void) {
+  int backlog = (int) (pgauditlogtofile_reorder_backlog() * 100);
+  uint64 latency_us = pgauditlogtofile_degrade_latency();
+  bool over_backlog = guc_pgaudit_log_degrade_backlog > 0 && backlog >= guc_pgaudit_log_degrade_backlog;
+  bool over_latency = guc_pgaudit_log_degrade_latency > 0 && latency_us >= (uint64) guc_pgaudit_log_degrade_latency;
+  TimestampTz now = GetCurrentTimestamp();
+
+  if (!pgauditlogtofile_degrade_active()) {
+    if (over_backlog || over_latency) {
+      /* the marker goes first, so it is before any minimal record */
+      ereport(LOG, (errmsg(PGAUDIT_DEGRADED_MESSAGE, backlog, latency_us), errhidestmt(true)));
+      pg_atomic_write_u32(&pgaudit_degrade_shm->active, 1);
+      calm_since = 0;
+    }
+    return;
+  }
+
+  if (backlog * 2 >= guc_pgaudit_log_degrade_backlog && guc_pgaudit_log_degrade_backlog > 0)
+    calm_since = 0;
+  else if (latency_us * 2 >= (uint64) guc_pgaudit_log_degrade_latency && guc_pgaudit_log_degrade_latency > 0)
+    calm_since = 0;
+  else if (calm_since == 0)
+    calm_since = now;
+
+  if (calm_since != 0 && TimestampDifferenceExceeds(calm_since, now, DEGRADE_RESTORE_MS)) {
+    /* the marker goes last, after the records formatted while it was on */
+    pg_atomic_write_u32(&pgaudit_degrade_shm->active, 0);
+    ereport(LOG, (errmsg(PGAUDIT_RESTORED_MESSAGE, backlog, latency_us), errhidestmt(true)));
+    calm_since = 0;
+  }
+}
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_degrade.h
+ *      minimal audit records while the audit pipeline is overloaded
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_DEGRADE_H
+#define PGAUDITLOGTOFILE_DEGRADE_H
+
+#include "lib/stringinfo.h"
+
+/* Messages of the records that mark the switches, as pgaudit would write them */
+#define PGAUDIT_DEGRADED_MESSAGE "AUDIT: DEGRADED,,,,,,,backlog=%d%% hook_latency_us=" UINT64_FORMAT ","
+#define PGAUDIT_RESTORED_MESSAGE "AUDIT: RESTORED,,,,,,,backlog=%d%% hook_latency_us=" UINT64_FORMAT ","
+
+/* GUC variables */
+extern int guc_pgaudit_log_degrade_backlog;
+extern int guc_pgaudit_log_degrade_latency;
+
+/* SHMEM functions */
+void pgauditlogtofile_degrade_shmem_request(void);
+void pgauditlogtofile_degrade_shmem_startup(void);
+
+/* Backends */
+bool pgauditlogtofile_degrade_active(void);
+bool pgauditlogtofile_degrade_line(StringInfo buf, const ErrorData *edata, int exclude_nchars);
+
+/* Switches, background worker only */
+bool pgauditlogtofile_degrade_enabled(void);
+void pgauditlogtofile_degrade_run(void);
+
+#endif
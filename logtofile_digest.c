@@ -0,0 +1,466 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_digest.c
+ *      chained block digests of the audit files
+ *
+ * The background worker reads the audit file being written and, for every
+ * block of pgaudit.log_digest_block bytes, appends to the digest file next
+ * to it (PGAUDIT_DIGEST_SUFFIX) the SHA-256 digest of the block and a chain
+ * digest over the previous one. When the audit file is rotated its last
+ * partial block is added and the digest file is closed with the root of a
+ * Merkle tree over the block digests, signed with the HMAC key found in
+ * pgaudit.log_digest_key_file.
+ *
+ *   leaf  = SHA-256(0x00 || block)
+ *   chain = SHA-256(previous chain || leaf), 32 zero bytes before the first
+ *   node  = SHA-256(0x01 || left || right), an odd node is promoted as is
+ *   hmac  = HMAC-SHA-256(key, root line without its last column)
+ *
+ * Every block can be checked on its own, which is what tools/digestcheck
+ * does in parallel, and the chain and the signed root cover their order
+ * and number. The digests are resumed from the digest file when the worker
+ * restarts.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#if (PG_VERSION_NUM >= 140000)
+#include "common/cryptohash.h"
+#include "common/hmac.h"
+#include "common/sha2.h"
+#endif
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/resowner.h"
+
+#include "logtofile.h"
+#include "logtofile_digest.h"
+#include "logtofile_stats.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defines */
+#define DIGEST_LENGTH 32
+#define DIGEST_HEX_LENGTH (DIGEST_LENGTH * 2)
+#define DIGEST_READ_SIZE 65536
+#define DIGEST_MAX_KEY 1024
+#define DIGEST_HEADER "# pgauditlogtofile digest sha256 block "
+
+/* Digests of an audit file */
+typedef struct pgAuditLogToFileDigestFile {
+  char path[MAXPGPATH];
+  char digest_path[MAXPGPATH];
+  uint64 block_size;
+  uint64 offset; /* bytes covered by the blocks */
+  uint64 blocks;
+  uint8 chain[DIGEST_LENGTH];
+  uint8 *leaves;
+  uint64 max_leaves;
+  bool has_header;
+  bool finished; /* signed, or not to be touched anymore */
+} pgAuditLogToFileDigestFile;
+
+/* GUC variables */
+int guc_pgaudit_log_digest_block = 0;
+char *guc_pgaudit_log_digest_key_file = NULL;
+
+#if (PG_VERSION_NUM >= 140000)
+static pgAuditLogToFileDigestFile current;
+static bool have_current = false;
+static char *read_buffer = NULL;
+
+/* Internal functions */
+static void pgauditlogtofile_digest_append(pgAuditLogToFileDigestFile *f, const char *line, bool sync);
+static bool pgauditlogtofile_digest_block(pgAuditLogToFileDigestFile *f, int fd, uint64 len, uint8 *leaf);
+static void pgauditlogtofile_digest_file(pgAuditLogToFileDigestFile *f, bool final);
+static bool pgauditlogtofile_digest_hex_decode(const char *hex, uint8 *dest);
+static void pgauditlogtofile_digest_hex_encode(const uint8 *digest, char *dest);
+static void pgauditlogtofile_digest_resume(pgAuditLogToFileDigestFile *f, const char *path);
+static void pgauditlogtofile_digest_sha256(const uint8 *a, size_t alen, const uint8 *b, size_t blen,
+                                           const uint8 *c, size_t clen, uint8 *dest);
+static void pgauditlogtofile_digest_sign(pgAuditLogToFileDigestFile *f);
+#endif
+
+
+/*
+ * Checks if the audit files have to be digested
+ */
+bool pgauditlogtofile_digest_enabled(void) {
+#if (PG_VERSION_NUM >= 140000)
+  return guc_pgaudit_log_digest_block > 0;
+#else
+  static bool reported = false;
+
+  if (guc_pgaudit_log_digest_block > 0 && !reported) {
+    ereport(LOG, (errmsg("pgaudit.log_digest_block requires PostgreSQL 14 or later")));
+    reported = true;
+  }
+  return false;
+#endif
+}
+
+/*
+ * Digests the new blocks of the current audit file, and signs the previous
+ * one when it has been rotated
+ */
+void pgauditlogtofile_digest_run(void) {
+#if (PG_VERSION_NUM >= 140000)
+  pgAuditLogToFileCounters counters;
+
+  /* the cryptohash contexts are tracked by a resource owner */
+  if (CurrentResourceOwner == NULL)
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "pgauditlogtofile digest");
+  if (read_buffer == NULL)
+    read_buffer = MemoryContextAlloc(TopMemoryContext, DIGEST_READ_SIZE);
+
+  /* the last file opened by any process */
+  pgauditlogtofile_counters_snapshot(&counters);
+
+  if (have_current && strcmp(current.path, counters.filename) != 0) {
+    if (!current.finished)
+      pgauditlogtofile_digest_file(&current, true);
+    have_current = false;
+  }
+
+  if (counters.filename[0] == '\0')
+    return;
+
+  if (!have_current) {
+    pgauditlogtofile_digest_resume(&current, counters.filename);
+    have_current = true;
+  }
+
+  if (!current.finished)
+    pgauditlogtofile_digest_file(&current, false);
+#endif
+}
+
+#if (PG_VERSION_NUM >= 140000)
+/*
+ * SHA-256 of the concatenation of up to three buffers
+ */
+static void pgauditlogtofile_digest_sha256(const uint8 *a, size_t alen, const uint8 *b, size_t blen,
+                                           const uint8 *c, size_t clen, uint8 *dest) {
+  pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+
+  if (ctx == NULL || pg_cryptohash_init(ctx) < 0 ||
+      pg_cryptohash_update(ctx, a, alen) < 0 ||
+      (blen > 0 && pg_cryptohash_update(ctx, b, blen) < 0) ||
+      (clen > 0 && pg_cryptohash_update(ctx, c, clen) < 0) ||
+      pg_cryptohash_final(ctx, dest, DIGEST_LENGTH) < 0)
+    ereport(ERROR, (errmsg("could not compute the audit file digest")));
+
+  pg_cryptohash_free(ctx);
+}
+
+static void pgauditlogtofile_digest_hex_encode(const uint8 *digest, char *dest) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < DIGEST_LENGTH; i++) {
+    dest[i * 2] = hex[digest[i] >> 4];
+    dest[i * 2 + 1] = hex[digest[i] & 0x0f];
+  }
+  dest[DIGEST_HEX_LENGTH] = '\0';
+}
+
+static bool pgauditlogtofile_digest_hex_decode(const char *hex, uint8 *dest) {
+  int i;
+
+  for (i = 0; i < DIGEST_HEX_LENGTH; i++) {
+    char c = hex[i];
+    int v;
+
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return false;
+
+    if (i % 2 == 0)
+      dest[i / 2] = v << 4;
+    else
+      dest[i / 2] |= v;
+  }
+  return hex[DIGEST_HEX_LENGTH] == '\0' || hex[DIGEST_HEX_LENGTH] == '\t' || hex[DIGEST_HEX_LENGTH] == '\n';
+}
+
+/*
+ * Appends a line to the digest file, with the header if it is new
+ */
+static void pgauditlogtofile_digest_append(pgAuditLogToFileDigestFile *f, const char *line, bool sync) {
+  FILE *fh;
+
+  fh = AllocateFile(f->digest_path, "a");
+  if (fh == NULL) {
+    ereport(LOG, (errcode_for_file_access(),
+                  errmsg("could not open digest file \"%s\": %m", f->digest_path)));
+    return;
+  }
+
+  if (!f->has_header) {
+    fprintf(fh, DIGEST_HEADER UINT64_FORMAT "\n", f->block_size);
+    f->has_header = true;
+  }
+  fputs(line, fh);
+
+  if (fflush(fh) != 0 || (sync && pg_fsync(fileno(fh)) != 0))
+    ereport(LOG, (errcode_for_file_access(),
+                  errmsg("could not write digest file \"%s\": %m", f->digest_path)));
+  FreeFile(fh);
+}
+
+/*
+ * Digest of the next len bytes of the audit file
+ */
+static bool pgauditlogtofile_digest_block(pgAuditLogToFileDigestFile *f, int fd, uint64 len, uint8 *leaf) {
+  static const uint8 leaf_prefix = 0x00;
+  pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+  uint64 done = 0;
+
+  if (ctx == NULL || pg_cryptohash_init(ctx) < 0 || pg_cryptohash_update(ctx, &leaf_prefix, 1) < 0)
+    ereport(ERROR, (errmsg("could not compute the audit file digest")));
+
+  if (lseek(fd, f->offset, SEEK_SET) != (off_t) f->offset) {
+    pg_cryptohash_free(ctx);
+    return false;
+  }
+
+  while (done < len) {
+    ssize_t rc = read(fd, read_buffer, Min(len - done, DIGEST_READ_SIZE));
+
+    if (rc <= 0) {
+      pg_cryptohash_free(ctx);
+      return false;
+    }
+    if (pg_cryptohash_update(ctx, (uint8 *) read_buffer, rc) < 0)
+      ereport(ERROR, (errmsg("could not compute the audit file digest")));
+    done += rc;
+  }
+
+  if (pg_cryptohash_final(ctx, leaf, DIGEST_LENGTH) < 0)
+    ereport(ERROR, (errmsg("could not compute the audit file digest")));
+  pg_cryptohash_free(ctx);
+
+  return true;
+}
+
+/*
+ * Digests the complete blocks of the audit file, and the last partial one
+ * and the signed root when the file is not written anymore
+ */
+static void pgauditlogtofile_digest_file(pgAuditLogToFileDigestFile *f, bool final) {
+  struct stat st;
+  int fd;
+
+  fd = OpenTransientFile(f->path, O_RDONLY | PG_BINARY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      CloseTransientFile(fd);
+    return;
+  }
+
+  if ((uint64) st.st_size < f->offset) {
+    ereport(WARNING, (errmsg("audit file \"%s\" is shorter than its digests, it is not digested anymore",
+                             f->path)));
+    CloseTransientFile(fd);
+    f->finished = true;
+    return;
+  }
+
+  while ((uint64) st.st_size - f->offset >= f->block_size ||
+         (final && (uint64) st.st_size > f->offset)) {
+    uint64 len = Min((uint64) st.st_size - f->offset, f->block_size);
+    uint8 leaf[DIGEST_LENGTH];
+    char leaf_hex[DIGEST_HEX_LENGTH + 1], chain_hex[DIGEST_HEX_LENGTH + 1];
+    char line[64 + 2 * DIGEST_HEX_LENGTH];
+
+    if (!pgauditlogtofile_digest_block(f, fd, len, leaf)) {
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not read audit file \"%s\": %m", f->path)));
+      break;
+    }
+    pgauditlogtofile_digest_sha256(f->chain, DIGEST_LENGTH, leaf, DIGEST_LENGTH, NULL, 0, f->chain);
+
+    if (f->blocks == f->max_leaves) {
+      f->max_leaves *= 2;
+      f->leaves = repalloc(f->leaves, f->max_leaves * DIGEST_LENGTH);
+    }
+    memcpy(f->leaves + f->blocks * DIGEST_LENGTH, leaf, DIGEST_LENGTH);
+
+    pgauditlogtofile_digest_hex_encode(leaf, leaf_hex);
+    pgauditlogtofile_digest_hex_encode(f->chain, chain_hex);
+    snprintf(line, sizeof(line), "block\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t%s\t%s\n",
+             f->blocks, f->offset, len, leaf_hex, chain_hex);
+    pgauditlogtofile_digest_append(f, line, false);
+
+    f->offset += len;
+    f->blocks++;
+  }
+  CloseTransientFile(fd);
+
+  if (final)
+    pgauditlogtofile_digest_sign(f);
+}
+
+/*
+ * Closes the digest file with the Merkle root, signed if there is a key
+ */
+static void pgauditlogtofile_digest_sign(pgAuditLogToFileDigestFile *f) {
+  static const uint8 node_prefix = 0x01;
+  uint8 root[DIGEST_LENGTH], mac[DIGEST_LENGTH];
+  char root_hex[DIGEST_HEX_LENGTH + 1], chain_hex[DIGEST_HEX_LENGTH + 1], mac_hex[DIGEST_HEX_LENGTH + 1];
+  char line[64 + 3 * DIGEST_HEX_LENGTH];
+  uint64 n = f->blocks, i;
+  uint8 *level;
+  int len;
+
+  /* reduce the leaves level by level */
+  memset(root, 0, DIGEST_LENGTH);
+  if (n > 0) {
+    level = palloc(n * DIGEST_LENGTH);
+    memcpy(level, f->leaves, n * DIGEST_LENGTH);
+    while (n > 1) {
+      for (i = 0; i < n / 2; i++)
+        pgauditlogtofile_digest_sha256(&node_prefix, 1,
+                                       level + 2 * i * DIGEST_LENGTH, DIGEST_LENGTH,
+                                       level + (2 * i + 1) * DIGEST_LENGTH, DIGEST_LENGTH,
+                                       level + i * DIGEST_LENGTH);
+      if (n % 2 == 1)
+        memmove(level + (n / 2) * DIGEST_LENGTH, level + (n - 1) * DIGEST_LENGTH, DIGEST_LENGTH);
+      n = (n + 1) / 2;
+    }
+    memcpy(root, level, DIGEST_LENGTH);
+    pfree(level);
+  }
+
+  pgauditlogtofile_digest_hex_encode(root, root_hex);
+  pgauditlogtofile_digest_hex_encode(f->chain, chain_hex);
+  len = snprintf(line, sizeof(line), "root\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t%s\t%s",
+                 f->blocks, f->offset, root_hex, chain_hex);
+
+  strcpy(mac_hex, "-");
+  if (guc_pgaudit_log_digest_key_file != NULL && guc_pgaudit_log_digest_key_file[0] != '\0') {
+    char key[DIGEST_MAX_KEY];
+    size_t key_len = 0;
+    FILE *fh = AllocateFile(guc_pgaudit_log_digest_key_file, "r");
+
+    if (fh != NULL) {
+      key_len = fread(key, 1, sizeof(key), fh);
+      FreeFile(fh);
+      /* a trailing line end is not part of the key */
+      while (key_len > 0 && (key[key_len - 1] == '\n' || key[key_len - 1] == '\r'))
+        key_len--;
+    }
+
+    if (key_len == 0) {
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not read digest key file \"%s\", digest of \"%s\" is not signed",
+                           guc_pgaudit_log_digest_key_file, f->path)));
+    } else {
+      pg_hmac_ctx *ctx = pg_hmac_create(PG_SHA256);
+
+      if (ctx == NULL || pg_hmac_init(ctx, (uint8 *) key, key_len) < 0 ||
+          pg_hmac_update(ctx, (uint8 *) line, len) < 0 ||
+          pg_hmac_final(ctx, mac, DIGEST_LENGTH) < 0)
+        ereport(ERROR, (errmsg("could not compute the audit file signature")));
+      pg_hmac_free(ctx);
+      pgauditlogtofile_digest_hex_encode(mac, mac_hex);
+    }
+    explicit_bzero(key, sizeof(key));
+  }
+
+  snprintf(line + len, sizeof(line) - len, "\t%s\n", mac_hex);
+  pgauditlogtofile_digest_append(f, line, true);
+  f->finished = true;
+}
+
+/*
+ * Starts the digests of an audit file where its digest file left them
+ */
+static void pgauditlogtofile_digest_resume(pgAuditLogToFileDigestFile *f, const char *path) {
+  char line[256];
+  FILE *fh;
+  long complete = 0;
+  bool corrupted = false;
+
+  if (f->leaves == NULL) {
+    f->max_leaves = 64;
+    f->leaves = MemoryContextAlloc(TopMemoryContext, f->max_leaves * DIGEST_LENGTH);
+  }
+  strlcpy(f->path, path, MAXPGPATH);
+  snprintf(f->digest_path, MAXPGPATH, "%s" PGAUDIT_DIGEST_SUFFIX, path);
+  f->block_size = (uint64) guc_pgaudit_log_digest_block * 1024;
+  f->offset = 0;
+  f->blocks = 0;
+  memset(f->chain, 0, DIGEST_LENGTH);
+  f->has_header = false;
+  f->finished = false;
+
+  fh = AllocateFile(f->digest_path, "r");
+  if (fh == NULL)
+    return;
+
+  while (!corrupted && fgets(line, sizeof(line), fh) != NULL) {
+    char *fields[6];
+    char *field;
+    int n = 0;
+
+    /* a line being written when the worker stopped */
+    if (strchr(line, '\n') == NULL)
+      break;
+
+    if (strncmp(line, DIGEST_HEADER, strlen(DIGEST_HEADER)) == 0) {
+      f->block_size = strtoull(line + strlen(DIGEST_HEADER), NULL, 10);
+      f->has_header = true;
+      complete = ftell(fh);
+      continue;
+    }
+
+    for (field = strtok(line, "\t\n"); field != NULL && n < 6; field = strtok(NULL, "\t\n"))
+      fields[n++] = field;
+
+    if (!f->has_header) {
+      corrupted = true;
+    } else if (n >= 2 && strcmp(fields[0], "root") == 0) {
+      f->finished = true;
+    } else if (n == 6 && strcmp(fields[0], "block") == 0 &&
+               strtoull(fields[1], NULL, 10) == f->blocks &&
+               strtoull(fields[2], NULL, 10) == f->offset) {
+      if (f->blocks == f->max_leaves) {
+        f->max_leaves *= 2;
+        f->leaves = repalloc(f->leaves, f->max_leaves * DIGEST_LENGTH);
+      }
+      if (!pgauditlogtofile_digest_hex_decode(fields[4], f->leaves + f->blocks * DIGEST_LENGTH) ||
+          !pgauditlogtofile_digest_hex_decode(fields[5], f->chain))
+        corrupted = true;
+      f->offset += strtoull(fields[3], NULL, 10);
+      f->blocks++;
+    } else
+      corrupted = true;
+
+    if (!corrupted)
+      complete = ftell(fh);
+  }
+  FreeFile(fh);
+
+  if (corrupted || (f->has_header && f->block_size == 0)) {
+    ereport(WARNING, (errmsg("digest file \"%s\" is not valid, audit file \"%s\" is not digested",
+                             f->digest_path, f->path)));
+    f->finished = true;
+    return;
+  }
+
+  /* drop the incomplete line, the block is digested again */
+  if (!f->finished && truncate(f->digest_path, complete) != 0)
+    ereport(LOG, (errcode_for_file_access(),
+                  errmsg("could not truncate digest file \"%s\": %m", f->digest_path)));
+}
+#endif
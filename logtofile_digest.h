@@ -0,0 +1,26 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_digest.h
+ *      chained block digests of the audit files
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_DIGEST_H
+#define PGAUDITLOGTOFILE_DIGEST_H
+
+/* Suffix of the digest file written next to each audit file */
+#define PGAUDIT_DIGEST_SUFFIX ".digest"
+
+/* GUC variables */
+extern int guc_pgaudit_log_digest_block;
+extern char *guc_pgaudit_log_digest_key_file;
+
+/* Background worker only */
+bool pgauditlogtofile_digest_enabled(void);
+void pgauditlogtofile_digest_run(void);
+
+#endif
@@ -0,0 +1,426 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_format.c
+ *      formatting and classification of the audit log lines
+ *
+ * Everything in the path from an ErrorData to the text of an audit line
+ * lives here, without touching SHMEM, GUCs or files, so it can be built and
+ * measured outside the server (see bench/).
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ * Copyright (c) 2014, 2ndQuadrant Ltd.
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "access/xact.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "pgtime.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/ps_status.h"
+
+#include "logtofile_clock.h"
+#include "logtofile_format.h"
+
+/* Extracted from src/backend/po */
+static const char * postgresConnMsg[] = {
+  "connection received: host=%s port=%s",
+  "connection received: host=%s",
+  "connection authorized: user=%s",
+  "connection authenticated: identity=\"%s\" method=%s (%s:%d)",
+  "replication connection authorized: user=%s",
+  "replication connection authorized: user=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
+  "replication connection authorized: user=%s application_name=%s",
+  "replication connection authorized: user=%s application_name=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
+  "password authentication failed for user \"%s\"",
+  "authentication failed for user \"%s\": host rejected",
+  "\"trust\" authentication failed for user \"%s\"",
+  "Ident authentication failed for user \"%s\"",
+  "Peer authentication failed for user \"%s\"",
+  "password authentication failed for user \"%s\"",
+  "SSPI authentication failed for user \"%s\"",
+  "PAM authentication failed for user \"%s\"",
+  "BSD authentication failed for user \"%s\"",
+  "LDAP authentication failed for user \"%s\"",
+  "certificate authentication failed for user \"%s\"",
+  "RADIUS authentication failed for user \"%s\"",
+  "authentication failed for user \"%s\": invalid authentication method",
+  "connection authorized: user=%s database=%s",
+  "connection authorized: user=%s database=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
+  "connection authorized: user=%s database=%s application_name=%s",
+  "connection authorized: user=%s database=%s application_name=%s SSL enabled (protocol=%s, cipher=%s, bits=%d, compression=%s)",
+};
+
+/* Extracted from src/backend/po */
+static const char * postgresDisconnMsg[] = {
+  "disconnection: session time: %d:%02d:%02d.%03d user=%s database=%s host=%s%s%s"
+};
+
+/* Buffers for formatted timestamps */
+static char formatted_start_time[FORMATTED_TS_LEN];
+static char formatted_log_time[FORMATTED_TS_LEN];
+static uint64 formatted_log_time_ms = 0;
+
+/* Internal functions */
+static char ** pgauditlogtofile_unique_prefixes(const char **messages, const size_t num_messages, size_t *num_unique);
+
+
+/*
+ * Unique prefixes, up to the first format specifier, of the messages
+ */
+static char ** pgauditlogtofile_unique_prefixes(const char **messages, const size_t num_messages, size_t *num_unique) {
+  bool is_unique;
+  char **prefixes = NULL;
+  char *message, *prefix, *dup;
+  size_t i, j;
+
+  *num_unique = 0;
+
+  prefixes = palloc(num_messages * sizeof(char *));
+  if (prefixes != NULL) {
+    for (i = 0; i < num_messages; i++) {
+  #ifdef ENABLE_NLS
+      // Get translation - static copy
+      message = gettext(messages[i]);
+  #else
+      // Pointer to original = static copy
+      message = messages[i];
+  #endif
+      // Get a copy that we can modify
+      dup = pstrdup(message);
+      if (dup != NULL) {
+        prefix = strtok(dup, "%");
+        if (prefix != NULL) {
+          // Search duplicated
+          is_unique = true;
+          for (j = 0; j < i; j++) {
+            if (prefixes[j] != NULL) {
+              if (strcmp(prefixes[j], prefix) == 0) {
+                // Skip - prefix already present
+                is_unique = false;
+              }
+            }
+          }
+
+          if (is_unique) {
+            prefixes[i] = palloc((strlen(prefix) + 1) * sizeof(char));
+            if (prefixes[i] != NULL) {
+              strcpy(prefixes[i], prefix);
+              *num_unique += 1;
+            }
+          } else {
+            prefixes[i] = NULL;
+          }
+        }
+        pfree(dup);
+      }
+    }
+  }
+
+  return prefixes;
+}
+
+/*
+ * Builds the unique prefixes of the connection or the disconnection messages
+ */
+pgAuditLogToFilePrefix **pgauditlogtofile_build_prefixes(bool disconnection, size_t *num_prefixes, pgAuditLogToFileAllocFunc alloc_func) {
+  const char **messages;
+  size_t num_messages, i, j;
+  char **prefixes = NULL;
+  pgAuditLogToFilePrefix **result;
+
+  if (disconnection) {
+    messages = postgresDisconnMsg;
+    num_messages = sizeof(postgresDisconnMsg) / sizeof(char *);
+  } else {
+    messages = postgresConnMsg;
+    num_messages = sizeof(postgresConnMsg) / sizeof(char *);
+  }
+
+  prefixes = pgauditlogtofile_unique_prefixes(messages, num_messages, num_prefixes);
+  result = alloc_func(*num_prefixes * sizeof(pgAuditLogToFilePrefix *));
+  for (i = 0, j = 0; i < num_messages; i++) {
+    if (prefixes != NULL && prefixes[i] != NULL) {
+      result[j] = alloc_func(sizeof(pgAuditLogToFilePrefix));
+      result[j]->length = strlen(prefixes[i]);
+      result[j]->prefix = alloc_func( (result[j]->length + 1) * sizeof(char) );
+      strcpy(result[j]->prefix, prefixes[i]);
+      pfree(prefixes[i]);
+      j++;
+    }
+  }
+  pfree(prefixes);
+
+  return result;
+}
+
+/*
+ * Checks if a message starts with one of the prefixes
+ */
+bool pgauditlogtofile_match_prefix(const char *msg, pgAuditLogToFilePrefix **prefixes, size_t num_prefixes) {
+  size_t i;
+
+  for (i = 0; i < num_prefixes; i++) {
+    if (pg_strncasecmp(msg, prefixes[i]->prefix, prefixes[i]->length) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Locates the field n (0 based) of a pgaudit message, skipping the commas
+ * inside quoted fields. Returns the length of the field or -1 if the message
+ * has less fields.
+ */
+int pgauditlogtofile_audit_field(const char *msg, int n, const char **field) {
+  const char *p = msg;
+  const char *start;
+  int i;
+
+  for (i = 0;; i++) {
+    start = p;
+    if (*p == '"') {
+      /* quoted field, ends in a quote that is not escaped by another quote */
+      for (p++; *p != '\0'; p++) {
+        if (*p == '"') {
+          if (p[1] != '"') {
+            p++;
+            break;
+          }
+          p++;
+        }
+      }
+    }
+    while (*p != '\0' && *p != ',')
+      p++;
+
+    if (i == n) {
+      *field = start;
+      return p - start;
+    }
+
+    if (*p == '\0')
+      return -1;
+    p++;
+  }
+}
+
+/*
+ * Formats an audit log line
+ */
+void pgauditlogtofile_create_audit_line(StringInfo buf, const ErrorData *edata, int exclude_nchars) {
+  bool print_stmt = false;
+
+  /* static counter for line numbers */
+  static long log_line_number = 0;
+
+  /* has counter been reset in current process? */
+  static int log_my_pid = 0;
+
+  /*
+   * This is one of the few places where we'd rather not inherit a static
+   * variable's value from the postmaster.  But since we will, reset it when
+   * MyProcPid changes.
+   */
+  if (log_my_pid != MyProcPid) {
+    /* new session */
+    log_line_number = 0;
+    log_my_pid = MyProcPid;
+    /* start session timestamp */
+    pgauditlogtofile_format_start_time();
+  }
+  log_line_number++;
+
+  /* timestamp with milliseconds */
+  pgauditlogtofile_format_log_time();
+  appendStringInfoString(buf, formatted_log_time);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* username */
+  if (MyProcPort && MyProcPort->user_name)
+    appendStringInfoString(buf, MyProcPort->user_name);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* database name */
+  if (MyProcPort && MyProcPort->database_name)
+    appendStringInfoString(buf, MyProcPort->database_name);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* Process id  */
+  appendStringInfo(buf, "%d", log_my_pid);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* Remote host and port */
+  if (MyProcPort && MyProcPort->remote_host) {
+    appendStringInfoString(buf, MyProcPort->remote_host);
+    if (MyProcPort->remote_port && MyProcPort->remote_port[0] != '\0') {
+      appendStringInfoCharMacro(buf, ':');
+      appendStringInfoString(buf, MyProcPort->remote_port);
+    }
+  }
+  appendStringInfoCharMacro(buf, ',');
+
+  /* session id - hex representation of start time . session process id */
+  appendStringInfo(buf, "%lx.%x", (long)MyStartTime, log_my_pid);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* Line number */
+  appendStringInfo(buf, "%ld", log_line_number);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* PS display */
+  if (MyProcPort) {
+    StringInfoData msgbuf;
+    const char *psdisp;
+    int displen;
+
+    initStringInfo(&msgbuf);
+
+    psdisp = get_ps_display(&displen);
+    appendBinaryStringInfo(&msgbuf, psdisp, displen);
+    appendStringInfoString(buf, msgbuf.data);
+
+    pfree(msgbuf.data);
+  }
+  appendStringInfoCharMacro(buf, ',');
+
+  /* session start timestamp */
+  appendStringInfoString(buf, formatted_start_time);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* Virtual transaction id */
+  /* keep VXID format in sync with lockfuncs.c */
+  if (MyProc != NULL && MyProc->backendId != InvalidBackendId)
+    appendStringInfo(buf, "%d/%u", MyProc->backendId, MyProc->lxid);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* Transaction id */
+  appendStringInfo(buf, "%u", GetTopTransactionIdIfAny());
+  appendStringInfoCharMacro(buf, ',');
+
+  /* SQL state code */
+  appendStringInfoString(buf, unpack_sql_state(edata->sqlerrcode));
+  appendStringInfoCharMacro(buf, ',');
+
+  /* errmessage - PGAUDIT formatted text, +7 exclude "AUDIT: " prefix */
+  appendStringInfoString(buf, edata->message + exclude_nchars);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* errdetail or errdetail_log */
+  if (edata->detail_log)
+    appendStringInfoString(buf, edata->detail_log);
+  else if (edata->detail)
+    appendStringInfoString(buf, edata->detail);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* errhint */
+  if (edata->hint)
+    appendStringInfoString(buf, edata->hint);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* internal query */
+  if (edata->internalquery)
+    appendStringInfoString(buf, edata->internalquery);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* if printed internal query, print internal pos too */
+  if (edata->internalpos > 0 && edata->internalquery != NULL)
+    appendStringInfo(buf, "%d", edata->internalpos);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* errcontext */
+  if (edata->context)
+    appendStringInfoString(buf, edata->context);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* user query --- only reported if not disabled by the caller */
+  if (debug_query_string != NULL && !edata->hide_stmt)
+    print_stmt = true;
+  if (print_stmt)
+    appendStringInfoString(buf, debug_query_string);
+  appendStringInfoCharMacro(buf, ',');
+  if (print_stmt && edata->cursorpos > 0)
+    appendStringInfo(buf, "%d", edata->cursorpos);
+  appendStringInfoCharMacro(buf, ',');
+
+  /* file error location */
+  if (Log_error_verbosity >= PGERROR_VERBOSE) {
+    StringInfoData msgbuf;
+
+    initStringInfo(&msgbuf);
+
+    if (edata->funcname && edata->filename)
+      appendStringInfo(&msgbuf, "%s, %s:%d", edata->funcname, edata->filename,
+                       edata->lineno);
+    else if (edata->filename)
+      appendStringInfo(&msgbuf, "%s:%d", edata->filename, edata->lineno);
+    appendStringInfoString(buf, msgbuf.data);
+    pfree(msgbuf.data);
+  }
+  appendStringInfoCharMacro(buf, ',');
+
+  /* application name */
+  if (application_name)
+    appendStringInfoString(buf, application_name);
+
+  appendStringInfoCharMacro(buf, '\n');
+}
+
+/*
+ * Formats the session start time
+ */
+void pgauditlogtofile_format_start_time(void) {
+  /*
+   * Note: we expect that guc.c will ensure that log_timezone is set up (at
+   * least with a minimal GMT value) before Log_line_prefix can become
+   * nonempty or CSV mode can be selected.
+   */
+  pg_strftime(formatted_start_time, FORMATTED_TS_LEN, "%Y-%m-%d %H:%M:%S %Z",
+              pg_localtime((pg_time_t *)&MyStartTime, log_timezone));
+}
+
+/*
+ * Formats the record time
+ */
+void pgauditlogtofile_format_log_time(void) {
+  struct timeval tv;
+  char msbuf[5];
+
+  pgauditlogtofile_gettimeofday(&tv);
+
+  /*
+   * Note: we expect that guc.c will ensure that log_timezone is set up (at
+   * least with a minimal GMT value) before Log_line_prefix can become
+   * nonempty or CSV mode can be selected.
+   */
+  pg_strftime(formatted_log_time, FORMATTED_TS_LEN,
+              /* leave room for milliseconds... */
+              "%Y-%m-%d %H:%M:%S     %Z",
+              pg_localtime((pg_time_t *)&(tv.tv_sec), log_timezone));
+
+  /* 'paste' milliseconds into place... */
+  sprintf(msbuf, ".%03d", (int)(tv.tv_usec / 1000));
+  memcpy(formatted_log_time + 19, msbuf, 4);
+
+  formatted_log_time_ms = (uint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * Last record time formatted
+ */
+const char *pgauditlogtofile_formatted_log_time(void) {
+  return formatted_log_time;
+}
+
+/*
+ * Milliseconds since the epoch of the last record time formatted
+ */
+uint64 pgauditlogtofile_log_time_ms(void) {
+  return formatted_log_time_ms;
+}
@@ -0,0 +1,57 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_format.h
+ *      formatting and classification of the audit log lines
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ * Copyright (c) 2014, 2ndQuadrant Ltd.
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_FORMAT_H
+#define PGAUDITLOGTOFILE_FORMAT_H
+
+#include "lib/stringinfo.h"
+
+/* Defines */
+#define PGAUDIT_PREFIX_LINE "AUDIT: "
+#define PGAUDIT_PREFIX_LINE_LENGTH sizeof(PGAUDIT_PREFIX_LINE) - 1
+#define FORMATTED_TS_LEN 128
+
+/* Fields of a pgaudit message */
+#define PGAUDIT_FIELD_AUDIT_TYPE 0
+#define PGAUDIT_FIELD_STATEMENT_ID 1
+#define PGAUDIT_FIELD_SUBSTATEMENT_ID 2
+#define PGAUDIT_FIELD_CLASS 3
+#define PGAUDIT_FIELD_COMMAND 4
+#define PGAUDIT_FIELD_OBJECT_TYPE 5
+#define PGAUDIT_FIELD_OBJECT_NAME 6
+#define PGAUDIT_FIELD_STATEMENT 7
+#define PGAUDIT_FIELD_PARAMETER 8
+
+/* Prefix of a connection or disconnection message */
+typedef struct pgAuditLogToFilePrefix {
+  char *prefix;
+  int length;
+} pgAuditLogToFilePrefix;
+
+/* Allocator for the prefixes, ShmemAlloc or palloc */
+typedef void *(*pgAuditLogToFileAllocFunc) (Size size);
+
+/* Connection and disconnection messages */
+pgAuditLogToFilePrefix **pgauditlogtofile_build_prefixes(bool disconnection, size_t *num_prefixes, pgAuditLogToFileAllocFunc alloc_func);
+bool pgauditlogtofile_match_prefix(const char *msg, pgAuditLogToFilePrefix **prefixes, size_t num_prefixes);
+
+/* Audit log lines */
+void pgauditlogtofile_create_audit_line(StringInfo buf, const ErrorData *edata, int exclude_nchars);
+void pgauditlogtofile_format_log_time(void);
+const char *pgauditlogtofile_formatted_log_time(void);
+uint64 pgauditlogtofile_log_time_ms(void);
+void pgauditlogtofile_format_start_time(void);
+
+/* pgaudit message parsing */
+int pgauditlogtofile_audit_field(const char *msg, int n, const char **field);
+
+#endif
@@ -0,0 +1,499 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_hold.c
+ *      legal hold snapshots of the audit files
+ *
+ * pgauditlogtofile_legal_hold() keeps a copy of the audit files of a time
+ * range in a directory of its own under pgaudit.log_hold_directory. Every
+ * file is cloned with FICLONE when the file system shares extents (XFS,
+ * btrfs), which takes no time and no space whatever the size of the file.
+ * Elsewhere the audit files that are not written anymore are hard linked,
+ * and the rest are copied with copy_file_range, or read and written when
+ * that is not available either.
+ *
+ * A backend keeps appending to the previous audit file until it notices a
+ * rotation, so only the files older than the two newest ones, and not
+ * modified for HOLD_CLOSED_AGE_S plus the longest rotation lag seen, are
+ * hard linked. The link is made read only, which makes the audit file read
+ * only too, and it is copied instead if its size or modification time
+ * changed meanwhile.
+ *
+ * An audit file belongs to the range when it was modified after its start
+ * and the previous audit file was not modified after its end: the names
+ * depend on pgaudit.log_filename, so the modification times are used
+ * instead. The digest files next to the audit files are kept too.
+ *
+ * The MANIFEST, with the SHA-256 of every file, is written last, so a hold
+ * directory without it is not complete.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#if (PG_VERSION_NUM >= 140000)
+#include "common/cryptohash.h"
+#endif
+#include "common/file_perm.h"
+#include "common/sha2.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "logtofile.h"
+#include "logtofile_digest.h"
+#include "logtofile_hold.h"
+#include "logtofile_stats.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+/* Defines */
+#define PGAUDITLOGTOFILE_HOLD_COLS 4
+#define HOLD_NAME_MAXLEN 64
+#define HOLD_COPY_SIZE 65536
+#define HOLD_SHA256_HEX_LENGTH (PG_SHA256_DIGEST_LENGTH * 2)
+/* Seconds without changes, besides the rotation lag, of a closed audit file */
+#define HOLD_CLOSED_AGE_S 60
+
+/* Audit file found in pgaudit.log_directory */
+typedef struct pgAuditLogToFileHoldFile {
+  char name[MAXPGPATH];
+  pg_time_t mtime;
+} pgAuditLogToFileHoldFile;
+
+/* GUC variables */
+char *guc_pgaudit_log_hold_directory = NULL;
+
+/* SQL functions */
+PG_FUNCTION_INFO_V1(pgauditlogtofile_legal_hold);
+
+/* Internal functions */
+static int pgauditlogtofile_hold_cmp(const void *a, const void *b);
+static const char *pgauditlogtofile_hold_copy(const char *src, const char *dest, bool closed, uint64 *bytes);
+static bool pgauditlogtofile_hold_link(const char *src, const char *dest, const struct stat *src_st);
+static const char *pgauditlogtofile_hold_copy_data(int src_fd, int dest_fd, off_t size, const char *src,
+                                                   const char *dest);
+static bool pgauditlogtofile_hold_is_audit_file(const char *name);
+static int pgauditlogtofile_hold_open_dest(const char *dest);
+static void pgauditlogtofile_hold_sha256(const char *path, char *hex);
+static void pgauditlogtofile_hold_write_manifest(const char *hold_path, StringInfo manifest);
+
+
+/*
+ * Checks if a file of pgaudit.log_directory is an audit file: the text of
+ * pgaudit.log_filename before its first and after its last time pattern
+ */
+static bool pgauditlogtofile_hold_is_audit_file(const char *name) {
+  const char *pattern = guc_pgaudit_log_filename;
+  const char *first = strchr(pattern, '%');
+  const char *last = strrchr(pattern, '%');
+  size_t name_len = strlen(name);
+  size_t prefix_len, suffix_len;
+
+  if (name[0] == '.')
+    return false;
+  if (name_len > strlen(PGAUDIT_DIGEST_SUFFIX) &&
+      strcmp(name + name_len - strlen(PGAUDIT_DIGEST_SUFFIX), PGAUDIT_DIGEST_SUFFIX) == 0)
+    return false;
+  if (first == NULL)
+    return strcmp(name, pattern) == 0;
+
+  prefix_len = first - pattern;
+  suffix_len = last[1] != '\0' ? strlen(last + 2) : 0;
+
+  return name_len >= prefix_len + suffix_len &&
+         strncmp(name, pattern, prefix_len) == 0 &&
+         strcmp(name + name_len - suffix_len, pattern + strlen(pattern) - suffix_len) == 0;
+}
+
+/*
+ * Oldest modified first
+ */
+static int pgauditlogtofile_hold_cmp(const void *a, const void *b) {
+  const pgAuditLogToFileHoldFile *fa = (const pgAuditLogToFileHoldFile *) a;
+  const pgAuditLogToFileHoldFile *fb = (const pgAuditLogToFileHoldFile *) b;
+
+  if (fa->mtime != fb->mtime)
+    return fa->mtime < fb->mtime ? -1 : 1;
+  return strcmp(fa->name, fb->name);
+}
+
+/*
+ * Creates a file of the hold, it must not exist
+ */
+static int pgauditlogtofile_hold_open_dest(const char *dest) {
+  int fd = OpenTransientFile(dest, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY);
+
+  if (fd < 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not create file \"%s\": %m", dest)));
+
+  return fd;
+}
+
+/*
+ * Copies size bytes, with copy_file_range if the kernel can copy them on its
+ * own. Returns the method used.
+ */
+static const char *pgauditlogtofile_hold_copy_data(int src_fd, int dest_fd, off_t size, const char *src,
+                                                   const char *dest) {
+  const char *method = "copy";
+  off_t copied = 0;
+  char *buffer;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  /* both offsets move, a failure goes on below where it stopped */
+  while (copied < size) {
+    ssize_t rc = copy_file_range(src_fd, NULL, dest_fd, NULL, size - copied, 0);
+
+    if (rc <= 0)
+      break;
+    copied += rc;
+    method = "copy_file_range";
+  }
+#endif
+
+  if (copied >= size)
+    return method;
+
+  buffer = palloc(HOLD_COPY_SIZE);
+  while (copied < size) {
+    ssize_t rc = read(src_fd, buffer, Min(HOLD_COPY_SIZE, size - copied));
+
+    if (rc < 0)
+      ereport(ERROR, (errcode_for_file_access(),
+                      errmsg("could not read file \"%s\": %m", src)));
+    if (rc == 0)
+      break;
+
+    errno = 0;
+    if (write(dest_fd, buffer, rc) != rc) {
+      /* if write didn't set errno, assume problem is no disk space */
+      if (errno == 0)
+        errno = ENOSPC;
+      ereport(ERROR, (errcode_for_file_access(),
+                      errmsg("could not write file \"%s\": %m", dest)));
+    }
+    copied += rc;
+  }
+  pfree(buffer);
+
+  return method;
+}
+
+/*
+ * Hard links a closed audit file into the hold, read only. False if it was
+ * not possible or the file changed meanwhile.
+ */
+static bool pgauditlogtofile_hold_link(const char *src, const char *dest, const struct stat *src_st) {
+  struct stat st;
+
+  if (link(src, dest) != 0)
+    return false;
+
+  /* shared with the audit file: nobody can open it for writing anymore */
+  if (chmod(dest, pg_file_create_mode & (S_IRUSR | S_IRGRP)) == 0 && stat(dest, &st) == 0 &&
+      st.st_size == src_st->st_size && st.st_mtime == src_st->st_mtime)
+    return true;
+
+  /* still written by a backend that has not noticed the rotation */
+  (void) chmod(dest, src_st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+  (void) unlink(dest);
+  return false;
+}
+
+/*
+ * Snapshots a file into the hold: reflink, hard link if it is closed, or
+ * copy. Returns the method used.
+ */
+static const char *pgauditlogtofile_hold_copy(const char *src, const char *dest, bool closed, uint64 *bytes) {
+  const char *method = NULL;
+  struct stat st;
+  int src_fd, dest_fd;
+
+  src_fd = OpenTransientFile(src, O_RDONLY | PG_BINARY);
+  if (src_fd < 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not open file \"%s\": %m", src)));
+  if (fstat(src_fd, &st) != 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not stat file \"%s\": %m", src)));
+  *bytes = st.st_size;
+
+  dest_fd = pgauditlogtofile_hold_open_dest(dest);
+
+#ifdef FICLONE
+  if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+    method = "reflink";
+#endif
+
+  /* an audit file that is not written anymore can be shared */
+  if (method == NULL && closed) {
+    CloseTransientFile(dest_fd);
+    dest_fd = -1;
+    if (unlink(dest) == 0 && pgauditlogtofile_hold_link(src, dest, &st))
+      method = "hardlink";
+    else
+      dest_fd = pgauditlogtofile_hold_open_dest(dest);
+  }
+
+  if (method == NULL)
+    method = pgauditlogtofile_hold_copy_data(src_fd, dest_fd, st.st_size, src, dest);
+
+  /* the hard links were made read only already */
+  if (dest_fd >= 0) {
+    if (fchmod(dest_fd, pg_file_create_mode & (S_IRUSR | S_IRGRP)) != 0 || pg_fsync(dest_fd) != 0)
+      ereport(ERROR, (errcode_for_file_access(),
+                      errmsg("could not sync file \"%s\": %m", dest)));
+    if (fstat(dest_fd, &st) == 0)
+      *bytes = st.st_size;
+    CloseTransientFile(dest_fd);
+  }
+  CloseTransientFile(src_fd);
+
+  return method;
+}
+
+/*
+ * SHA-256 of a file, in hexadecimal
+ */
+static void pgauditlogtofile_hold_sha256(const char *path, char *hex) {
+#if (PG_VERSION_NUM >= 140000)
+  pg_cryptohash_ctx *ctx;
+#else
+  pg_sha256_ctx ctx;
+#endif
+  uint8 digest[PG_SHA256_DIGEST_LENGTH];
+  char *buffer;
+  ssize_t rc;
+  int fd;
+  int i;
+
+  fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+  if (fd < 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not open file \"%s\": %m", path)));
+
+  buffer = palloc(HOLD_COPY_SIZE);
+#if (PG_VERSION_NUM >= 140000)
+  ctx = pg_cryptohash_create(PG_SHA256);
+  if (pg_cryptohash_init(ctx) < 0)
+    elog(ERROR, "could not initialize SHA-256 context");
+#else
+  pg_sha256_init(&ctx);
+#endif
+
+  while ((rc = read(fd, buffer, HOLD_COPY_SIZE)) > 0) {
+#if (PG_VERSION_NUM >= 140000)
+    if (pg_cryptohash_update(ctx, (uint8 *) buffer, rc) < 0)
+      elog(ERROR, "could not update SHA-256 context");
+#else
+    pg_sha256_update(&ctx, (uint8 *) buffer, rc);
+#endif
+  }
+  if (rc < 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not read file \"%s\": %m", path)));
+
+#if (PG_VERSION_NUM >= 140000)
+  if (pg_cryptohash_final(ctx, digest, sizeof(digest)) < 0)
+    elog(ERROR, "could not finalize SHA-256 context");
+  pg_cryptohash_free(ctx);
+#else
+  pg_sha256_final(&ctx, digest);
+#endif
+  pfree(buffer);
+  CloseTransientFile(fd);
+
+  for (i = 0; i < PG_SHA256_DIGEST_LENGTH; i++)
+    sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/*
+ * Writes the manifest through a temporary file, so it only exists complete
+ */
+static void pgauditlogtofile_hold_write_manifest(const char *hold_path, StringInfo manifest) {
+  char tmp_path[MAXPGPATH];
+  char path[MAXPGPATH];
+  int fd;
+
+  snprintf(tmp_path, MAXPGPATH, "%s/%s.tmp", hold_path, PGAUDIT_HOLD_MANIFEST);
+  snprintf(path, MAXPGPATH, "%s/%s", hold_path, PGAUDIT_HOLD_MANIFEST);
+
+  fd = pgauditlogtofile_hold_open_dest(tmp_path);
+  errno = 0;
+  if (write(fd, manifest->data, manifest->len) != manifest->len) {
+    /* if write didn't set errno, assume problem is no disk space */
+    if (errno == 0)
+      errno = ENOSPC;
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not write file \"%s\": %m", tmp_path)));
+  }
+  if (pg_fsync(fd) != 0)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not fsync file \"%s\": %m", tmp_path)));
+  CloseTransientFile(fd);
+
+  durable_rename(tmp_path, path, ERROR);
+}
+
+/*
+ * SQL function: keeps the audit files written between start_time and
+ * end_time in the hold directory name
+ */
+Datum pgauditlogtofile_legal_hold(PG_FUNCTION_ARGS) {
+  char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  TimestampTz start_time = PG_GETARG_TIMESTAMPTZ(1);
+  TimestampTz end_time = PG_GETARG_TIMESTAMPTZ(2);
+  bool checksums = PG_GETARG_BOOL(3);
+  pgAuditLogToFileCounters counters;
+  pg_time_t closed_before;
+  pgAuditLogToFileHoldFile *files;
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  StringInfoData manifest;
+  char hold_root[MAXPGPATH];
+  char hold_path[MAXPGPATH];
+  DIR *dir;
+  struct dirent *de;
+  int num_files = 0;
+  int max_files = 64;
+  int i;
+
+  if (name[0] == '\0' || name[0] == '.' || strlen(name) >= HOLD_NAME_MAXLEN ||
+      strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-") != strlen(name))
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid legal hold name \"%s\"", name),
+                    errdetail("Names can only contain letters, digits, \".\", \"_\" and \"-\", and cannot start with \".\".")));
+  if (end_time < start_time)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("end of the legal hold must not be before its start")));
+  if (guc_pgaudit_log_directory == NULL || guc_pgaudit_log_directory[0] == '\0' ||
+      guc_pgaudit_log_filename == NULL || guc_pgaudit_log_filename[0] == '\0' ||
+      guc_pgaudit_log_hold_directory == NULL || guc_pgaudit_log_hold_directory[0] == '\0')
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgauditlogtofile legal holds are not available"),
+                    errhint("pgaudit.log_directory, pgaudit.log_filename and pgaudit.log_hold_directory must be set.")));
+
+  /* relative to the audit files, so they are in the same file system */
+  if (is_absolute_path(guc_pgaudit_log_hold_directory))
+    strlcpy(hold_root, guc_pgaudit_log_hold_directory, MAXPGPATH);
+  else
+    snprintf(hold_root, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, guc_pgaudit_log_hold_directory);
+  snprintf(hold_path, MAXPGPATH, "%s/%s", hold_root, name);
+
+  /* Audit files, oldest first */
+  files = palloc(max_files * sizeof(pgAuditLogToFileHoldFile));
+  dir = AllocateDir(guc_pgaudit_log_directory);
+  while ((de = ReadDir(dir, guc_pgaudit_log_directory)) != NULL) {
+    char path[MAXPGPATH];
+    struct stat st;
+
+    if (!pgauditlogtofile_hold_is_audit_file(de->d_name))
+      continue;
+    snprintf(path, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, de->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    if (num_files == max_files) {
+      max_files *= 2;
+      files = repalloc(files, max_files * sizeof(pgAuditLogToFileHoldFile));
+    }
+    strlcpy(files[num_files].name, de->d_name, MAXPGPATH);
+    files[num_files].mtime = st.st_mtime;
+    num_files++;
+  }
+  FreeDir(dir);
+  qsort(files, num_files, sizeof(pgAuditLogToFileHoldFile), pgauditlogtofile_hold_cmp);
+
+  tupstore = pgauditlogtofile_materialize_srf(fcinfo, &tupdesc);
+
+  if (MakePGDirectory(hold_root) < 0 && errno != EEXIST)
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not create directory \"%s\": %m", hold_root)));
+  if (MakePGDirectory(hold_path) < 0) {
+    if (errno == EEXIST)
+      ereport(ERROR, (errcode(ERRCODE_DUPLICATE_OBJECT),
+                      errmsg("legal hold \"%s\" already exists", name)));
+    ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not create directory \"%s\": %m", hold_path)));
+  }
+
+  /* the file being written, and the rotation lag of the backends */
+  pgauditlogtofile_counters_snapshot(&counters);
+  closed_before = (pg_time_t) time(NULL) - HOLD_CLOSED_AGE_S - counters.rotation_lag_ms / 1000;
+
+  initStringInfo(&manifest);
+  appendStringInfo(&manifest, "# pgauditlogtofile legal hold %s from %s", name, timestamptz_to_str(start_time));
+  appendStringInfo(&manifest, " to %s\n", timestamptz_to_str(end_time));
+
+  for (i = 0; i < num_files; i++) {
+    char src[MAXPGPATH];
+    char dest[MAXPGPATH];
+    char src_digest[MAXPGPATH];
+    struct stat st;
+    bool closed;
+    int j;
+
+    if (time_t_to_timestamptz(files[i].mtime) < start_time)
+      continue;
+    if (i > 0 && time_t_to_timestamptz(files[i - 1].mtime) > end_time)
+      break;
+
+    snprintf(src, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, files[i].name);
+    /* the previous file can still be written by the backends that lag */
+    closed = strcmp(src, counters.filename) != 0 && i < num_files - 2 && files[i].mtime < closed_before;
+    snprintf(src_digest, MAXPGPATH, "%s%s", src, PGAUDIT_DIGEST_SUFFIX);
+
+    /* the audit file and its digest file, which the worker may still append to */
+    for (j = 0; j < 2; j++) {
+      Datum values[PGAUDITLOGTOFILE_HOLD_COLS];
+      bool nulls[PGAUDITLOGTOFILE_HOLD_COLS];
+      char file_name[MAXPGPATH];
+      char hex[HOLD_SHA256_HEX_LENGTH + 1];
+      const char *method;
+      uint64 bytes;
+      int k = 0;
+
+      if (j == 1 && stat(src_digest, &st) != 0)
+        break;
+
+      snprintf(file_name, MAXPGPATH, "%s%s", files[i].name, j == 0 ? "" : PGAUDIT_DIGEST_SUFFIX);
+      snprintf(dest, MAXPGPATH, "%s/%s", hold_path, file_name);
+      method = pgauditlogtofile_hold_copy(j == 0 ? src : src_digest, dest, j == 0 && closed, &bytes);
+
+      memset(nulls, 0, sizeof(nulls));
+      values[k++] = CStringGetTextDatum(file_name);
+      values[k++] = Int64GetDatum((int64) bytes);
+      values[k++] = CStringGetTextDatum(method);
+      if (checksums) {
+        pgauditlogtofile_hold_sha256(dest, hex);
+        values[k++] = CStringGetTextDatum(hex);
+      } else {
+        strlcpy(hex, "-", sizeof(hex));
+        nulls[k++] = true;
+      }
+      tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+      appendStringInfo(&manifest, "%s\t" UINT64_FORMAT "\t%s\t%s\n", hex, bytes, method, file_name);
+    }
+  }
+
+  pgauditlogtofile_hold_write_manifest(hold_path, &manifest);
+
+  pfree(manifest.data);
+  pfree(files);
+
+  return (Datum) 0;
+}
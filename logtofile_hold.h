@@ -0,0 +1,21 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_hold.h
+ *      legal hold snapshots of the audit files
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_HOLD_H
+#define PGAUDITLOGTOFILE_HOLD_H
+
+/* Manifest written in every hold directory once the snapshot is complete */
+#define PGAUDIT_HOLD_MANIFEST "MANIFEST"
+
+/* GUC variables */
+extern char *guc_pgaudit_log_hold_directory;
+
+#endif
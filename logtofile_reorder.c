@@ -0,0 +1,575 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_reorder.c
+ *      reorder window that writes the audit records in timestamp order
+ *
+ * Backends copy their formatted records to a ring in shared memory instead
+ * of appending them to the audit file, and the background worker writes
+ * them once they are older than pgaudit.log_reorder_window, sorted by the
+ * time in the line and then by sequence number.
+ *
+ * The memory is bounded by pgaudit.log_reorder_buffer: when the records
+ * held by the worker exceed it, the oldest ones are written before their
+ * time. A backend that finds the ring full waits up to the window for room
+ * and then writes the record itself, as it does while there is no worker or
+ * the record does not fit in half of the ring, and as the processes that
+ * are not attached to shared memory do (disconnections and connections
+ * received). Those records land among the sorted ones, so they are counted
+ * as unordered, as are the records the worker writes after a newer one,
+ * because they arrived late or newer ones were written before their time,
+ * and an audit file can only be searched by bisection when none was
+ * written.
+ *
+ * When the audit file is written in compressed or encrypted blocks the ring
+ * is used even without window, so the worker builds the blocks from the
+ * records of all the backends. The part of the ring in use when a block is
+ * written, and the bytes per second taken from it, drive the adaptive
+ * compression level.
+ *
+ * With pgaudit.log_flush_latency the ring is used too, and the worker
+ * batches the records due before flushing them: the batch is the bytes
+ * that arrive, at the measured speed, in the time left by the latency
+ * ceiling once the measured flush time is taken off. When the audit log is
+ * quiet the batch is smaller than a record and every record is flushed at
+ * once; under load fewer and bigger writes are made, never holding a record
+ * longer than the ceiling allows. The text records of a batch are collected
+ * and written with a single write, since the stdio buffer of the audit file
+ * is flushed by the seek to its end before every write.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "lib/binaryheap.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+
+#include "logtofile.h"
+#include "logtofile_block.h"
+#include "logtofile_clock.h"
+#include "logtofile_reorder.h"
+#include "logtofile_stats.h"
+
+/* Defines */
+/* Length of the marker of the unused end of the ring */
+#define REORDER_WRAP PG_UINT32_MAX
+/* Wait of a backend that finds the ring full */
+#define REORDER_WAIT_US 100L
+#define REORDER_ENTRY_SIZE(len) MAXALIGN(sizeof(pgAuditLogToFileReorderEntry) + (len))
+/* Shortest interval of the arrival speed */
+#define REORDER_SPEED_INTERVAL_S 0.1
+/* Weight of the last flush in the averages of the batching */
+#define REORDER_BATCH_WEIGHT 0.25
+
+/* Record in the ring, followed by the line */
+typedef struct pgAuditLogToFileReorderEntry {
+  uint32 len;
+  uint64 time_ms;
+  uint64 seq;
+} pgAuditLogToFileReorderEntry;
+
+/* SHM structure */
+typedef struct pgAuditLogToFileReorderShm {
+  LWLock *lock;
+  Latch *writer_latch; /* NULL while there is no worker */
+  uint64 head;         /* bytes stored by the backends */
+  uint64 tail;         /* bytes taken by the worker */
+  Size size;
+  char data[FLEXIBLE_ARRAY_MEMBER];
+} pgAuditLogToFileReorderShm;
+
+static pgAuditLogToFileReorderShm *pgaudit_reorder_shm = NULL;
+
+/* Record held by the worker */
+typedef struct pgAuditLogToFileReorderRecord {
+  uint64 time_ms;
+  uint64 seq;
+  uint64 arrival;
+  uint32 len;
+  char line[FLEXIBLE_ARRAY_MEMBER];
+} pgAuditLogToFileReorderRecord;
+
+/* Worker state */
+static MemoryContext ReorderMemoryContext = NULL;
+static binaryheap *pending = NULL;
+static Size pending_bytes = 0;
+static uint64 arrivals = 0;
+static char *drain_buffer = NULL;
+static uint64 last_emitted_ms = 0; /* time of the newest record written */
+static StringInfoData block_records; /* records of the next block */
+static int block_count = 0;
+static StringInfoData batch_records; /* text records of the batch */
+static int batch_count = 0;
+static int unflushed_count = 0; /* records written and not flushed yet */
+static uint64 arrival_bytes = 0; /* taken from the ring since arrival_since */
+static instr_time arrival_since;
+static double arrival_speed = 0;
+static uint64 batch_bytes = 0;    /* written and not flushed yet */
+static uint64 batch_start_ms = 0; /* when the oldest of them was due */
+static double batch_target = 0;   /* bytes of a batch */
+static double flush_ms = 0;       /* time of a flush, average */
+static double latency_ms = 0;     /* from due to flushed, average */
+
+/* GUC variables */
+int guc_pgaudit_log_reorder_window = 0;
+int guc_pgaudit_log_reorder_buffer = 1024;
+int guc_pgaudit_log_flush_latency = 0;
+
+/* Internal functions */
+static void pgauditlogtofile_reorder_adapt(void);
+static void pgauditlogtofile_reorder_arrivals(void);
+static long pgauditlogtofile_reorder_batch_wait(uint64 now_ms);
+static int pgauditlogtofile_reorder_cmp(Datum a, Datum b, void *arg);
+static void pgauditlogtofile_reorder_flush_batch(uint64 now_ms);
+static void pgauditlogtofile_reorder_drain(void);
+static long pgauditlogtofile_reorder_emit(bool all);
+static bool pgauditlogtofile_reorder_needed(void);
+static void pgauditlogtofile_reorder_write_block(void);
+static void pgauditlogtofile_reorder_write_batch(void);
+static Size pgauditlogtofile_reorder_shmem_size(void);
+
+
+/*
+ * Estimate shared memory space needed
+ */
+static Size pgauditlogtofile_reorder_shmem_size(void) {
+  return add_size(offsetof(pgAuditLogToFileReorderShm, data),
+                  MAXALIGN_DOWN((Size) guc_pgaudit_log_reorder_buffer * 1024));
+}
+
+/*
+ * Checks if the ring of the worker is configured
+ */
+bool pgauditlogtofile_reorder_enabled(void) {
+  return pgaudit_reorder_shm != NULL;
+}
+
+/*
+ * Part of the ring not taken by the worker yet, 0 without ring
+ */
+double pgauditlogtofile_reorder_backlog(void) {
+  pgAuditLogToFileReorderShm *shm = pgaudit_reorder_shm;
+  double backlog;
+
+  if (shm == NULL)
+    return 0;
+
+  LWLockAcquire(shm->lock, LW_SHARED);
+  backlog = (double) (shm->head - shm->tail) / shm->size;
+  LWLockRelease(shm->lock);
+
+  return backlog;
+}
+
+/*
+ * Checks if the ring is needed: reorder window, batching or blocks
+ */
+static bool pgauditlogtofile_reorder_needed(void) {
+  return guc_pgaudit_log_reorder_window > 0 || guc_pgaudit_log_flush_latency > 0 ||
+         pgauditlogtofile_block_enabled();
+}
+
+/*
+ * Request the SHMEM and lock used by the ring
+ */
+void pgauditlogtofile_reorder_shmem_request(void) {
+  if (!pgauditlogtofile_reorder_needed())
+    return;
+
+  RequestAddinShmemSpace(pgauditlogtofile_reorder_shmem_size());
+  RequestNamedLWLockTranche("pgauditlogtofile_reorder", 1);
+}
+
+/*
+ * Initialize the ring SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_reorder_shmem_startup(void) {
+  bool found;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_reorder_shm = NULL;
+
+  if (!pgauditlogtofile_reorder_needed())
+    return;
+
+  pgaudit_reorder_shm = ShmemInitStruct("pgauditlogtofile_reorder", pgauditlogtofile_reorder_shmem_size(), &found);
+  if (!found) {
+    pgaudit_reorder_shm->lock = &(GetNamedLWLockTranche("pgauditlogtofile_reorder"))->lock;
+    pgaudit_reorder_shm->writer_latch = NULL;
+    pgaudit_reorder_shm->head = 0;
+    pgaudit_reorder_shm->tail = 0;
+    pgaudit_reorder_shm->size = MAXALIGN_DOWN((Size) guc_pgaudit_log_reorder_buffer * 1024);
+  }
+}
+
+/*
+ * Checks if the records go through the worker: the audit file does not need
+ * to be open in this process
+ */
+bool pgauditlogtofile_reorder_active(void) {
+  return pgaudit_reorder_shm != NULL && MyProc != NULL && pgaudit_reorder_shm->writer_latch != NULL;
+}
+
+/*
+ * Copies a record to the ring, false if the caller has to write it
+ */
+bool pgauditlogtofile_reorder_store(const char *line, int len, uint64 time_ms, uint64 seq) {
+  pgAuditLogToFileReorderShm *shm = pgaudit_reorder_shm;
+  Size needed = REORDER_ENTRY_SIZE(len);
+  long waited_us = 0;
+
+  if (!pgauditlogtofile_reorder_active() || needed > shm->size / 2)
+    return false;
+
+  for (;;) {
+    Latch *latch;
+    Size offset, contiguous, total;
+
+    LWLockAcquire(shm->lock, LW_EXCLUSIVE);
+    latch = shm->writer_latch;
+    if (latch == NULL) {
+      LWLockRelease(shm->lock);
+      return false;
+    }
+
+    offset = shm->head % shm->size;
+    contiguous = shm->size - offset;
+    total = contiguous < needed ? contiguous + needed : needed;
+    if (shm->size - (shm->head - shm->tail) >= total) {
+      pgAuditLogToFileReorderEntry *entry;
+
+      /* records are never split, skip the end of the ring */
+      if (contiguous < needed) {
+        ((pgAuditLogToFileReorderEntry *) (shm->data + offset))->len = REORDER_WRAP;
+        shm->head += contiguous;
+        offset = 0;
+      }
+      entry = (pgAuditLogToFileReorderEntry *) (shm->data + offset);
+      entry->len = len;
+      entry->time_ms = time_ms;
+      entry->seq = seq;
+      memcpy((char *) entry + sizeof(pgAuditLogToFileReorderEntry), line, len);
+      shm->head += needed;
+      LWLockRelease(shm->lock);
+
+      SetLatch(latch);
+      return true;
+    }
+    LWLockRelease(shm->lock);
+
+    /* full: wake up the worker and wait for room up to the window */
+    if (latch == MyLatch || waited_us >= guc_pgaudit_log_reorder_window * 1000L)
+      return false;
+    SetLatch(latch);
+    pg_usleep(REORDER_WAIT_US);
+    waited_us += REORDER_WAIT_US;
+  }
+}
+
+/*
+ * Oldest record first: time, sequence number and arrival to the worker
+ */
+static int pgauditlogtofile_reorder_cmp(Datum a, Datum b, void *arg) {
+  const pgAuditLogToFileReorderRecord *ra = (const pgAuditLogToFileReorderRecord *) DatumGetPointer(a);
+  const pgAuditLogToFileReorderRecord *rb = (const pgAuditLogToFileReorderRecord *) DatumGetPointer(b);
+
+  /* binaryheap keeps the biggest first */
+  if (ra->time_ms != rb->time_ms)
+    return ra->time_ms < rb->time_ms ? 1 : -1;
+  if (ra->seq != rb->seq)
+    return ra->seq < rb->seq ? 1 : -1;
+  if (ra->arrival != rb->arrival)
+    return ra->arrival < rb->arrival ? 1 : -1;
+  return 0;
+}
+
+/*
+ * Starts taking the records of the backends
+ */
+void pgauditlogtofile_reorder_attach(void) {
+  pgAuditLogToFileReorderShm *shm = pgaudit_reorder_shm;
+
+  if (!shm)
+    return;
+
+  ReorderMemoryContext = AllocSetContextCreate(TopMemoryContext,
+                                               "pgauditlogtofile reorder",
+                                               ALLOCSET_DEFAULT_SIZES);
+  /* the records held never exceed the ring twice */
+  pending = binaryheap_allocate(2 * shm->size / REORDER_ENTRY_SIZE(1),
+                                pgauditlogtofile_reorder_cmp, NULL);
+  drain_buffer = MemoryContextAlloc(ReorderMemoryContext, shm->size);
+  {
+    MemoryContext oldcontext = MemoryContextSwitchTo(ReorderMemoryContext);
+
+    if (pgauditlogtofile_block_enabled())
+      initStringInfo(&block_records);
+    else
+      initStringInfo(&batch_records);
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  LWLockAcquire(shm->lock, LW_EXCLUSIVE);
+  shm->writer_latch = MyLatch;
+  LWLockRelease(shm->lock);
+}
+
+/*
+ * Stops taking the records of the backends and writes the ones held
+ */
+void pgauditlogtofile_reorder_detach(void) {
+  pgAuditLogToFileReorderShm *shm = pgaudit_reorder_shm;
+
+  if (!shm || !pending)
+    return;
+
+  LWLockAcquire(shm->lock, LW_EXCLUSIVE);
+  shm->writer_latch = NULL;
+  LWLockRelease(shm->lock);
+
+  pgauditlogtofile_reorder_emit(true);
+}
+
+/*
+ * Writes the records older than the window, returns the milliseconds until
+ * the next one is due or -1 if there is none
+ */
+long pgauditlogtofile_reorder_flush(void) {
+  if (!pending)
+    return -1;
+
+  return pgauditlogtofile_reorder_emit(false);
+}
+
+/*
+ * Moves the records of the ring to the heap. The lock is held only to copy
+ * the bytes.
+ */
+static void pgauditlogtofile_reorder_drain(void) {
+  pgAuditLogToFileReorderShm *shm = pgaudit_reorder_shm;
+  uint64 start, end, pos;
+  Size offset, first;
+
+  LWLockAcquire(shm->lock, LW_EXCLUSIVE);
+  start = shm->tail;
+  end = shm->head;
+  offset = start % shm->size;
+  first = Min(end - start, shm->size - offset);
+  memcpy(drain_buffer, shm->data + offset, first);
+  if (first < end - start)
+    memcpy(drain_buffer + first, shm->data, end - start - first);
+  shm->tail = end;
+  LWLockRelease(shm->lock);
+  arrival_bytes += end - start;
+
+  for (pos = start; pos < end;) {
+    pgAuditLogToFileReorderEntry *entry = (pgAuditLogToFileReorderEntry *) (drain_buffer + (pos - start));
+    pgAuditLogToFileReorderRecord *record;
+
+    if (entry->len == REORDER_WRAP) {
+      pos += shm->size - pos % shm->size;
+      continue;
+    }
+
+    record = MemoryContextAlloc(ReorderMemoryContext,
+                                offsetof(pgAuditLogToFileReorderRecord, line) + entry->len);
+    record->time_ms = entry->time_ms;
+    record->seq = entry->seq;
+    record->arrival = arrivals++;
+    record->len = entry->len;
+    memcpy(record->line, (char *) entry + sizeof(pgAuditLogToFileReorderEntry), entry->len);
+    binaryheap_add(pending, PointerGetDatum(record));
+    pending_bytes += REORDER_ENTRY_SIZE(entry->len);
+
+    pos += REORDER_ENTRY_SIZE(entry->len);
+  }
+}
+
+/*
+ * Writes the records due, or all of them
+ */
+static long pgauditlogtofile_reorder_emit(bool all) {
+  struct timeval tv;
+  uint64 now_ms;
+  long timeout = -1;
+  long wait;
+
+  pgauditlogtofile_reorder_drain();
+  pgauditlogtofile_reorder_arrivals();
+
+  pgauditlogtofile_gettimeofday(&tv);
+  now_ms = (uint64) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+  while (!binaryheap_empty(pending)) {
+    pgAuditLogToFileReorderRecord *record =
+      (pgAuditLogToFileReorderRecord *) DatumGetPointer(binaryheap_first(pending));
+
+    if (!all && record->time_ms + guc_pgaudit_log_reorder_window > now_ms &&
+        pending_bytes <= pgaudit_reorder_shm->size) {
+      timeout = (long) (record->time_ms + guc_pgaudit_log_reorder_window - now_ms);
+      break;
+    }
+
+    binaryheap_remove_first(pending);
+    pending_bytes -= REORDER_ENTRY_SIZE(record->len);
+    /* forced out before its time, or arrived after a newer one was written */
+    if (record->time_ms < last_emitted_ms) {
+      if (guc_pgaudit_log_reorder_window > 0)
+        pgauditlogtofile_counters_add_unordered();
+    } else
+      last_emitted_ms = record->time_ms;
+    if (batch_bytes == 0)
+      batch_start_ms = now_ms;
+    batch_bytes += record->len;
+    if (block_records.data != NULL) {
+      appendBinaryStringInfo(&block_records, record->line, record->len);
+      block_count++;
+      if (block_records.len >= guc_pgaudit_log_block_size * 1024)
+        pgauditlogtofile_reorder_write_block();
+    } else {
+      appendBinaryStringInfo(&batch_records, record->line, record->len);
+      batch_count++;
+    }
+    pfree(record);
+  }
+
+  /* the records due wait for a full batch at most until the ceiling */
+  if (batch_bytes > 0) {
+    wait = all ? 0 : pgauditlogtofile_reorder_batch_wait(now_ms);
+    if (wait == 0)
+      pgauditlogtofile_reorder_flush_batch(now_ms);
+    else if (timeout < 0 || wait < timeout)
+      timeout = wait;
+  }
+
+  return timeout;
+}
+
+/*
+ * Milliseconds the batch can still wait, 0 if it has to be flushed
+ */
+static long pgauditlogtofile_reorder_batch_wait(uint64 now_ms) {
+  double delay_ms;
+
+  if (guc_pgaudit_log_flush_latency <= 0 || batch_bytes >= batch_target)
+    return 0;
+
+  /* the time of the flush itself is part of the latency */
+  delay_ms = guc_pgaudit_log_flush_latency - flush_ms;
+  if (now_ms - batch_start_ms >= delay_ms)
+    return 0;
+
+  return Max((long) (batch_start_ms + delay_ms - now_ms), 1);
+}
+
+/*
+ * Writes the block being built and flushes the audit file, and sizes the
+ * next batch from the speed the records arrive and the time of the flush
+ */
+static void pgauditlogtofile_reorder_flush_batch(uint64 now_ms) {
+  instr_time start, duration;
+  double delay_ms, batch_max;
+
+  INSTR_TIME_SET_CURRENT(start);
+  if (block_count > 0)
+    pgauditlogtofile_reorder_write_block();
+  if (batch_count > 0)
+    pgauditlogtofile_reorder_write_batch();
+  /* the records still in the buffer of the file are lost if it fails */
+  if (!pgauditlogtofile_flush_file()) {
+    for (; unflushed_count > 0; unflushed_count--)
+      pgauditlogtofile_counters_add_dropped();
+  }
+  unflushed_count = 0;
+  INSTR_TIME_SET_CURRENT(duration);
+  INSTR_TIME_SUBTRACT(duration, start);
+
+  flush_ms += REORDER_BATCH_WEIGHT * (INSTR_TIME_GET_MILLISEC(duration) - flush_ms);
+  latency_ms += REORDER_BATCH_WEIGHT *
+                (now_ms - batch_start_ms + INSTR_TIME_GET_MILLISEC(duration) - latency_ms);
+  batch_bytes = 0;
+
+  if (guc_pgaudit_log_flush_latency > 0) {
+    /* never more than a block, or than the ring could hold meanwhile */
+    batch_max = block_records.data != NULL ? guc_pgaudit_log_block_size * 1024.0 :
+                pgaudit_reorder_shm->size / 2.0;
+    delay_ms = Max(guc_pgaudit_log_flush_latency - flush_ms, 0);
+    batch_target = Min(arrival_speed * delay_ms / 1000.0, batch_max);
+  }
+
+  pgauditlogtofile_counters_set_batch((uint64) batch_target, (uint64) (latency_ms * 1000.0));
+}
+
+/*
+ * Measures the bytes per second taken from the ring
+ */
+static void pgauditlogtofile_reorder_arrivals(void) {
+  instr_time now, elapsed;
+  double seconds;
+
+  INSTR_TIME_SET_CURRENT(now);
+  if (INSTR_TIME_IS_ZERO(arrival_since))
+    arrival_since = now;
+  elapsed = now;
+  INSTR_TIME_SUBTRACT(elapsed, arrival_since);
+  seconds = INSTR_TIME_GET_DOUBLE(elapsed);
+  if (seconds >= REORDER_SPEED_INTERVAL_S) {
+    arrival_speed = arrival_bytes / seconds;
+    arrival_bytes = 0;
+    arrival_since = now;
+  }
+}
+
+/*
+ * Passes the backlog of the ring and the speed the records arrive to the
+ * adaptive compression level
+ */
+static void pgauditlogtofile_reorder_adapt(void) {
+  pgauditlogtofile_block_adapt(pgauditlogtofile_reorder_backlog(), arrival_speed);
+}
+
+/*
+ * Writes the text records of the batch in a single write
+ */
+static void pgauditlogtofile_reorder_write_batch(void) {
+  if (!pgauditlogtofile_write_line(batch_records.data, batch_records.len)) {
+    for (; batch_count > 0; batch_count--)
+      pgauditlogtofile_counters_add_dropped();
+  }
+
+  unflushed_count += batch_count;
+  resetStringInfo(&batch_records);
+  batch_count = 0;
+}
+
+/*
+ * Writes the records collected as a block
+ */
+static void pgauditlogtofile_reorder_write_block(void) {
+  StringInfoData block;
+  MemoryContext oldcontext;
+
+  pgauditlogtofile_reorder_adapt();
+
+  oldcontext = MemoryContextSwitchTo(ReorderMemoryContext);
+  initStringInfo(&block);
+  if (!pgauditlogtofile_block_encode(block_records.data, block_records.len, &block) ||
+      !pgauditlogtofile_write_line(block.data, block.len)) {
+    for (; block_count > 0; block_count--)
+      pgauditlogtofile_counters_add_dropped();
+  }
+  pfree(block.data);
+  MemoryContextSwitchTo(oldcontext);
+
+  unflushed_count += block_count;
+  resetStringInfo(&block_records);
+  block_count = 0;
+}
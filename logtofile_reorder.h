@@ -0,0 +1,35 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_reorder.h
+ *      reorder window that writes the audit records in timestamp order
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_REORDER_H
+#define PGAUDITLOGTOFILE_REORDER_H
+
+/* GUC variables */
+extern int guc_pgaudit_log_reorder_window;
+extern int guc_pgaudit_log_reorder_buffer;
+extern int guc_pgaudit_log_flush_latency;
+
+/* SHMEM functions */
+void pgauditlogtofile_reorder_shmem_request(void);
+void pgauditlogtofile_reorder_shmem_startup(void);
+
+/* Backends */
+bool pgauditlogtofile_reorder_active(void);
+bool pgauditlogtofile_reorder_store(const char *line, int len, uint64 time_ms, uint64 seq);
+
+/* Writer, background worker only */
+bool pgauditlogtofile_reorder_enabled(void);
+double pgauditlogtofile_reorder_backlog(void);
+void pgauditlogtofile_reorder_attach(void);
+long pgauditlogtofile_reorder_flush(void);
+void pgauditlogtofile_reorder_detach(void);
+
+#endif
@@ -0,0 +1,423 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_seq.c
+ *      cluster wide sequence numbers of the audit records
+ *
+ * Every audit record gets the next number of a 64-bit counter in shared
+ * memory, appended as the last column of the line, so a missing record
+ * leaves a gap that tools/seqcheck can find. Records that could not be
+ * written to the audit file also take their number.
+ *
+ * When the shared memory is created the counter resumes after the highest
+ * number found at the end of the most recent audit file, and during quiet
+ * periods the background worker writes tick records, so the numbers written
+ * before a crash or a truncation can be told apart from records never
+ * written.
+ *
+ * The compressed or encrypted blocks cannot be read back there, so the
+ * next number is also kept in SEQ_INDEX_FILE in pgaudit.log_directory: the
+ * postmaster writes it exactly when the shared memory goes away, on a
+ * shutdown or a crash of a child, and while running the worker writes it
+ * every second ahead by twice the numbers taken in the last second. The
+ * sequence resumes from it when the audit files are written in blocks or
+ * no number was found at their end. After a crash of the postmaster or of
+ * the host the numbers reserved and not taken are seen as a gap, and only
+ * a burst of more numbers than reserved within a second can be reused.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/shmem.h"
+
+#include "logtofile.h"
+#include "logtofile_seq.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defines */
+/* Bytes read at the end of the last audit file to resume the sequence */
+#define SEQ_TAIL_SIZE 65536
+/* Next sequence number, hidden from the tools that read the directory */
+#define SEQ_INDEX_FILE ".pgauditlogtofile.seq"
+/* Numbers reserved at least by every write of the worker */
+#define SEQ_INDEX_RESERVE_MIN 1000
+
+/* SHM structure */
+typedef struct pgAuditLogToFileSeqShm {
+  pg_atomic_uint64 next;
+} pgAuditLogToFileSeqShm;
+
+static pgAuditLogToFileSeqShm *pgaudit_seq_shm = NULL;
+
+/* Audit file candidate to resume the sequence */
+typedef struct pgAuditLogToFileSeqFile {
+  char path[MAXPGPATH];
+  time_t mtime;
+} pgAuditLogToFileSeqFile;
+
+/* GUC variables */
+bool guc_pgaudit_log_sequence = false;
+int guc_pgaudit_log_sequence_tick = 60;
+
+/* Internal functions */
+static int pgauditlogtofile_seq_cmp_mtime(const void *a, const void *b);
+static bool pgauditlogtofile_seq_match(const char *pattern, const char *name);
+static uint64 pgauditlogtofile_seq_read_index(void);
+static uint64 pgauditlogtofile_seq_read_tail(const char *path);
+static uint64 pgauditlogtofile_seq_resume(void);
+static bool pgauditlogtofile_seq_is_record_start(const char *s, const char *end);
+
+
+/*
+ * Request the SHMEM used by the sequence
+ */
+void pgauditlogtofile_seq_shmem_request(void) {
+  if (!guc_pgaudit_log_sequence)
+    return;
+
+  RequestAddinShmemSpace(MAXALIGN(sizeof(pgAuditLogToFileSeqShm)));
+}
+
+/*
+ * Initialize the sequence SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_seq_shmem_startup(void) {
+  bool found;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_seq_shm = NULL;
+
+  if (!guc_pgaudit_log_sequence)
+    return;
+
+  pgaudit_seq_shm = ShmemInitStruct("pgauditlogtofile_seq", sizeof(pgAuditLogToFileSeqShm), &found);
+  if (!found)
+    pg_atomic_init_u64(&pgaudit_seq_shm->next, pgauditlogtofile_seq_resume());
+}
+
+/*
+ * Checks if the records are numbered
+ */
+bool pgauditlogtofile_seq_enabled(void) {
+  return pgaudit_seq_shm != NULL;
+}
+
+/*
+ * Takes the next sequence number, 0 if disabled
+ */
+uint64 pgauditlogtofile_seq_next(void) {
+  if (!pgaudit_seq_shm)
+    return 0;
+
+  return pg_atomic_fetch_add_u64(&pgaudit_seq_shm->next, 1);
+}
+
+/*
+ * Appends the next sequence number as the last column of an audit line,
+ * returns the number or 0 if disabled
+ */
+uint64 pgauditlogtofile_seq_stamp(StringInfo buf) {
+  uint64 seq;
+
+  if (!pgaudit_seq_shm)
+    return 0;
+
+  /* before the line end */
+  Assert(buf->len > 0 && buf->data[buf->len - 1] == '\n');
+  seq = pgauditlogtofile_seq_next();
+  buf->len--;
+  appendStringInfo(buf, "," UINT64_FORMAT "\n", seq);
+
+  return seq;
+}
+
+/*
+ * Checks if the background worker has to write tick records
+ */
+bool pgauditlogtofile_seq_tick_enabled(void) {
+  return pgaudit_seq_shm != NULL && guc_pgaudit_log_sequence_tick > 0;
+}
+
+/*
+ * Writes a tick record if no record was numbered since the previous call.
+ * It goes through the logging hook like any pgaudit message, so it is
+ * written and rotated as the rest of the records.
+ */
+void pgauditlogtofile_seq_tick(void) {
+  static uint64 last_next = 0;
+  uint64 next;
+
+  if (!pgaudit_seq_shm)
+    return;
+
+  next = pg_atomic_read_u64(&pgaudit_seq_shm->next);
+  if (next == last_next)
+    ereport(LOG, (errmsg(PGAUDIT_TICK_MESSAGE), errhidestmt(true)));
+
+  last_next = pg_atomic_read_u64(&pgaudit_seq_shm->next);
+}
+
+/*
+ * Writes the next sequence number to the index: exactly when no process can
+ * take more, otherwise ahead of it by what can be taken until the next write
+ */
+void pgauditlogtofile_seq_save(bool exact) {
+  static uint64 last_next = 0;
+  static uint64 last_saved = 0;
+  static bool last_failed = false;
+  char path[MAXPGPATH];
+  char tmp_path[MAXPGPATH];
+  uint64 next, saved;
+  FILE *fh;
+
+  if (!pgaudit_seq_shm || guc_pgaudit_log_directory == NULL || guc_pgaudit_log_directory[0] == '\0')
+    return;
+
+  next = pg_atomic_read_u64(&pgaudit_seq_shm->next);
+  saved = next;
+  if (!exact)
+    saved += Max(2 * (last_next > 0 ? next - last_next : 0), SEQ_INDEX_RESERVE_MIN);
+  last_next = next;
+
+  /* the reservation written already covers the new one */
+  if (!exact && saved <= last_saved)
+    return;
+
+  snprintf(path, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, SEQ_INDEX_FILE);
+  snprintf(tmp_path, MAXPGPATH, "%s.tmp", path);
+  fh = AllocateFile(tmp_path, "w");
+  if (fh == NULL) {
+    /* the directory is created with the first audit file */
+    if (!last_failed)
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not open file \"%s\": %m", tmp_path)));
+    last_failed = true;
+    return;
+  }
+  fprintf(fh, UINT64_FORMAT "\n", saved);
+  if (FreeFile(fh) != 0) {
+    if (!last_failed)
+      ereport(LOG, (errcode_for_file_access(),
+                    errmsg("could not write file \"%s\": %m", tmp_path)));
+    last_failed = true;
+    unlink(tmp_path);
+    return;
+  }
+
+  if (durable_rename(tmp_path, path, LOG) == 0) {
+    last_saved = saved;
+    last_failed = false;
+  }
+}
+
+/*
+ * Next sequence number kept in the index, 0 if there is none
+ */
+static uint64 pgauditlogtofile_seq_read_index(void) {
+  char path[MAXPGPATH];
+  unsigned long long next;
+  FILE *fh;
+
+  snprintf(path, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, SEQ_INDEX_FILE);
+  fh = AllocateFile(path, "r");
+  if (fh == NULL)
+    return 0;
+  if (fscanf(fh, "%llu", &next) != 1)
+    next = 0;
+  FreeFile(fh);
+
+  return (uint64) next;
+}
+
+/*
+ * Newest files first
+ */
+static int pgauditlogtofile_seq_cmp_mtime(const void *a, const void *b) {
+  const pgAuditLogToFileSeqFile *fa = (const pgAuditLogToFileSeqFile *) a;
+  const pgAuditLogToFileSeqFile *fb = (const pgAuditLogToFileSeqFile *) b;
+
+  if (fa->mtime != fb->mtime)
+    return fa->mtime > fb->mtime ? -1 : 1;
+  return -strcmp(fa->path, fb->path);
+}
+
+/*
+ * Checks if a file name can be the result of pgaudit.log_filename: each
+ * strftime conversion matches one or more characters
+ */
+static bool pgauditlogtofile_seq_match(const char *pattern, const char *name) {
+  const char *s;
+
+  if (*pattern == '\0')
+    return *name == '\0';
+
+  if (pattern[0] == '%' && pattern[1] != '\0') {
+    if (pattern[1] == '%')
+      return *name == '%' && pgauditlogtofile_seq_match(pattern + 2, name + 1);
+
+    for (s = name; *s != '\0'; s++)
+      if (pgauditlogtofile_seq_match(pattern + 2, s + 1))
+        return true;
+    return false;
+  }
+
+  return *pattern == *name && pgauditlogtofile_seq_match(pattern + 1, name + 1);
+}
+
+/*
+ * Checks if a line starts with the timestamp of an audit record
+ */
+static bool pgauditlogtofile_seq_is_record_start(const char *s, const char *end) {
+  /* YYYY-MM-DD HH: */
+  static const char shape[] = "dddd-dd-dd dd:";
+  int i;
+
+  if (end - s < (int) sizeof(shape) - 1)
+    return false;
+
+  for (i = 0; i < (int) sizeof(shape) - 1; i++) {
+    if (shape[i] == 'd' ? !isdigit((unsigned char) s[i]) : s[i] != shape[i])
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Highest sequence number in the last bytes of an audit file, 0 if none.
+ * The last line of a record ends with a comma and the number, and the next
+ * line starts a new record or is the end of the file.
+ */
+static uint64 pgauditlogtofile_seq_read_tail(const char *path) {
+  char *buf;
+  char *line, *end, *next;
+  off_t size, offset;
+  ssize_t len;
+  uint64 max_seq = 0;
+  int fd;
+
+  fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+  if (fd < 0)
+    return 0;
+
+  size = lseek(fd, 0, SEEK_END);
+  offset = size > SEQ_TAIL_SIZE ? size - SEQ_TAIL_SIZE : 0;
+  buf = palloc(SEQ_TAIL_SIZE + 1);
+  len = -1;
+  if (lseek(fd, offset, SEEK_SET) == offset)
+    len = read(fd, buf, SEQ_TAIL_SIZE);
+  CloseTransientFile(fd);
+  if (len <= 0) {
+    pfree(buf);
+    return 0;
+  }
+  buf[len] = '\0';
+  end = buf + len;
+
+  /* the first line may be partial */
+  line = buf;
+  if (offset > 0) {
+    line = memchr(buf, '\n', len);
+    line = line ? line + 1 : end;
+  }
+
+  for (; line < end; line = next) {
+    char *eol = memchr(line, '\n', end - line);
+    char *p;
+    uint64 seq = 0;
+
+    /* a line without end was not completely written */
+    if (eol == NULL)
+      break;
+    next = eol + 1;
+
+    if (next < end && !pgauditlogtofile_seq_is_record_start(next, end))
+      continue;
+
+    for (p = eol; p > line && isdigit((unsigned char) p[-1]); p--)
+      ;
+    if (p == eol || p == line || p[-1] != ',')
+      continue;
+    for (; p < eol; p++)
+      seq = seq * 10 + (*p - '0');
+
+    if (seq > max_seq)
+      max_seq = seq;
+  }
+
+  pfree(buf);
+  return max_seq;
+}
+
+/*
+ * First sequence number after a start: the larger of the next to the
+ * highest one at the end of the most recent audit file that has them and
+ * the one of the index
+ */
+static uint64 pgauditlogtofile_seq_resume(void) {
+  pgAuditLogToFileSeqFile *files;
+  int num_files = 0, max_files = 16, i;
+  const char *pattern;
+  struct dirent *de;
+  struct stat st;
+  uint64 seq = 0, next;
+  DIR *dir;
+
+  if (guc_pgaudit_log_directory == NULL || guc_pgaudit_log_filename == NULL ||
+      stat(guc_pgaudit_log_directory, &st) != 0)
+    return 1;
+
+  /* only the name of the file is matched */
+  pattern = strrchr(guc_pgaudit_log_filename, '/');
+  pattern = pattern ? pattern + 1 : guc_pgaudit_log_filename;
+
+  files = palloc(max_files * sizeof(pgAuditLogToFileSeqFile));
+  dir = AllocateDir(guc_pgaudit_log_directory);
+  while ((de = ReadDirExtended(dir, guc_pgaudit_log_directory, LOG)) != NULL) {
+    if (!pgauditlogtofile_seq_match(pattern, de->d_name))
+      continue;
+
+    if (num_files == max_files) {
+      max_files *= 2;
+      files = repalloc(files, max_files * sizeof(pgAuditLogToFileSeqFile));
+    }
+    snprintf(files[num_files].path, MAXPGPATH, "%s/%s", guc_pgaudit_log_directory, de->d_name);
+    if (stat(files[num_files].path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    files[num_files].mtime = st.st_mtime;
+    num_files++;
+  }
+  FreeDir(dir);
+
+  qsort(files, num_files, sizeof(pgAuditLogToFileSeqFile), pgauditlogtofile_seq_cmp_mtime);
+  for (i = 0; i < num_files && seq == 0; i++) {
+    seq = pgauditlogtofile_seq_read_tail(files[i].path);
+    if (seq > 0)
+      ereport(LOG, (errmsg("pgauditlogtofile sequence resumed after " UINT64_FORMAT " from \"%s\"",
+                           seq, files[i].path)));
+  }
+  pfree(files);
+
+  /*
+   * The index is always read: the blocks are binary and the numbers in them
+   * are not found above, and a text file that was rotated or removed can
+   * leave an older file as the most recent one
+   */
+  next = pgauditlogtofile_seq_read_index();
+  if (next > seq + 1) {
+    ereport(LOG, (errmsg("pgauditlogtofile sequence resumed at " UINT64_FORMAT " from \"%s\"",
+                         next, SEQ_INDEX_FILE)));
+    return next;
+  }
+
+  return seq + 1;
+}
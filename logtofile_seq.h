@@ -0,0 +1,40 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_seq.h
+ *      cluster wide sequence numbers of the audit records
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_SEQ_H
+#define PGAUDITLOGTOFILE_SEQ_H
+
+#include "lib/stringinfo.h"
+
+/* Message of the tick records, as pgaudit would write it */
+#define PGAUDIT_TICK_MESSAGE "AUDIT: TICK,,,,,,,,"
+
+/* GUC variables */
+extern bool guc_pgaudit_log_sequence;
+extern int guc_pgaudit_log_sequence_tick;
+
+/* SHMEM functions */
+void pgauditlogtofile_seq_shmem_request(void);
+void pgauditlogtofile_seq_shmem_startup(void);
+
+/* Sequence numbers */
+bool pgauditlogtofile_seq_enabled(void);
+uint64 pgauditlogtofile_seq_next(void);
+uint64 pgauditlogtofile_seq_stamp(StringInfo buf);
+
+/* Tick records, background worker only */
+bool pgauditlogtofile_seq_tick_enabled(void);
+void pgauditlogtofile_seq_tick(void);
+
+/* Index of the next number, background worker and postmaster */
+void pgauditlogtofile_seq_save(bool exact);
+
+#endif
@@ -0,0 +1,540 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_stats.c
+ *      statistics about the audit records written by pgauditlogtofile
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#if (PG_VERSION_NUM >= 140000)
+#include "utils/backend_status.h"
+#endif
+
+#include "logtofile.h"
+#include "logtofile_stats.h"
+
+/* Defines */
+#define PGAUDITLOGTOFILE_STATS_COLS 7
+#define PGAUDITLOGTOFILE_COUNTERS_COLS 12
+/* Percentage of entries to evict when the hash is full */
+#define STATS_DEALLOC_PERCENT 5
+#define STATS_DEALLOC_MIN 10
+
+/* SHM structure */
+typedef struct pgAuditLogToFileStatsKey {
+  Oid userid;
+  Oid dbid;
+  uint64 queryid;
+} pgAuditLogToFileStatsKey;
+
+typedef struct pgAuditLogToFileStatsEntry {
+  pgAuditLogToFileStatsKey key; /* hash key of entry - MUST BE FIRST */
+  int64 records;
+  int64 bytes;
+  double format_time; /* milliseconds */
+  double write_time;  /* milliseconds */
+  slock_t mutex;      /* protects the counters only */
+} pgAuditLogToFileStatsEntry;
+
+typedef struct pgAuditLogToFileStatsShm {
+  LWLock *lock; /* protects hashtable search/modification */
+} pgAuditLogToFileStatsShm;
+
+typedef struct pgAuditLogToFileCountersShm {
+  pg_atomic_uint64 records;
+  pg_atomic_uint64 bytes;
+  pg_atomic_uint64 dropped;
+  pg_atomic_uint64 file_opens;
+  pg_atomic_uint64 rotations;
+  pg_atomic_uint64 latency_sum_us;
+  pg_atomic_uint64 latency_buckets[PGAUDITLOGTOFILE_LATENCY_BUCKETS];
+  pg_atomic_uint64 memory; /* allocated by the audit memory contexts of all backends */
+  pg_atomic_uint64 batch_bytes;      /* set by the worker only */
+  pg_atomic_uint64 flush_latency_us; /* set by the worker only */
+  pg_atomic_uint64 degraded;         /* written in the minimal layout */
+  pg_atomic_uint64 unordered;        /* written around the reorder window */
+  slock_t mutex; /* protects the fields below */
+  pg_time_t rotation_time;
+  int64 rotation_lag_ms;
+  char filename[MAXPGPATH];
+} pgAuditLogToFileCountersShm;
+
+static pgAuditLogToFileStatsShm *pgaudit_stats_shm = NULL;
+static HTAB *pgaudit_stats_hash = NULL;
+static pgAuditLogToFileCountersShm *pgaudit_counters_shm = NULL;
+
+/* Upper bounds of the hook latency histogram buckets */
+const uint64 pgauditlogtofile_latency_bounds_us[PGAUDITLOGTOFILE_LATENCY_BUCKETS - 1] = {
+  10, 25, 50, 100, 250, 500,
+  1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000
+};
+
+/* GUC variables */
+int guc_pgaudit_log_stats_max = 1000;
+
+/* SQL functions */
+PG_FUNCTION_INFO_V1(pgauditlogtofile_stats);
+PG_FUNCTION_INFO_V1(pgauditlogtofile_stat_statements);
+PG_FUNCTION_INFO_V1(pgauditlogtofile_stat_statements_reset);
+
+/* Internal functions */
+static int pgauditlogtofile_stats_entry_cmp(const void *lhs, const void *rhs);
+static void pgauditlogtofile_stats_dealloc(void);
+static Size pgauditlogtofile_stats_shmem_size(void);
+
+
+/*
+ * Estimate shared memory space needed
+ */
+static Size pgauditlogtofile_stats_shmem_size(void) {
+  Size size;
+
+  size = MAXALIGN(sizeof(pgAuditLogToFileStatsShm));
+  size = add_size(size, hash_estimate_size(guc_pgaudit_log_stats_max,
+                                           sizeof(pgAuditLogToFileStatsEntry)));
+
+  return size;
+}
+
+/*
+ * Request the SHMEM and the lock used by the statistics
+ */
+void pgauditlogtofile_stats_shmem_request(void) {
+  RequestAddinShmemSpace(MAXALIGN(sizeof(pgAuditLogToFileCountersShm)));
+
+  if (guc_pgaudit_log_stats_max <= 0)
+    return;
+
+  RequestAddinShmemSpace(pgauditlogtofile_stats_shmem_size());
+  RequestNamedLWLockTranche("pgauditlogtofile_stats", 1);
+}
+
+/*
+ * Initialize the statistics SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_stats_shmem_startup(void) {
+  bool found;
+  HASHCTL info;
+  int i;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_stats_shm = NULL;
+  pgaudit_stats_hash = NULL;
+  pgaudit_counters_shm = NULL;
+
+  pgaudit_counters_shm = ShmemInitStruct("pgauditlogtofile_counters", sizeof(pgAuditLogToFileCountersShm), &found);
+  if (!found) {
+    pg_atomic_init_u64(&pgaudit_counters_shm->records, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->bytes, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->dropped, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->file_opens, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->rotations, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->latency_sum_us, 0);
+    for (i = 0; i < PGAUDITLOGTOFILE_LATENCY_BUCKETS; i++)
+      pg_atomic_init_u64(&pgaudit_counters_shm->latency_buckets[i], 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->memory, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->batch_bytes, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->flush_latency_us, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->degraded, 0);
+    pg_atomic_init_u64(&pgaudit_counters_shm->unordered, 0);
+    SpinLockInit(&pgaudit_counters_shm->mutex);
+    pgaudit_counters_shm->rotation_time = 0;
+    pgaudit_counters_shm->rotation_lag_ms = 0;
+    pgaudit_counters_shm->filename[0] = '\0';
+  }
+
+  if (guc_pgaudit_log_stats_max <= 0)
+    return;
+
+  pgaudit_stats_shm = ShmemInitStruct("pgauditlogtofile_stats", sizeof(pgAuditLogToFileStatsShm), &found);
+  if (!found)
+    pgaudit_stats_shm->lock = &(GetNamedLWLockTranche("pgauditlogtofile_stats"))->lock;
+
+  memset(&info, 0, sizeof(info));
+  info.keysize = sizeof(pgAuditLogToFileStatsKey);
+  info.entrysize = sizeof(pgAuditLogToFileStatsEntry);
+  pgaudit_stats_hash = ShmemInitHash("pgauditlogtofile_stats hash",
+                                     guc_pgaudit_log_stats_max, guc_pgaudit_log_stats_max,
+                                     &info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Counts an audit record written to the audit file
+ */
+void pgauditlogtofile_counters_add_record(int64 bytes) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->records, 1);
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->bytes, bytes);
+}
+
+/*
+ * Counts an audit record written in the minimal layout
+ */
+void pgauditlogtofile_counters_add_degraded(void) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->degraded, 1);
+}
+
+/*
+ * Counts an audit record that could not be written and was sent to the
+ * server log
+ */
+void pgauditlogtofile_counters_add_dropped(void) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->dropped, 1);
+}
+
+/*
+ * Adds the time spent by the hook on an audit record to the histogram
+ */
+void pgauditlogtofile_counters_add_latency(uint64 latency_us) {
+  int i;
+
+  if (!pgaudit_counters_shm)
+    return;
+
+  for (i = 0; i < PGAUDITLOGTOFILE_LATENCY_BUCKETS - 1; i++) {
+    if (latency_us <= pgauditlogtofile_latency_bounds_us[i])
+      break;
+  }
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->latency_buckets[i], 1);
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->latency_sum_us, latency_us);
+}
+
+/*
+ * Adds the change of memory allocated by the audit of a backend
+ */
+void pgauditlogtofile_counters_add_memory(int64 bytes) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->memory, bytes);
+}
+
+/*
+ * Counts an open of the audit file and remembers its name
+ */
+void pgauditlogtofile_counters_add_open(const char *filename) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->file_opens, 1);
+
+  /* The postmaster does not take spinlocks */
+  if (!IsUnderPostmaster)
+    return;
+
+  SpinLockAcquire(&pgaudit_counters_shm->mutex);
+  if (strcmp(pgaudit_counters_shm->filename, filename) != 0)
+    strlcpy(pgaudit_counters_shm->filename, filename, MAXPGPATH);
+  SpinLockRelease(&pgaudit_counters_shm->mutex);
+}
+
+/*
+ * Counts a rotation of the audit file in a process, keeping the biggest delay
+ * between the scheduled rotation time and the processes noticing it
+ */
+void pgauditlogtofile_counters_add_rotation(pg_time_t rotation_time, int64 lag_ms) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->rotations, 1);
+
+  /* The postmaster does not take spinlocks */
+  if (!IsUnderPostmaster || rotation_time == 0)
+    return;
+
+  SpinLockAcquire(&pgaudit_counters_shm->mutex);
+  if (rotation_time > pgaudit_counters_shm->rotation_time) {
+    pgaudit_counters_shm->rotation_time = rotation_time;
+    pgaudit_counters_shm->rotation_lag_ms = lag_ms;
+  } else if (rotation_time == pgaudit_counters_shm->rotation_time &&
+             lag_ms > pgaudit_counters_shm->rotation_lag_ms) {
+    pgaudit_counters_shm->rotation_lag_ms = lag_ms;
+  }
+  SpinLockRelease(&pgaudit_counters_shm->mutex);
+}
+
+/*
+ * Counts an audit record written directly while the reorder window is on
+ */
+void pgauditlogtofile_counters_add_unordered(void) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_fetch_add_u64(&pgaudit_counters_shm->unordered, 1);
+}
+
+/*
+ * Publishes the batch size and the flush latency of the worker
+ */
+void pgauditlogtofile_counters_set_batch(uint64 batch_bytes, uint64 flush_latency_us) {
+  if (!pgaudit_counters_shm)
+    return;
+
+  pg_atomic_write_u64(&pgaudit_counters_shm->batch_bytes, batch_bytes);
+  pg_atomic_write_u64(&pgaudit_counters_shm->flush_latency_us, flush_latency_us);
+}
+
+/*
+ * Copies the global counters
+ */
+void pgauditlogtofile_counters_snapshot(pgAuditLogToFileCounters *counters) {
+  int i;
+
+  memset(counters, 0, sizeof(pgAuditLogToFileCounters));
+  if (!pgaudit_counters_shm)
+    return;
+
+  counters->records = pg_atomic_read_u64(&pgaudit_counters_shm->records);
+  counters->bytes = pg_atomic_read_u64(&pgaudit_counters_shm->bytes);
+  counters->dropped = pg_atomic_read_u64(&pgaudit_counters_shm->dropped);
+  counters->file_opens = pg_atomic_read_u64(&pgaudit_counters_shm->file_opens);
+  counters->rotations = pg_atomic_read_u64(&pgaudit_counters_shm->rotations);
+  counters->latency_sum_us = pg_atomic_read_u64(&pgaudit_counters_shm->latency_sum_us);
+  for (i = 0; i < PGAUDITLOGTOFILE_LATENCY_BUCKETS; i++)
+    counters->latency_buckets[i] = pg_atomic_read_u64(&pgaudit_counters_shm->latency_buckets[i]);
+  counters->memory = (int64) pg_atomic_read_u64(&pgaudit_counters_shm->memory);
+  counters->batch_bytes = pg_atomic_read_u64(&pgaudit_counters_shm->batch_bytes);
+  counters->flush_latency_us = pg_atomic_read_u64(&pgaudit_counters_shm->flush_latency_us);
+  counters->degraded = pg_atomic_read_u64(&pgaudit_counters_shm->degraded);
+  counters->unordered = pg_atomic_read_u64(&pgaudit_counters_shm->unordered);
+
+  SpinLockAcquire(&pgaudit_counters_shm->mutex);
+  counters->rotation_time = pgaudit_counters_shm->rotation_time;
+  counters->rotation_lag_ms = pgaudit_counters_shm->rotation_lag_ms;
+  strlcpy(counters->filename, pgaudit_counters_shm->filename, MAXPGPATH);
+  SpinLockRelease(&pgaudit_counters_shm->mutex);
+}
+
+/*
+ * Checks if the per statement statistics are available in this process
+ */
+bool pgauditlogtofile_stats_enabled(void) {
+  /* The postmaster cannot take LWLocks */
+  return pgaudit_stats_hash != NULL && MyProc != NULL;
+}
+
+/*
+ * Accumulates the cost of an audit record in the entry of the running statement
+ */
+void pgauditlogtofile_stats_store(int64 bytes, double format_time, double write_time) {
+  pgAuditLogToFileStatsKey key;
+  pgAuditLogToFileStatsEntry *entry;
+  bool found;
+
+  if (!pgauditlogtofile_stats_enabled())
+    return;
+
+  /* Connection messages can be emitted before the role is known */
+  memset(&key, 0, sizeof(key));
+  key.userid = OidIsValid(MyProc->roleId) ? GetUserId() : InvalidOid;
+  key.dbid = MyDatabaseId;
+#if (PG_VERSION_NUM >= 140000)
+  key.queryid = pgstat_get_my_query_id();
+#endif
+
+  LWLockAcquire(pgaudit_stats_shm->lock, LW_SHARED);
+  entry = (pgAuditLogToFileStatsEntry *) hash_search(pgaudit_stats_hash, &key, HASH_FIND, NULL);
+  if (!entry) {
+    /* Need exclusive lock to make a new entry */
+    LWLockRelease(pgaudit_stats_shm->lock);
+    LWLockAcquire(pgaudit_stats_shm->lock, LW_EXCLUSIVE);
+
+    if (hash_get_num_entries(pgaudit_stats_hash) >= guc_pgaudit_log_stats_max)
+      pgauditlogtofile_stats_dealloc();
+
+    entry = (pgAuditLogToFileStatsEntry *) hash_search(pgaudit_stats_hash, &key, HASH_ENTER, &found);
+    if (!found) {
+      entry->records = 0;
+      entry->bytes = 0;
+      entry->format_time = 0;
+      entry->write_time = 0;
+      SpinLockInit(&entry->mutex);
+    }
+  }
+
+  SpinLockAcquire(&entry->mutex);
+  entry->records += 1;
+  entry->bytes += bytes;
+  entry->format_time += format_time;
+  entry->write_time += write_time;
+  SpinLockRelease(&entry->mutex);
+
+  LWLockRelease(pgaudit_stats_shm->lock);
+}
+
+/*
+ * qsort comparator for sorting into increasing bytes order
+ */
+static int pgauditlogtofile_stats_entry_cmp(const void *lhs, const void *rhs) {
+  int64 l_bytes = (*(pgAuditLogToFileStatsEntry *const *) lhs)->bytes;
+  int64 r_bytes = (*(pgAuditLogToFileStatsEntry *const *) rhs)->bytes;
+
+  if (l_bytes < r_bytes)
+    return -1;
+  else if (l_bytes > r_bytes)
+    return +1;
+  else
+    return 0;
+}
+
+/*
+ * Evicts the entries that account for the fewest bytes - caller holds the
+ * lock in exclusive mode
+ */
+static void pgauditlogtofile_stats_dealloc(void) {
+  HASH_SEQ_STATUS hash_seq;
+  pgAuditLogToFileStatsEntry **entries;
+  pgAuditLogToFileStatsEntry *entry;
+  int nvictims;
+  int i = 0;
+
+  entries = palloc(hash_get_num_entries(pgaudit_stats_hash) * sizeof(pgAuditLogToFileStatsEntry *));
+
+  hash_seq_init(&hash_seq, pgaudit_stats_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    entries[i++] = entry;
+
+  qsort(entries, i, sizeof(pgAuditLogToFileStatsEntry *), pgauditlogtofile_stats_entry_cmp);
+
+  nvictims = Max(STATS_DEALLOC_MIN, i * STATS_DEALLOC_PERCENT / 100);
+  nvictims = Min(nvictims, i);
+  for (i = 0; i < nvictims; i++)
+    hash_search(pgaudit_stats_hash, &entries[i]->key, HASH_REMOVE, NULL);
+
+  pfree(entries);
+}
+
+/*
+ * SQL function: global counters
+ */
+Datum pgauditlogtofile_stats(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  pgAuditLogToFileCounters counters;
+  Datum values[PGAUDITLOGTOFILE_COUNTERS_COLS];
+  bool nulls[PGAUDITLOGTOFILE_COUNTERS_COLS];
+  int i = 0;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  pgauditlogtofile_counters_snapshot(&counters);
+
+  memset(nulls, 0, sizeof(nulls));
+
+  values[i++] = Int64GetDatum((int64) counters.records);
+  values[i++] = Int64GetDatum((int64) counters.bytes);
+  values[i++] = Int64GetDatum((int64) counters.dropped);
+  values[i++] = Int64GetDatum((int64) counters.file_opens);
+  values[i++] = Int64GetDatum((int64) counters.rotations);
+  values[i++] = Float8GetDatum(counters.rotation_lag_ms / 1000.0);
+  if (counters.filename[0] != '\0')
+    values[i++] = CStringGetTextDatum(counters.filename);
+  else
+    nulls[i++] = true;
+  values[i++] = Int64GetDatum(counters.memory);
+  values[i++] = Int64GetDatum((int64) counters.batch_bytes);
+  values[i++] = Float8GetDatum(counters.flush_latency_us / 1000000.0);
+  values[i++] = Int64GetDatum((int64) counters.degraded);
+  values[i++] = Int64GetDatum((int64) counters.unordered);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * SQL function: audit volume accumulated by each statement
+ */
+Datum pgauditlogtofile_stat_statements(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  HASH_SEQ_STATUS hash_seq;
+  pgAuditLogToFileStatsEntry *entry;
+
+  if (!pgaudit_stats_shm || !pgaudit_stats_hash)
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgauditlogtofile statement statistics are not available"),
+                    errhint("pgauditlogtofile must be loaded via shared_preload_libraries and pgaudit.log_stats_max must be greater than 0.")));
+
+  tupstore = pgauditlogtofile_materialize_srf(fcinfo, &tupdesc);
+
+  LWLockAcquire(pgaudit_stats_shm->lock, LW_SHARED);
+
+  hash_seq_init(&hash_seq, pgaudit_stats_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+    Datum values[PGAUDITLOGTOFILE_STATS_COLS];
+    bool nulls[PGAUDITLOGTOFILE_STATS_COLS];
+    int64 records, bytes;
+    double format_time, write_time;
+    int i = 0;
+
+    memset(nulls, 0, sizeof(nulls));
+
+    SpinLockAcquire(&entry->mutex);
+    records = entry->records;
+    bytes = entry->bytes;
+    format_time = entry->format_time;
+    write_time = entry->write_time;
+    SpinLockRelease(&entry->mutex);
+
+    values[i++] = ObjectIdGetDatum(entry->key.userid);
+    values[i++] = ObjectIdGetDatum(entry->key.dbid);
+    values[i++] = Int64GetDatum((int64) entry->key.queryid);
+    values[i++] = Int64GetDatum(records);
+    values[i++] = Int64GetDatum(bytes);
+    values[i++] = Float8GetDatum(format_time);
+    values[i++] = Float8GetDatum(write_time);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  LWLockRelease(pgaudit_stats_shm->lock);
+
+  return (Datum) 0;
+}
+
+/*
+ * SQL function: discards the accumulated statement statistics
+ */
+Datum pgauditlogtofile_stat_statements_reset(PG_FUNCTION_ARGS) {
+  HASH_SEQ_STATUS hash_seq;
+  pgAuditLogToFileStatsEntry *entry;
+
+  if (!pgaudit_stats_shm || !pgaudit_stats_hash)
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgauditlogtofile statement statistics are not available"),
+                    errhint("pgauditlogtofile must be loaded via shared_preload_libraries and pgaudit.log_stats_max must be greater than 0.")));
+
+  LWLockAcquire(pgaudit_stats_shm->lock, LW_EXCLUSIVE);
+
+  hash_seq_init(&hash_seq, pgaudit_stats_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    hash_search(pgaudit_stats_hash, &entry->key, HASH_REMOVE, NULL);
+
+  LWLockRelease(pgaudit_stats_shm->lock);
+
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,64 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_stats.h
+ *      statistics about the audit records written by pgauditlogtofile
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_STATS_H
+#define PGAUDITLOGTOFILE_STATS_H
+
+#include "pgtime.h"
+
+/* Buckets of the hook latency histogram, the last one has no upper bound */
+#define PGAUDITLOGTOFILE_LATENCY_BUCKETS 17
+
+/* Copy of the global counters */
+typedef struct pgAuditLogToFileCounters {
+  uint64 records;
+  uint64 bytes;
+  uint64 dropped;
+  uint64 file_opens;
+  uint64 rotations;
+  uint64 latency_sum_us;
+  uint64 latency_buckets[PGAUDITLOGTOFILE_LATENCY_BUCKETS];
+  pg_time_t rotation_time;
+  int64 rotation_lag_ms;
+  char filename[MAXPGPATH];
+  int64 memory;
+  uint64 batch_bytes;
+  uint64 flush_latency_us;
+  uint64 degraded;
+  uint64 unordered;
+} pgAuditLogToFileCounters;
+
+extern const uint64 pgauditlogtofile_latency_bounds_us[PGAUDITLOGTOFILE_LATENCY_BUCKETS - 1];
+
+/* GUC variables */
+extern int guc_pgaudit_log_stats_max;
+
+/* SHMEM functions */
+void pgauditlogtofile_stats_shmem_request(void);
+void pgauditlogtofile_stats_shmem_startup(void);
+
+/* Global counters */
+void pgauditlogtofile_counters_add_degraded(void);
+void pgauditlogtofile_counters_add_dropped(void);
+void pgauditlogtofile_counters_add_latency(uint64 latency_us);
+void pgauditlogtofile_counters_add_memory(int64 bytes);
+void pgauditlogtofile_counters_add_open(const char *filename);
+void pgauditlogtofile_counters_add_record(int64 bytes);
+void pgauditlogtofile_counters_add_rotation(pg_time_t rotation_time, int64 lag_ms);
+void pgauditlogtofile_counters_add_unordered(void);
+void pgauditlogtofile_counters_set_batch(uint64 batch_bytes, uint64 flush_latency_us);
+void pgauditlogtofile_counters_snapshot(pgAuditLogToFileCounters *counters);
+
+/* Per statement accounting */
+bool pgauditlogtofile_stats_enabled(void);
+void pgauditlogtofile_stats_store(int64 bytes, double format_time, double write_time);
+
+#endif
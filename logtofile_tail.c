@@ -0,0 +1,273 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_tail.c
+ *      in memory ring with the most recent audit records
+ *
+ * Every slot of the ring is protected by a change counter that is odd while
+ * a backend is copying a record into it. Writers never wait: if the slot
+ * they claimed is still being written by a backend one lap behind, the
+ * record is only kept in the audit file. Readers copy the slot and retry if
+ * the counter changed meanwhile.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "funcapi.h"
+#include "libpq/libpq-be.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+
+#include "logtofile.h"
+#include "logtofile_format.h"
+#include "logtofile_tail.h"
+
+/* Defines */
+#define PGAUDITLOGTOFILE_TAIL_COLS 6
+/* Longer records are truncated in the ring */
+#define TAIL_RECORD_SIZE 2048
+#define TAIL_CLASS_SIZE 16
+/* Attempts to copy a slot that is being modified */
+#define TAIL_READ_RETRIES 8
+
+/* SHM structure */
+typedef struct pgAuditLogToFileTailSlot {
+  pg_atomic_uint32 changecount; /* odd while the slot is being written */
+  uint64 position;              /* record number stored in the slot */
+  char user_name[NAMEDATALEN];
+  char database_name[NAMEDATALEN];
+  char class[TAIL_CLASS_SIZE];
+  bool truncated;
+  int len;
+  char line[TAIL_RECORD_SIZE];
+} pgAuditLogToFileTailSlot;
+
+typedef struct pgAuditLogToFileTailShm {
+  pg_atomic_uint64 next_position;
+  pgAuditLogToFileTailSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} pgAuditLogToFileTailShm;
+
+static pgAuditLogToFileTailShm *pgaudit_tail_shm = NULL;
+
+/* GUC variables */
+int guc_pgaudit_log_tail_records = 1000;
+
+/* SQL functions */
+PG_FUNCTION_INFO_V1(pgauditlogtofile_tail);
+
+/* Internal functions */
+static bool pgauditlogtofile_tail_read(uint64 position, pgAuditLogToFileTailSlot *copy);
+static Size pgauditlogtofile_tail_shmem_size(void);
+
+
+/*
+ * Estimate shared memory space needed
+ */
+static Size pgauditlogtofile_tail_shmem_size(void) {
+  return add_size(offsetof(pgAuditLogToFileTailShm, slots),
+                  mul_size(guc_pgaudit_log_tail_records, sizeof(pgAuditLogToFileTailSlot)));
+}
+
+/*
+ * Request the SHMEM used by the ring
+ */
+void pgauditlogtofile_tail_shmem_request(void) {
+  if (guc_pgaudit_log_tail_records <= 0)
+    return;
+
+  RequestAddinShmemSpace(pgauditlogtofile_tail_shmem_size());
+}
+
+/*
+ * Initialize the ring SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_tail_shmem_startup(void) {
+  bool found;
+  int i;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_tail_shm = NULL;
+
+  if (guc_pgaudit_log_tail_records <= 0)
+    return;
+
+  pgaudit_tail_shm = ShmemInitStruct("pgauditlogtofile_tail", pgauditlogtofile_tail_shmem_size(), &found);
+  if (!found) {
+    pg_atomic_init_u64(&pgaudit_tail_shm->next_position, 0);
+    for (i = 0; i < guc_pgaudit_log_tail_records; i++) {
+      pg_atomic_init_u32(&pgaudit_tail_shm->slots[i].changecount, 0);
+      pgaudit_tail_shm->slots[i].position = PG_UINT64_MAX;
+    }
+  }
+}
+
+/*
+ * Copies an audit record into the ring
+ */
+void pgauditlogtofile_tail_store(const ErrorData *edata, int exclude_nchars, const char *line, int len) {
+  pgAuditLogToFileTailSlot *slot;
+  uint64 position;
+  uint32 changecount;
+  const char *class;
+  int class_len = -1;
+
+  if (!pgaudit_tail_shm)
+    return;
+
+  position = pg_atomic_fetch_add_u64(&pgaudit_tail_shm->next_position, 1);
+  slot = &pgaudit_tail_shm->slots[position % guc_pgaudit_log_tail_records];
+
+  /* Skip the slot if a backend one lap behind is still writing it */
+  changecount = pg_atomic_read_u32(&slot->changecount);
+  if ((changecount & 1) != 0 ||
+      !pg_atomic_compare_exchange_u32(&slot->changecount, &changecount, changecount + 1))
+    return;
+  pg_write_barrier();
+
+  slot->position = position;
+  slot->user_name[0] = '\0';
+  if (MyProcPort && MyProcPort->user_name)
+    strlcpy(slot->user_name, MyProcPort->user_name, NAMEDATALEN);
+  slot->database_name[0] = '\0';
+  if (MyProcPort && MyProcPort->database_name)
+    strlcpy(slot->database_name, MyProcPort->database_name, NAMEDATALEN);
+
+  /* Connection messages are not pgaudit records and have no class */
+  if (exclude_nchars > 0)
+    class_len = pgauditlogtofile_audit_field(edata->message + exclude_nchars, PGAUDIT_FIELD_CLASS, &class);
+  if (class_len >= 0) {
+    class_len = Min(class_len, TAIL_CLASS_SIZE - 1);
+    memcpy(slot->class, class, class_len);
+    slot->class[class_len] = '\0';
+  } else {
+    slot->class[0] = '\0';
+  }
+
+  /* Without the trailing new line, and never cutting a character */
+  if (len > 0 && line[len - 1] == '\n')
+    len--;
+  slot->truncated = len > TAIL_RECORD_SIZE;
+  slot->len = slot->truncated ? pg_mbcliplen(line, len, TAIL_RECORD_SIZE) : len;
+  memcpy(slot->line, line, slot->len);
+
+  pg_write_barrier();
+  pg_atomic_write_u32(&slot->changecount, changecount + 2);
+}
+
+/*
+ * Copies the slot holding the record at position, false if the record is
+ * no longer in the ring or it could not be read consistently
+ */
+static bool pgauditlogtofile_tail_read(uint64 position, pgAuditLogToFileTailSlot *copy) {
+  pgAuditLogToFileTailSlot *slot = &pgaudit_tail_shm->slots[position % guc_pgaudit_log_tail_records];
+  uint32 before, after;
+  int retries;
+
+  for (retries = 0; retries < TAIL_READ_RETRIES; retries++) {
+    before = pg_atomic_read_u32(&slot->changecount);
+    if ((before & 1) == 0) {
+      pg_read_barrier();
+      memcpy(copy, slot, offsetof(pgAuditLogToFileTailSlot, line));
+      if (copy->len > 0 && copy->len <= TAIL_RECORD_SIZE)
+        memcpy(copy->line, slot->line, copy->len);
+      pg_read_barrier();
+      after = pg_atomic_read_u32(&slot->changecount);
+      if (before == after)
+        return copy->position == position;
+    }
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  return false;
+}
+
+/*
+ * SQL function: most recent n audit records, optionally only those of a
+ * role, database and/or class
+ */
+Datum pgauditlogtofile_tail(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  pgAuditLogToFileTailSlot copy;
+  uint64 *positions;
+  char *filter_user = NULL;
+  char *filter_database = NULL;
+  char *filter_class = NULL;
+  uint64 next_position, position, oldest_position;
+  int num_records = 0;
+  int n;
+  int i;
+
+  if (!pgaudit_tail_shm)
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgauditlogtofile recent records are not available"),
+                    errhint("pgauditlogtofile must be loaded via shared_preload_libraries and pgaudit.log_tail_records must be greater than 0.")));
+
+  n = PG_ARGISNULL(0) ? 10 : PG_GETARG_INT32(0);
+  if (n < 0)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("number of records must not be negative")));
+  n = Min(n, guc_pgaudit_log_tail_records);
+  if (!PG_ARGISNULL(1))
+    filter_user = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  if (!PG_ARGISNULL(2))
+    filter_database = text_to_cstring(PG_GETARG_TEXT_PP(2));
+  if (!PG_ARGISNULL(3))
+    filter_class = text_to_cstring(PG_GETARG_TEXT_PP(3));
+
+  tupstore = pgauditlogtofile_materialize_srf(fcinfo, &tupdesc);
+
+  /* Only the positions are kept, n slots may not fit in an allocation */
+  positions = palloc(Max(n, 1) * sizeof(uint64));
+
+  /* Walk the ring backwards, from the newest record */
+  next_position = pg_atomic_read_u64(&pgaudit_tail_shm->next_position);
+  oldest_position = next_position > (uint64) guc_pgaudit_log_tail_records ?
+                    next_position - guc_pgaudit_log_tail_records : 0;
+  for (position = next_position; num_records < n && position > oldest_position; position--) {
+    if (!pgauditlogtofile_tail_read(position - 1, &copy))
+      continue;
+    if (filter_user && strcmp(copy.user_name, filter_user) != 0)
+      continue;
+    if (filter_database && strcmp(copy.database_name, filter_database) != 0)
+      continue;
+    if (filter_class && pg_strcasecmp(copy.class, filter_class) != 0)
+      continue;
+
+    positions[num_records++] = position - 1;
+  }
+
+  /* Oldest first, like in the file, skipping those overwritten meanwhile */
+  for (i = num_records - 1; i >= 0; i--) {
+    Datum values[PGAUDITLOGTOFILE_TAIL_COLS];
+    bool nulls[PGAUDITLOGTOFILE_TAIL_COLS];
+    int j = 0;
+
+    if (!pgauditlogtofile_tail_read(positions[i], &copy))
+      continue;
+
+    memset(nulls, 0, sizeof(nulls));
+
+    values[j++] = Int64GetDatum((int64) copy.position);
+    values[j++] = CStringGetTextDatum(copy.user_name);
+    values[j++] = CStringGetTextDatum(copy.database_name);
+    if (copy.class[0] != '\0')
+      values[j++] = CStringGetTextDatum(copy.class);
+    else
+      nulls[j++] = true;
+    values[j++] = PointerGetDatum(cstring_to_text_with_len(copy.line, copy.len));
+    values[j++] = BoolGetDatum(copy.truncated);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  pfree(positions);
+
+  return (Datum) 0;
+}
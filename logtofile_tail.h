@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_tail.h
+ *      in memory ring with the most recent audit records
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_TAIL_H
+#define PGAUDITLOGTOFILE_TAIL_H
+
+/* GUC variables */
+extern int guc_pgaudit_log_tail_records;
+
+/* SHMEM functions */
+void pgauditlogtofile_tail_shmem_request(void);
+void pgauditlogtofile_tail_shmem_startup(void);
+
+/* Recent records */
+void pgauditlogtofile_tail_store(const ErrorData *edata, int exclude_nchars, const char *line, int len);
+
+#endif
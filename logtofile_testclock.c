@@ -0,0 +1,133 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_testclock.c
+ *      test only clock and hook trace for the rotation benchmarks
+ *
+ * Only built with make TEST_CLOCK=1. The clock starts when the library is
+ * loaded by the postmaster and runs pgaudit.log_test_clock_scale times
+ * faster from there; every backend inherits the same starting point, so all
+ * of them agree on when the next rotation happens. When
+ * pgaudit.log_test_trace_directory is set, every backend also writes a line
+ * per audit record to trace.<pid> in it with the time of the test clock in
+ * microseconds, the latency of the hook in microseconds and the number of
+ * files opened by the record.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "datatype/timestamp.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "utils/guc.h"
+
+#include "logtofile_clock.h"
+
+/* Defines */
+#define TEST_TRACE_BUFFER_SIZE 65536
+
+/* GUC variables */
+int guc_pgaudit_log_test_clock_scale = 1;
+char *guc_pgaudit_log_test_trace_directory = NULL;
+
+/* Real time when the library was loaded by the postmaster */
+static int64 test_clock_start_us = 0;
+
+/* Trace of this backend */
+static FILE *test_trace_file = NULL;
+static int test_trace_pid = 0;
+static int test_trace_opens = 0;
+
+/* Internal functions */
+static void pgauditlogtofile_testclock_shutdown(int code, Datum arg);
+
+
+/*
+ * Defines the GUCs and starts the clock
+ */
+void pgauditlogtofile_testclock_init(void) {
+  struct timeval tv;
+
+  DefineCustomIntVariable(
+    "pgaudit.log_test_clock_scale",
+    "Speed of the test clock relative to the real one", NULL,
+    &guc_pgaudit_log_test_clock_scale, 1, 1, 3600, PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  DefineCustomStringVariable(
+    "pgaudit.log_test_trace_directory",
+    "Directory where every backend writes the trace of the audit hook", NULL,
+    &guc_pgaudit_log_test_trace_directory, "", PGC_POSTMASTER,
+    GUC_NOT_IN_SAMPLE | GUC_SUPERUSER_ONLY, NULL, NULL, NULL);
+
+  gettimeofday(&tv, NULL);
+  test_clock_start_us = (int64) tv.tv_sec * USECS_PER_SEC + tv.tv_usec;
+}
+
+/*
+ * Current time of the test clock
+ */
+void pgauditlogtofile_gettimeofday(struct timeval *tv) {
+  int64 now_us;
+
+  gettimeofday(tv, NULL);
+  if (guc_pgaudit_log_test_clock_scale <= 1)
+    return;
+
+  now_us = (int64) tv->tv_sec * USECS_PER_SEC + tv->tv_usec;
+  now_us = test_clock_start_us + (now_us - test_clock_start_us) * guc_pgaudit_log_test_clock_scale;
+  tv->tv_sec = now_us / USECS_PER_SEC;
+  tv->tv_usec = now_us % USECS_PER_SEC;
+}
+
+/*
+ * Counts an audit file opened by the record being traced
+ */
+void pgauditlogtofile_testclock_count_open(void) {
+  test_trace_opens++;
+}
+
+/*
+ * Writes the trace line of an audit record
+ */
+void pgauditlogtofile_testclock_trace(uint64 latency_us) {
+  char path[MAXPGPATH];
+  struct timeval tv;
+
+  if (guc_pgaudit_log_test_trace_directory == NULL || guc_pgaudit_log_test_trace_directory[0] == '\0')
+    return;
+
+  if (test_trace_pid != MyProcPid) {
+    /* inherited from the postmaster, it belongs to another process */
+    test_trace_file = NULL;
+    test_trace_pid = MyProcPid;
+
+    snprintf(path, MAXPGPATH, "%s/trace.%d", guc_pgaudit_log_test_trace_directory, MyProcPid);
+    test_trace_file = fopen(path, "a");
+    if (test_trace_file == NULL)
+      return;
+    setvbuf(test_trace_file, NULL, _IOFBF, TEST_TRACE_BUFFER_SIZE);
+    before_shmem_exit(pgauditlogtofile_testclock_shutdown, (Datum) 0);
+  }
+
+  if (test_trace_file == NULL)
+    return;
+
+  pgauditlogtofile_gettimeofday(&tv);
+  fprintf(test_trace_file, INT64_FORMAT " " UINT64_FORMAT " %d\n",
+          (int64) tv.tv_sec * USECS_PER_SEC + tv.tv_usec, latency_us, test_trace_opens);
+  test_trace_opens = 0;
+}
+
+/*
+ * Flushes the trace at backend exit
+ */
+static void pgauditlogtofile_testclock_shutdown(int code, Datum arg) {
+  if (test_trace_file != NULL && test_trace_pid == MyProcPid) {
+    fclose(test_trace_file);
+    test_trace_file = NULL;
+  }
+}
@@ -0,0 +1,358 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_topk.c
+ *      heavy hitters of the audit log by role, database and application
+ *
+ * Every bucket of the sliding window keeps a Space-Saving summary of the
+ * producers that wrote more audit bytes: a fixed number of counters where a
+ * new producer replaces the smallest one and inherits its count. The count
+ * of a producer is overestimated at most by the inherited error, so the
+ * offenders can be found without scanning the audit files.
+ *
+ * A record of a producer already in the bucket only takes the lock shared
+ * and the spinlock of its counter, starting the search at the counter the
+ * backend used last. The lock is taken exclusive to start a bucket and to
+ * add or replace a producer.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+
+#include "logtofile.h"
+#include "logtofile_topk.h"
+
+#include <time.h>
+
+/* Defines */
+#define PGAUDITLOGTOFILE_TOPK_COLS 6
+/* Number of buckets in which the sliding window is divided */
+#define TOPK_BUCKETS 10
+
+/* SHM structure */
+typedef struct pgAuditLogToFileTopKKey {
+  Oid roleid;
+  Oid dbid;
+  char application_name[NAMEDATALEN];
+} pgAuditLogToFileTopKKey;
+
+typedef struct pgAuditLogToFileTopKEntry {
+  pgAuditLogToFileTopKKey key;
+  int64 records;
+  int64 bytes;
+  int64 bytes_error; /* bytes inherited from the replaced producer */
+  slock_t mutex;     /* protects the counters only */
+} pgAuditLogToFileTopKEntry;
+
+typedef struct pgAuditLogToFileTopKBucket {
+  int64 epoch; /* start of the bucket in bucket widths since the unix epoch */
+  int num_entries;
+  pgAuditLogToFileTopKEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} pgAuditLogToFileTopKBucket;
+
+typedef struct pgAuditLogToFileTopKShm {
+  LWLock *lock; /* protects all the buckets, except the counters */
+} pgAuditLogToFileTopKShm;
+
+static pgAuditLogToFileTopKShm *pgaudit_topk_shm = NULL;
+/* TOPK_BUCKETS buckets follow the header in SHMEM */
+static char *pgaudit_topk_buckets = NULL;
+
+/* Counter used last by this backend, where the search starts */
+static int last_entry = 0;
+
+/* GUC variables */
+int guc_pgaudit_log_topk = 64;
+// Default 5 minutes window
+int guc_pgaudit_log_topk_window = 5 * SECS_PER_MINUTE;
+
+/* SQL functions */
+PG_FUNCTION_INFO_V1(pgauditlogtofile_top_producers);
+
+/* Internal functions */
+static pgAuditLogToFileTopKBucket *pgauditlogtofile_topk_bucket(int i);
+static Size pgauditlogtofile_topk_bucket_size(void);
+static int64 pgauditlogtofile_topk_epoch(pg_time_t now);
+static pgAuditLogToFileTopKEntry *pgauditlogtofile_topk_find(pgAuditLogToFileTopKBucket *bucket,
+                                                             const pgAuditLogToFileTopKKey *key);
+static int pgauditlogtofile_topk_entry_cmp(const void *lhs, const void *rhs);
+static Size pgauditlogtofile_topk_shmem_size(void);
+
+
+/*
+ * Size of a bucket with guc_pgaudit_log_topk counters
+ */
+static Size pgauditlogtofile_topk_bucket_size(void) {
+  return MAXALIGN(add_size(offsetof(pgAuditLogToFileTopKBucket, entries),
+                           mul_size(guc_pgaudit_log_topk, sizeof(pgAuditLogToFileTopKEntry))));
+}
+
+/*
+ * Estimate shared memory space needed
+ */
+static Size pgauditlogtofile_topk_shmem_size(void) {
+  return add_size(MAXALIGN(sizeof(pgAuditLogToFileTopKShm)),
+                  mul_size(TOPK_BUCKETS, pgauditlogtofile_topk_bucket_size()));
+}
+
+/*
+ * Bucket i of the ring
+ */
+static inline pgAuditLogToFileTopKBucket *pgauditlogtofile_topk_bucket(int i) {
+  return (pgAuditLogToFileTopKBucket *) (pgaudit_topk_buckets + i * pgauditlogtofile_topk_bucket_size());
+}
+
+/*
+ * Bucket number of a point in time
+ */
+static inline int64 pgauditlogtofile_topk_epoch(pg_time_t now) {
+  int width = Max(guc_pgaudit_log_topk_window / TOPK_BUCKETS, 1);
+
+  return (int64) now / width;
+}
+
+/*
+ * Request the SHMEM and the lock used by the heavy hitters
+ */
+void pgauditlogtofile_topk_shmem_request(void) {
+  if (guc_pgaudit_log_topk <= 0)
+    return;
+
+  RequestAddinShmemSpace(pgauditlogtofile_topk_shmem_size());
+  RequestNamedLWLockTranche("pgauditlogtofile_topk", 1);
+}
+
+/*
+ * Initialize the heavy hitters SHMEM - caller holds AddinShmemInitLock
+ */
+void pgauditlogtofile_topk_shmem_startup(void) {
+  bool found;
+  int i;
+
+  /* reset in case this is a restart within the postmaster */
+  pgaudit_topk_shm = NULL;
+  pgaudit_topk_buckets = NULL;
+
+  if (guc_pgaudit_log_topk <= 0)
+    return;
+
+  pgaudit_topk_shm = ShmemInitStruct("pgauditlogtofile_topk", pgauditlogtofile_topk_shmem_size(), &found);
+  pgaudit_topk_buckets = (char *) pgaudit_topk_shm + MAXALIGN(sizeof(pgAuditLogToFileTopKShm));
+  if (!found) {
+    pgaudit_topk_shm->lock = &(GetNamedLWLockTranche("pgauditlogtofile_topk"))->lock;
+    for (i = 0; i < TOPK_BUCKETS; i++) {
+      pgauditlogtofile_topk_bucket(i)->epoch = -1;
+      pgauditlogtofile_topk_bucket(i)->num_entries = 0;
+    }
+  }
+}
+
+/*
+ * Counter of a producer in a bucket, NULL if it is not there - caller holds
+ * the lock
+ */
+static pgAuditLogToFileTopKEntry *pgauditlogtofile_topk_find(pgAuditLogToFileTopKBucket *bucket,
+                                                             const pgAuditLogToFileTopKKey *key) {
+  int i, n;
+
+  for (n = 0; n < bucket->num_entries; n++) {
+    i = (last_entry + n) % bucket->num_entries;
+    if (bucket->entries[i].key.roleid == key->roleid && bucket->entries[i].key.dbid == key->dbid &&
+        memcmp(&bucket->entries[i].key, key, sizeof(pgAuditLogToFileTopKKey)) == 0) {
+      last_entry = i;
+      return &bucket->entries[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Adds an audit record to the summary of the current bucket
+ */
+void pgauditlogtofile_topk_store(int64 bytes) {
+  pgAuditLogToFileTopKKey key;
+  pgAuditLogToFileTopKBucket *bucket;
+  pgAuditLogToFileTopKEntry *entry = NULL;
+  int64 epoch;
+  int i;
+
+  /* The postmaster cannot take LWLocks */
+  if (!pgaudit_topk_shm || MyProc == NULL)
+    return;
+
+  memset(&key, 0, sizeof(key));
+  key.roleid = MyProc->roleId;
+  key.dbid = MyDatabaseId;
+  if (application_name)
+    strlcpy(key.application_name, application_name, NAMEDATALEN);
+
+  epoch = pgauditlogtofile_topk_epoch((pg_time_t) time(NULL));
+  bucket = pgauditlogtofile_topk_bucket(epoch % TOPK_BUCKETS);
+
+  /* Producer already counted in the bucket: shared lock only */
+  LWLockAcquire(pgaudit_topk_shm->lock, LW_SHARED);
+  if (bucket->epoch == epoch)
+    entry = pgauditlogtofile_topk_find(bucket, &key);
+  if (entry) {
+    SpinLockAcquire(&entry->mutex);
+    entry->records += 1;
+    entry->bytes += bytes;
+    SpinLockRelease(&entry->mutex);
+    LWLockRelease(pgaudit_topk_shm->lock);
+    return;
+  }
+  LWLockRelease(pgaudit_topk_shm->lock);
+
+  LWLockAcquire(pgaudit_topk_shm->lock, LW_EXCLUSIVE);
+
+  if (bucket->epoch != epoch) {
+    /* The bucket belonged to a previous lap of the ring */
+    bucket->epoch = epoch;
+    bucket->num_entries = 0;
+  }
+
+  /* Another backend could have added it meanwhile */
+  entry = pgauditlogtofile_topk_find(bucket, &key);
+  if (entry == NULL) {
+    if (bucket->num_entries < guc_pgaudit_log_topk) {
+      entry = &bucket->entries[bucket->num_entries++];
+      entry->records = 0;
+      entry->bytes = 0;
+      entry->bytes_error = 0;
+      SpinLockInit(&entry->mutex);
+    } else {
+      /* Replace the smallest producer, inheriting its counts as error */
+      entry = &bucket->entries[0];
+      for (i = 1; i < bucket->num_entries; i++) {
+        if (bucket->entries[i].bytes < entry->bytes)
+          entry = &bucket->entries[i];
+      }
+      entry->bytes_error = entry->bytes;
+    }
+    entry->key = key;
+    last_entry = entry - bucket->entries;
+  }
+
+  /* No other backend holds the lock, the spinlock is not needed */
+  entry->records += 1;
+  entry->bytes += bytes;
+
+  LWLockRelease(pgaudit_topk_shm->lock);
+}
+
+/*
+ * qsort comparator for sorting into decreasing bytes order
+ */
+static int pgauditlogtofile_topk_entry_cmp(const void *lhs, const void *rhs) {
+  int64 l_bytes = ((const pgAuditLogToFileTopKEntry *) lhs)->bytes;
+  int64 r_bytes = ((const pgAuditLogToFileTopKEntry *) rhs)->bytes;
+
+  if (l_bytes > r_bytes)
+    return -1;
+  else if (l_bytes < r_bytes)
+    return +1;
+  else
+    return 0;
+}
+
+/*
+ * SQL function: producers of audit bytes in the last seconds, by default the
+ * whole pgaudit.log_topk_window
+ */
+Datum pgauditlogtofile_top_producers(PG_FUNCTION_ARGS) {
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  pgAuditLogToFileTopKEntry *merged;
+  int num_merged = 0;
+  int64 current_epoch, min_epoch;
+  int seconds, width;
+  int i, j, k;
+
+  if (!pgaudit_topk_shm)
+    ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                    errmsg("pgauditlogtofile heavy hitters are not available"),
+                    errhint("pgauditlogtofile must be loaded via shared_preload_libraries and pgaudit.log_topk must be greater than 0.")));
+
+  seconds = PG_ARGISNULL(0) ? guc_pgaudit_log_topk_window : PG_GETARG_INT32(0);
+  if (seconds <= 0)
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("window must be greater than 0 seconds")));
+
+  width = Max(guc_pgaudit_log_topk_window / TOPK_BUCKETS, 1);
+  current_epoch = pgauditlogtofile_topk_epoch((pg_time_t) time(NULL));
+  min_epoch = current_epoch - Min((seconds + width - 1) / width, TOPK_BUCKETS) + 1;
+
+  tupstore = pgauditlogtofile_materialize_srf(fcinfo, &tupdesc);
+
+  merged = palloc(TOPK_BUCKETS * guc_pgaudit_log_topk * sizeof(pgAuditLogToFileTopKEntry));
+
+  LWLockAcquire(pgaudit_topk_shm->lock, LW_SHARED);
+  for (i = 0; i < TOPK_BUCKETS; i++) {
+    pgAuditLogToFileTopKBucket *bucket = pgauditlogtofile_topk_bucket(i);
+
+    if (bucket->epoch < min_epoch || bucket->epoch > current_epoch)
+      continue;
+
+    for (j = 0; j < bucket->num_entries; j++) {
+      pgAuditLogToFileTopKEntry *entry = &bucket->entries[j];
+      int64 records, bytes;
+
+      SpinLockAcquire(&entry->mutex);
+      records = entry->records;
+      bytes = entry->bytes;
+      SpinLockRelease(&entry->mutex);
+
+      for (k = 0; k < num_merged; k++) {
+        if (memcmp(&merged[k].key, &entry->key, sizeof(pgAuditLogToFileTopKKey)) == 0)
+          break;
+      }
+
+      if (k == num_merged) {
+        merged[num_merged].key = entry->key;
+        merged[num_merged].records = records;
+        merged[num_merged].bytes = bytes;
+        merged[num_merged].bytes_error = entry->bytes_error;
+        num_merged++;
+      } else {
+        merged[k].records += records;
+        merged[k].bytes += bytes;
+        merged[k].bytes_error += entry->bytes_error;
+      }
+    }
+  }
+  LWLockRelease(pgaudit_topk_shm->lock);
+
+  qsort(merged, num_merged, sizeof(pgAuditLogToFileTopKEntry), pgauditlogtofile_topk_entry_cmp);
+
+  for (i = 0; i < num_merged; i++) {
+    Datum values[PGAUDITLOGTOFILE_TOPK_COLS];
+    bool nulls[PGAUDITLOGTOFILE_TOPK_COLS];
+    j = 0;
+
+    memset(nulls, 0, sizeof(nulls));
+
+    values[j++] = ObjectIdGetDatum(merged[i].key.roleid);
+    values[j++] = ObjectIdGetDatum(merged[i].key.dbid);
+    values[j++] = CStringGetTextDatum(merged[i].key.application_name);
+    values[j++] = Int64GetDatum(merged[i].records);
+    values[j++] = Int64GetDatum(merged[i].bytes);
+    values[j++] = Int64GetDatum(merged[i].bytes_error);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  pfree(merged);
+
+  return (Datum) 0;
+}
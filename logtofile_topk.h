@@ -0,0 +1,26 @@
+/*-------------------------------------------------------------------------
+ *
+ * logtofile_topk.h
+ *      heavy hitters of the audit log by role, database and application
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAUDITLOGTOFILE_TOPK_H
+#define PGAUDITLOGTOFILE_TOPK_H
+
+/* GUC variables */
+extern int guc_pgaudit_log_topk;
+extern int guc_pgaudit_log_topk_window;
+
+/* SHMEM functions */
+void pgauditlogtofile_topk_shmem_request(void);
+void pgauditlogtofile_topk_shmem_startup(void);
+
+/* Heavy hitters accounting */
+void pgauditlogtofile_topk_store(int64 bytes);
+
+#endif
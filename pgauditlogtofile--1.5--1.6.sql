@@ -0,0 +1,116 @@
+/* pgauditlogtofile/pgauditlogtofile--1.5--1.6.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pgauditlogtofile UPDATE TO '1.6'" to load this file. \quit
+
+-- Global counters
+CREATE FUNCTION pgauditlogtofile_stats(
+    OUT records bigint,
+    OUT bytes bigint,
+    OUT dropped_records bigint,
+    OUT file_opens bigint,
+    OUT rotations bigint,
+    OUT rotation_lag double precision,
+    OUT current_file text,
+    OUT memory_bytes bigint,
+    OUT batch_bytes bigint,
+    OUT flush_latency double precision,
+    OUT degraded_records bigint,
+    OUT unordered_records bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pgauditlogtofile_stats AS
+  SELECT * FROM pgauditlogtofile_stats();
+
+-- Audit volume accumulated by each statement
+CREATE FUNCTION pgauditlogtofile_stat_statements(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT records bigint,
+    OUT bytes bigint,
+    OUT total_format_time double precision,
+    OUT total_write_time double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_stat_statements'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pgauditlogtofile_stat_statements AS
+  SELECT * FROM pgauditlogtofile_stat_statements();
+
+REVOKE ALL ON FUNCTION pgauditlogtofile_stat_statements() FROM PUBLIC;
+REVOKE ALL ON pgauditlogtofile_stat_statements FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pgauditlogtofile_stat_statements() TO pg_read_all_stats;
+GRANT SELECT ON pgauditlogtofile_stat_statements TO pg_read_all_stats;
+
+CREATE FUNCTION pgauditlogtofile_stat_statements_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_stat_statements_reset'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pgauditlogtofile_stat_statements_reset() FROM PUBLIC;
+
+-- Heavy hitters of the audit log in the sliding window
+CREATE FUNCTION pgauditlogtofile_top_producers(
+    IN seconds integer DEFAULT NULL,
+    OUT roleid oid,
+    OUT dbid oid,
+    OUT application_name text,
+    OUT records bigint,
+    OUT bytes bigint,
+    OUT bytes_error bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_top_producers'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pgauditlogtofile_top_producers AS
+  SELECT r.rolname, d.datname, t.application_name, t.records, t.bytes, t.bytes_error
+  FROM pgauditlogtofile_top_producers() t
+  LEFT JOIN pg_catalog.pg_roles r ON r.oid = t.roleid
+  LEFT JOIN pg_catalog.pg_database d ON d.oid = t.dbid;
+
+REVOKE ALL ON FUNCTION pgauditlogtofile_top_producers(integer) FROM PUBLIC;
+REVOKE ALL ON pgauditlogtofile_top_producers FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pgauditlogtofile_top_producers(integer) TO pg_read_all_stats;
+GRANT SELECT ON pgauditlogtofile_top_producers TO pg_read_all_stats;
+
+-- Most recent audit records, read from shared memory
+CREATE FUNCTION pgauditlogtofile_tail(
+    IN n integer DEFAULT 10,
+    IN role text DEFAULT NULL,
+    IN database text DEFAULT NULL,
+    IN class text DEFAULT NULL,
+    OUT position bigint,
+    OUT user_name text,
+    OUT database_name text,
+    OUT audit_class text,
+    OUT record text,
+    OUT truncated boolean
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_tail'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pgauditlogtofile_tail(integer, text, text, text) FROM PUBLIC;
+
+-- Legal hold snapshots of the audit files of a time range
+CREATE FUNCTION pgauditlogtofile_legal_hold(
+    IN name text,
+    IN start_time timestamptz,
+    IN end_time timestamptz,
+    IN checksums boolean DEFAULT true,
+    OUT file text,
+    OUT bytes bigint,
+    OUT method text,
+    OUT sha256 text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pgauditlogtofile_legal_hold'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pgauditlogtofile_legal_hold(text, timestamptz, timestamptz, boolean) FROM PUBLIC;
@@ -11,8 +11,46 @@
  *-------------------------------------------------------------------------
  */
 #include "postgres.h"
+#include "funcapi.h"
+#include "miscadmin.h"
 #include "utils/guc.h"
+#include "utils/tuplestore.h"
 
 PG_MODULE_MAGIC;
 
 #include "logtofile.h"
+
+/*
+ * Prepares the materialized result of a SQL function returning a set of records
+ */
+Tuplestorestate *pgauditlogtofile_materialize_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc) {
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  MemoryContext per_query_ctx;
+  MemoryContext oldcontext;
+  Tuplestorestate *tupstore;
+
+  /* check to see if caller supports us returning a tuplestore */
+  if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("set-valued function called in context that cannot accept a set")));
+  if (!(rsinfo->allowedModes & SFRM_Materialize))
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("materialize mode required, but it is not allowed in this context")));
+
+  /* Switch into long-lived context to construct returned data structures */
+  per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+  oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+  /* Build a tuple descriptor for our result type */
+  if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  tupstore = tuplestore_begin_heap(true, false, work_mem);
+  rsinfo->returnMode = SFRM_Materialize;
+  rsinfo->setResult = tupstore;
+  rsinfo->setDesc = *tupdesc;
+
+  MemoryContextSwitchTo(oldcontext);
+
+  return tupstore;
+}
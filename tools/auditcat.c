@@ -0,0 +1,495 @@
+/*-------------------------------------------------------------------------
+ *
+ * auditcat.c
+ *      prints the records of compressed or encrypted audit files
+ *
+ * Reads audit files written with pgaudit.log_compression or
+ * pgaudit.log_encryption_key_file and writes their records to the standard
+ * output as text, decrypting and then decompressing every block. Text
+ * between blocks, written before the blocks were enabled, is copied as is.
+ *
+ * A block that fails authentication, or cannot be decompressed, is reported
+ * with its offset and skipped, and the exit status is 1.
+ *
+ * With -z the records are not printed but written again as zstd blocks of
+ * -b kB, with long distance matching, to archive them: the blocks are much
+ * bigger than those written by the server, so the repetitions of the
+ * records far apart are found. With -k the new blocks are encrypted with
+ * the same key. LZ4 and zstd need the tool to be built with them.
+ *
+ * The block format is described in logtofile_block.h.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Defines */
+#define BLOCK_MAGIC "\0PAF"
+#define BLOCK_MAGIC_LENGTH 4
+#define BLOCK_VERSION 1
+#define BLOCK_HEADER_SIZE 32
+#define BLOCK_NONCE_SIZE 12
+#define BLOCK_TAG_SIZE 16
+#define BLOCK_KEY_SIZE 32
+
+#define COMPRESSION_NONE 0
+#define COMPRESSION_ZLIB 1
+#define COMPRESSION_LZ4 2
+#define COMPRESSION_ZSTD 3
+
+#define ENCRYPTION_NONE 0
+#define ENCRYPTION_AES_256_GCM 1
+
+/* Archive blocks of -b kB, with a window that keeps a whole block */
+#define ARCHIVE_BLOCK_SIZE_DEFAULT 65536
+#define ARCHIVE_BLOCK_SIZE_MAX (1024 * 1024)
+#define ARCHIVE_WINDOW_LOG 27
+
+/* Key given with -k */
+static bool has_key = false;
+static uint8_t key[BLOCK_KEY_SIZE];
+static uint32_t key_id = 0;
+
+/* Options */
+static bool quiet = false;
+static int archive_level = 0;
+static size_t archive_block_size = ARCHIVE_BLOCK_SIZE_DEFAULT * 1024;
+
+#ifdef USE_ZSTD
+/* Records waiting for the next archive block */
+static ZSTD_CCtx *archive_ctx = NULL;
+static uint8_t *archive_buffer = NULL;
+static size_t archive_len = 0;
+static uint8_t *archive_out = NULL;
+static size_t archive_out_size = 0;
+static EVP_CIPHER_CTX *archive_cipher = NULL;
+#endif
+
+/* Totals */
+static uint64_t blocks = 0;
+static uint64_t damaged = 0;
+static uint64_t raw_bytes = 0;
+static uint64_t stored_bytes = 0;
+
+/* Internal functions */
+static uint32_t auditcat_get_uint32(const uint8_t *src);
+static void auditcat_output(const uint8_t *data, size_t len);
+#ifdef USE_ZSTD
+static void auditcat_put_uint32(uint8_t *dest, uint32_t value);
+static void auditcat_archive_block(bool final);
+static void auditcat_archive_write(const uint8_t *raw, size_t raw_len);
+#endif
+static void auditcat_load_key(const char *path);
+static void auditcat_damaged(const char *path, uint64_t offset, const char *message);
+static void auditcat_file(const char *path);
+static bool auditcat_decompress(int compression, const uint8_t *src, uint32_t src_len,
+                                uint8_t *dest, uint32_t dest_len);
+
+
+static uint32_t auditcat_get_uint32(const uint8_t *src) {
+  return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t) src[3] << 24);
+}
+
+/*
+ * Prints the records, or keeps them for the next archive block
+ */
+static void auditcat_output(const uint8_t *data, size_t len) {
+#ifdef USE_ZSTD
+  if (archive_level != 0) {
+    while (len > 0) {
+      size_t n = archive_block_size - archive_len;
+
+      if (n > len)
+        n = len;
+      memcpy(archive_buffer + archive_len, data, n);
+      archive_len += n;
+      data += n;
+      len -= n;
+      if (archive_len == archive_block_size)
+        auditcat_archive_block(false);
+    }
+    return;
+  }
+#endif
+  fwrite(data, 1, len, stdout);
+}
+
+#ifdef USE_ZSTD
+static void auditcat_put_uint32(uint8_t *dest, uint32_t value) {
+  dest[0] = value & 0xff;
+  dest[1] = (value >> 8) & 0xff;
+  dest[2] = (value >> 16) & 0xff;
+  dest[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Writes the whole records of the buffer as an archive block, all of it
+ * when final
+ */
+static void auditcat_archive_block(bool final) {
+  size_t len = archive_len;
+
+  if (!final) {
+    while (len > 0 && archive_buffer[len - 1] != '\n')
+      len--;
+    /* a record longer than a block is split */
+    if (len == 0)
+      len = archive_len;
+  }
+  if (len == 0)
+    return;
+
+  auditcat_archive_write(archive_buffer, len);
+  memmove(archive_buffer, archive_buffer + len, archive_len - len);
+  archive_len -= len;
+}
+
+/*
+ * Writes a zstd block, encrypted with the key of -k, with the layout of
+ * logtofile_block.h
+ */
+static void auditcat_archive_write(const uint8_t *raw, size_t raw_len) {
+  uint8_t header[BLOCK_HEADER_SIZE];
+  size_t bound = ZSTD_compressBound(raw_len);
+  size_t stored_len;
+  int out_len = 0, final_len = 0;
+
+  if (archive_out_size < bound + BLOCK_TAG_SIZE) {
+    archive_out_size = bound + BLOCK_TAG_SIZE;
+    archive_out = realloc(archive_out, archive_out_size);
+  }
+  stored_len = ZSTD_compress2(archive_ctx, archive_out, bound, raw, raw_len);
+  if (ZSTD_isError(stored_len)) {
+    fprintf(stderr, "could not compress archive block: %s\n", ZSTD_getErrorName(stored_len));
+    exit(2);
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, BLOCK_MAGIC, BLOCK_MAGIC_LENGTH);
+  header[4] = BLOCK_VERSION;
+  header[5] = COMPRESSION_ZSTD;
+  header[6] = has_key ? ENCRYPTION_AES_256_GCM : ENCRYPTION_NONE;
+  auditcat_put_uint32(header + 8, raw_len);
+  auditcat_put_uint32(header + 12, stored_len);
+
+  if (has_key) {
+    auditcat_put_uint32(header + 16, key_id);
+    /* GCM encrypts in place */
+    if (RAND_bytes(header + 20, BLOCK_NONCE_SIZE) != 1 ||
+        EVP_EncryptInit_ex(archive_cipher, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(archive_cipher, EVP_CTRL_GCM_SET_IVLEN, BLOCK_NONCE_SIZE, NULL) != 1 ||
+        EVP_EncryptInit_ex(archive_cipher, NULL, NULL, key, header + 20) != 1 ||
+        EVP_EncryptUpdate(archive_cipher, NULL, &out_len, header, BLOCK_HEADER_SIZE) != 1 ||
+        EVP_EncryptUpdate(archive_cipher, archive_out, &out_len, archive_out, stored_len) != 1 ||
+        EVP_EncryptFinal_ex(archive_cipher, archive_out + out_len, &final_len) != 1 ||
+        EVP_CIPHER_CTX_ctrl(archive_cipher, EVP_CTRL_GCM_GET_TAG, BLOCK_TAG_SIZE,
+                            archive_out + stored_len) != 1) {
+      fprintf(stderr, "could not encrypt archive block\n");
+      exit(2);
+    }
+  }
+
+  fwrite(header, 1, BLOCK_HEADER_SIZE, stdout);
+  fwrite(archive_out, 1, stored_len + (has_key ? BLOCK_TAG_SIZE : 0), stdout);
+}
+#endif
+
+/*
+ * Reads the key: 64 hexadecimal digits, as pgaudit.log_encryption_key_file
+ */
+static void auditcat_load_key(const char *path) {
+  char hex[BLOCK_KEY_SIZE * 2 + 2];
+  uint8_t digest[32];
+  size_t len;
+  FILE *fp;
+  int i;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+  len = fread(hex, 1, sizeof(hex), fp);
+  fclose(fp);
+  while (len > 0 && (hex[len - 1] == '\n' || hex[len - 1] == '\r'))
+    len--;
+
+  for (i = 0; i < BLOCK_KEY_SIZE * 2 && len == BLOCK_KEY_SIZE * 2; i++) {
+    char c = hex[i];
+    int v;
+
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v = c - 'A' + 10;
+    else
+      break;
+    key[i / 2] = (i % 2 == 0) ? v << 4 : key[i / 2] | v;
+  }
+  if (i != BLOCK_KEY_SIZE * 2) {
+    fprintf(stderr, "key file \"%s\" must contain 64 hexadecimal digits\n", path);
+    exit(2);
+  }
+
+  EVP_Digest(key, BLOCK_KEY_SIZE, digest, NULL, EVP_sha256(), NULL);
+  key_id = auditcat_get_uint32(digest);
+  has_key = true;
+}
+
+static void auditcat_damaged(const char *path, uint64_t offset, const char *message) {
+  if (!quiet)
+    fprintf(stderr, "%s: block at offset %" PRIu64 ": %s\n", path, offset, message);
+  damaged++;
+}
+
+static bool auditcat_decompress(int compression, const uint8_t *src, uint32_t src_len,
+                                uint8_t *dest, uint32_t dest_len) {
+  uLongf out_len = dest_len;
+
+  switch (compression) {
+    case COMPRESSION_NONE:
+      if (src_len != dest_len)
+        return false;
+      memcpy(dest, src, src_len);
+      return true;
+    case COMPRESSION_ZLIB:
+      return uncompress(dest, &out_len, src, src_len) == Z_OK && out_len == dest_len;
+#ifdef USE_LZ4
+    case COMPRESSION_LZ4: {
+      LZ4F_dctx *dctx;
+      size_t dest_size = dest_len, src_size = src_len, rc;
+
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return false;
+      /* 0 once the whole frame is decoded */
+      rc = LZ4F_decompress(dctx, dest, &dest_size, src, &src_size, NULL);
+      LZ4F_freeDecompressionContext(dctx);
+      return rc == 0 && dest_size == dest_len && src_size == src_len;
+    }
+#endif
+#ifdef USE_ZSTD
+    case COMPRESSION_ZSTD:
+      return ZSTD_decompress(dest, dest_len, src, src_len) == dest_len;
+#endif
+    default:
+      return false;
+  }
+}
+
+/*
+ * Prints the records of a file
+ */
+static void auditcat_file(const char *path) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  const uint8_t *data;
+  uint8_t *plain = NULL, *raw = NULL;
+  size_t plain_size = 0, raw_size = 0;
+  struct stat st;
+  uint64_t pos = 0;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    EVP_CIPHER_CTX_free(ctx);
+    return;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "could not map \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+
+  while (pos < (uint64_t) st.st_size) {
+    const uint8_t *header = data + pos;
+    const uint8_t *payload;
+    uint32_t raw_len, stored_len;
+    uint64_t block_len;
+    int compression, encryption;
+
+    /* text before the blocks, or between them */
+    if (header[0] != '\0') {
+      const uint8_t *end = memchr(header, '\0', st.st_size - pos);
+      size_t len = end ? (size_t) (end - header) : st.st_size - pos;
+
+      auditcat_output(header, len);
+      pos += len;
+      continue;
+    }
+
+    if (st.st_size - pos < BLOCK_HEADER_SIZE ||
+        memcmp(header, BLOCK_MAGIC, BLOCK_MAGIC_LENGTH) != 0 || header[4] != BLOCK_VERSION) {
+      auditcat_damaged(path, pos, "not a block header");
+      pos++;
+      continue;
+    }
+
+    compression = header[5];
+    encryption = header[6];
+    raw_len = auditcat_get_uint32(header + 8);
+    stored_len = auditcat_get_uint32(header + 12);
+    block_len = BLOCK_HEADER_SIZE + (uint64_t) stored_len +
+                (encryption == ENCRYPTION_AES_256_GCM ? BLOCK_TAG_SIZE : 0);
+    if (block_len > st.st_size - pos) {
+      auditcat_damaged(path, pos, "truncated");
+      break;
+    }
+    payload = header + BLOCK_HEADER_SIZE;
+    blocks++;
+    stored_bytes += block_len;
+
+    if (encryption == ENCRYPTION_AES_256_GCM) {
+      int out_len = 0, final_len = 0;
+
+      if (!has_key) {
+        auditcat_damaged(path, pos, "encrypted, no key given");
+        pos += block_len;
+        continue;
+      }
+      if (auditcat_get_uint32(header + 16) != key_id) {
+        auditcat_damaged(path, pos, "encrypted with another key");
+        pos += block_len;
+        continue;
+      }
+      if (plain_size < stored_len) {
+        plain_size = stored_len;
+        plain = realloc(plain, plain_size);
+      }
+      if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1 ||
+          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, BLOCK_NONCE_SIZE, NULL) != 1 ||
+          EVP_DecryptInit_ex(ctx, NULL, NULL, key, header + 20) != 1 ||
+          EVP_DecryptUpdate(ctx, NULL, &out_len, header, BLOCK_HEADER_SIZE) != 1 ||
+          EVP_DecryptUpdate(ctx, plain, &out_len, payload, stored_len) != 1 ||
+          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, BLOCK_TAG_SIZE,
+                              (void *) (payload + stored_len)) != 1 ||
+          EVP_DecryptFinal_ex(ctx, plain + out_len, &final_len) != 1) {
+        auditcat_damaged(path, pos, "fails authentication");
+        pos += block_len;
+        continue;
+      }
+      payload = plain;
+    } else if (encryption != ENCRYPTION_NONE) {
+      auditcat_damaged(path, pos, "unknown encryption");
+      pos += block_len;
+      continue;
+    }
+
+    if (raw_size < raw_len) {
+      raw_size = raw_len;
+      raw = realloc(raw, raw_size);
+    }
+    if (!auditcat_decompress(compression, payload, stored_len, raw, raw_len)) {
+      auditcat_damaged(path, pos, "cannot be decompressed");
+      pos += block_len;
+      continue;
+    }
+
+    auditcat_output(raw, raw_len);
+    raw_bytes += raw_len;
+    pos += block_len;
+  }
+
+  munmap((void *) data, st.st_size);
+  close(fd);
+  free(plain);
+  free(raw);
+  EVP_CIPHER_CTX_free(ctx);
+}
+
+int main(int argc, char **argv) {
+  int c, i;
+
+  while ((c = getopt(argc, argv, "b:k:qz:")) != -1) {
+    switch (c) {
+      case 'b':
+        archive_block_size = strtoul(optarg, NULL, 10);
+        if (archive_block_size == 0 || archive_block_size > ARCHIVE_BLOCK_SIZE_MAX) {
+          fprintf(stderr, "block size must be between 1 and %d kB\n", ARCHIVE_BLOCK_SIZE_MAX);
+          exit(2);
+        }
+        archive_block_size *= 1024;
+        break;
+      case 'k':
+        auditcat_load_key(optarg);
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      case 'z':
+        archive_level = atoi(optarg);
+        if (archive_level < 1) {
+          fprintf(stderr, "zstd level must be at least 1\n");
+          exit(2);
+        }
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-k key_file] [-q] [-z level [-b block_kb]] audit_file...\n", argv[0]);
+    exit(2);
+  }
+
+  if (archive_level != 0) {
+#ifdef USE_ZSTD
+    archive_ctx = ZSTD_createCCtx();
+    archive_buffer = malloc(archive_block_size);
+    archive_cipher = EVP_CIPHER_CTX_new();
+    if (archive_ctx == NULL || archive_buffer == NULL || archive_cipher == NULL ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(archive_ctx, ZSTD_c_compressionLevel, archive_level)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(archive_ctx, ZSTD_c_enableLongDistanceMatching, 1)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(archive_ctx, ZSTD_c_windowLog, ARCHIVE_WINDOW_LOG))) {
+      fprintf(stderr, "could not initialize zstd\n");
+      exit(2);
+    }
+#else
+    fprintf(stderr, "%s was built without zstd\n", argv[0]);
+    exit(2);
+#endif
+  }
+
+  for (i = optind; i < argc; i++)
+    auditcat_file(argv[i]);
+#ifdef USE_ZSTD
+  if (archive_level != 0)
+    auditcat_archive_block(true);
+#endif
+  fflush(stdout);
+
+  fprintf(stderr, "blocks %" PRIu64 ", damaged %" PRIu64 ", stored %" PRIu64 " bytes, records %" PRIu64 " bytes\n",
+          blocks, damaged, stored_bytes, raw_bytes);
+
+  return damaged > 0 ? 1 : 0;
+}
@@ -0,0 +1,234 @@
+/*-------------------------------------------------------------------------
+ *
+ * auditrecover.c
+ *      finds and cuts the damaged tail of text audit files
+ *
+ * Checks the CRC32C checkpoint records written with pgaudit.log_checkpoint
+ * and finds where the valid data of each audit file ends:
+ *
+ *   - the file is verified up to the end of the range of the last
+ *     checkpoint record whose range, and the ranges of all the checkpoints
+ *     before it, match their CRC
+ *   - after it, including the checkpoint record itself, only complete lines
+ *     without NUL bytes are kept, the bytes a crash leaves are usually
+ *     zeroes or a partial line
+ *   - if a checkpoint after it does not match, the data after it is
+ *     damaged and nothing more is kept
+ *
+ * With -t the files are truncated there. It uses the CRC32C of PostgreSQL,
+ * hardware accelerated where the CPU allows it.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include "postgres_fe.h"
+#include "port/pg_crc32c.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defines */
+#define CHECKPOINT_TYPE "CHECKPOINT"
+/*
+ * Fields of a checkpoint record: the worker has no user nor database, the
+ * pgaudit message starts with the audit type and the range follows the six
+ * empty pgaudit fields
+ */
+#define FIELD_USER 1
+#define FIELD_DATABASE 2
+#define FIELD_AUDIT_TYPE 12
+#define FIELD_RANGE 19
+
+/* Options */
+static bool truncate_files = false;
+
+/* Internal functions */
+static int auditrecover_field(const char *line, size_t len, int n, const char **field);
+static bool auditrecover_parse(const char *line, size_t len, uint64 *offset, uint64 *length, pg_crc32c *crc);
+static bool auditrecover_file(const char *path);
+
+
+/*
+ * Locates the field n (0 based) of a line, returns its length or -1 if the
+ * line has less fields. Only the fields up to the range of a checkpoint are
+ * looked at, none of them is quoted in a checkpoint record.
+ */
+static int auditrecover_field(const char *line, size_t len, int n, const char **field) {
+  const char *p = line;
+  const char *end = line + len;
+  const char *start;
+  int i;
+
+  for (i = 0;; i++) {
+    start = p;
+    while (p < end && *p != ',' && *p != '\n')
+      p++;
+
+    if (i == n) {
+      *field = start;
+      return p - start;
+    }
+
+    if (p == end || *p != ',')
+      return -1;
+    p++;
+  }
+}
+
+/*
+ * Range of a checkpoint record. The record is recognized by its fields, so
+ * the text of an audited statement cannot pass for one.
+ */
+static bool auditrecover_parse(const char *line, size_t len, uint64 *offset, uint64 *length, pg_crc32c *crc) {
+  char buf[128];
+  const char *field;
+  unsigned long long o, l;
+  unsigned int c;
+  int n, i;
+
+  if (auditrecover_field(line, len, FIELD_USER, &field) != 0 ||
+      auditrecover_field(line, len, FIELD_DATABASE, &field) != 0)
+    return false;
+
+  n = auditrecover_field(line, len, FIELD_AUDIT_TYPE, &field);
+  if (n != (int) strlen(CHECKPOINT_TYPE) || memcmp(field, CHECKPOINT_TYPE, n) != 0)
+    return false;
+
+  for (i = FIELD_AUDIT_TYPE + 1; i < FIELD_RANGE; i++) {
+    if (auditrecover_field(line, len, i, &field) != 0)
+      return false;
+  }
+
+  n = auditrecover_field(line, len, FIELD_RANGE, &field);
+  if (n <= 0 || n >= (int) sizeof(buf))
+    return false;
+  memcpy(buf, field, n);
+  buf[n] = '\0';
+  if (sscanf(buf, "offset=%llu length=%llu crc32c=%x", &o, &l, &c) != 3)
+    return false;
+
+  *offset = o;
+  *length = l;
+  *crc = c;
+  return true;
+}
+
+/*
+ * Checks a file and truncates it if asked, false if it is damaged
+ */
+static bool auditrecover_file(const char *path) {
+  const char *data;
+  struct stat st;
+  uint64 size, pos, verified = 0, cut;
+  uint64 checkpoints = 0, damaged_offset = 0;
+  bool damaged = false;
+  const char *status;
+  int fd;
+
+  fd = open(path, truncate_files ? O_RDWR : O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+  size = st.st_size;
+  data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "could not map \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+
+  for (pos = 0; pos < size;) {
+    const char *eol = memchr(data + pos, '\n', size - pos);
+    uint64 line_end = eol ? (uint64) (eol - data) + 1 : size;
+    uint64 offset, length;
+    pg_crc32c expected, crc;
+
+    if (auditrecover_parse(data + pos, line_end - pos, &offset, &length, &expected)) {
+      checkpoints++;
+      INIT_CRC32C(crc);
+      if (offset + length <= pos)
+        COMP_CRC32C(crc, data + offset, length);
+      FIN_CRC32C(crc);
+
+      if (offset + length > pos || !EQ_CRC32C(crc, expected)) {
+        if (!damaged) {
+          damaged = true;
+          damaged_offset = offset;
+        }
+      } else if (!damaged && offset <= verified) {
+        /* the ranges start again from 0 when the worker restarts */
+        verified = offset + length;
+      }
+    }
+    pos = line_end;
+  }
+
+  /* after the last checkpoint only complete lines without NUL are kept */
+  cut = verified;
+  if (!damaged) {
+    for (pos = verified; pos < size;) {
+      const char *eol = memchr(data + pos, '\n', size - pos);
+
+      if (eol == NULL || memchr(data + pos, '\0', eol - (data + pos)) != NULL)
+        break;
+      pos = (eol - data) + 1;
+    }
+    cut = pos;
+  }
+
+  if (damaged)
+    status = "damaged";
+  else if (cut < size)
+    status = "torn";
+  else
+    status = "ok";
+
+  printf("%s\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t%s",
+         path, size, checkpoints, verified, cut, status);
+  if (damaged)
+    printf("\t" UINT64_FORMAT, damaged_offset);
+  printf("\n");
+
+  if (data != NULL)
+    munmap((void *) data, size);
+
+  if (truncate_files && cut < size && ftruncate(fd, cut) != 0) {
+    fprintf(stderr, "could not truncate \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+  close(fd);
+
+  return cut == size;
+}
+
+int main(int argc, char **argv) {
+  bool all_valid = true;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "t")) != -1) {
+    switch (c) {
+      case 't':
+        truncate_files = true;
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-t] audit_file...\n", argv[0]);
+    exit(2);
+  }
+
+  printf("file\tsize\tcheckpoints\tverified\tcut\tstatus\tdamaged_from\n");
+  for (i = optind; i < argc; i++)
+    if (!auditrecover_file(argv[i]))
+      all_valid = false;
+
+  return all_valid ? 0 : 1;
+}
@@ -0,0 +1,534 @@
+/*-------------------------------------------------------------------------
+ *
+ * digestcheck.c
+ *      verifies the block digests of pgauditlogtofile
+ *
+ * Checks audit files written with pgaudit.log_digest_block against their
+ * digest files: every block is hashed again, in parallel over all the
+ * files and blocks given, and then the chain, the Merkle root and, with the
+ * key, the signature of each digest file are checked. Directories are
+ * expanded to their audit files.
+ *
+ * Every problem is printed with the block and the byte range it affects:
+ *   tampered   the block does not match its digest
+ *   chain      the digest file was edited at this block
+ *   truncated  the audit file ends before the block
+ *   root       the Merkle root or the totals do not match the blocks
+ *   signature  the HMAC of the root does not match the key
+ *   unsigned   the root is not signed
+ *   tail       bytes written after the root, not covered by any digest
+ *   missing    the audit file has no digest file
+ *   open       the digest file has no root yet, the audit file is still
+ *              being written: not a problem, the bytes after its last
+ *              block are not covered yet
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/* Defines */
+#define DIGEST_LENGTH 32
+#define DIGEST_HEX_LENGTH (DIGEST_LENGTH * 2)
+#define DIGEST_SUFFIX ".digest"
+#define DIGEST_HEADER "# pgauditlogtofile digest sha256 block "
+#define READ_SIZE 65536
+#define MAX_KEY 1024
+
+typedef struct digest_block {
+  uint64_t offset;
+  uint64_t len;
+  uint8_t leaf[DIGEST_LENGTH];
+  uint8_t chain[DIGEST_LENGTH];
+  bool tampered;
+  bool truncated;
+} digest_block;
+
+typedef struct digest_file {
+  char *path;
+  char *digest_path;
+  bool has_digest;
+  bool valid;
+  uint64_t size;
+  digest_block *blocks;
+  uint64_t num_blocks;
+  bool has_root;
+  uint64_t root_blocks;
+  uint64_t root_size;
+  uint8_t root[DIGEST_LENGTH];
+  uint8_t root_chain[DIGEST_LENGTH];
+  char root_line[256]; /* signed part of the root line */
+  char mac[DIGEST_HEX_LENGTH + 1];
+} digest_file;
+
+/* Files to check */
+static digest_file *files = NULL;
+static int num_files = 0;
+static int max_files = 0;
+
+/* Blocks to hash, shared by the threads */
+typedef struct digest_task {
+  digest_file *file;
+  digest_block *block;
+} digest_task;
+
+static digest_task *tasks = NULL;
+static uint64_t num_tasks = 0;
+static uint64_t next_task = 0;
+static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Totals */
+static uint64_t problems = 0;
+static uint64_t bytes_hashed = 0;
+
+/* Internal functions */
+static void digestcheck_add_path(const char *path);
+static bool digestcheck_ends_with(const char *s, const char *suffix);
+static bool digestcheck_hex_decode(const char *hex, uint8_t *dest);
+static void digestcheck_hex_encode(const uint8_t *digest, char *dest);
+static void digestcheck_sha256(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen,
+                               const uint8_t *c, size_t clen, uint8_t *dest);
+static void digestcheck_read_digest(digest_file *f);
+static void *digestcheck_worker(void *arg);
+static void digestcheck_report(const char *kind, const digest_file *f, int64_t block,
+                               uint64_t offset, uint64_t len);
+static void digestcheck_verify(digest_file *f, const uint8_t *key, size_t key_len);
+
+
+static bool digestcheck_ends_with(const char *s, const char *suffix) {
+  size_t len = strlen(s), slen = strlen(suffix);
+
+  return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+/*
+ * Adds an audit file, or the audit files of a directory
+ */
+static void digestcheck_add_path(const char *path) {
+  struct stat st;
+  DIR *dir;
+  struct dirent *de;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "could not stat \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    dir = opendir(path);
+    if (dir == NULL) {
+      fprintf(stderr, "could not open directory \"%s\": %s\n", path, strerror(errno));
+      exit(2);
+    }
+    while ((de = readdir(dir)) != NULL) {
+      char child[4096];
+
+      if (de->d_name[0] == '.' || digestcheck_ends_with(de->d_name, DIGEST_SUFFIX))
+        continue;
+      snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+      if (stat(child, &st) == 0 && S_ISREG(st.st_mode))
+        digestcheck_add_path(child);
+    }
+    closedir(dir);
+    return;
+  }
+
+  if (num_files == max_files) {
+    max_files = max_files ? max_files * 2 : 64;
+    files = realloc(files, max_files * sizeof(digest_file));
+  }
+  memset(&files[num_files], 0, sizeof(digest_file));
+  files[num_files].path = strdup(path);
+  files[num_files].digest_path = malloc(strlen(path) + sizeof(DIGEST_SUFFIX));
+  sprintf(files[num_files].digest_path, "%s" DIGEST_SUFFIX, path);
+  files[num_files].size = st.st_size;
+  num_files++;
+}
+
+static void digestcheck_hex_encode(const uint8_t *digest, char *dest) {
+  static const char hex[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < DIGEST_LENGTH; i++) {
+    dest[i * 2] = hex[digest[i] >> 4];
+    dest[i * 2 + 1] = hex[digest[i] & 0x0f];
+  }
+  dest[DIGEST_HEX_LENGTH] = '\0';
+}
+
+static bool digestcheck_hex_decode(const char *hex, uint8_t *dest) {
+  int i;
+
+  if (strlen(hex) != DIGEST_HEX_LENGTH)
+    return false;
+
+  for (i = 0; i < DIGEST_HEX_LENGTH; i++) {
+    char c = hex[i];
+    int v;
+
+    if (c >= '0' && c <= '9')
+      v = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else
+      return false;
+
+    if (i % 2 == 0)
+      dest[i / 2] = v << 4;
+    else
+      dest[i / 2] |= v;
+  }
+  return true;
+}
+
+/*
+ * SHA-256 of the concatenation of up to three buffers
+ */
+static void digestcheck_sha256(const uint8_t *a, size_t alen, const uint8_t *b, size_t blen,
+                               const uint8_t *c, size_t clen, uint8_t *dest) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  EVP_DigestUpdate(ctx, a, alen);
+  if (blen > 0)
+    EVP_DigestUpdate(ctx, b, blen);
+  if (clen > 0)
+    EVP_DigestUpdate(ctx, c, clen);
+  EVP_DigestFinal_ex(ctx, dest, NULL);
+  EVP_MD_CTX_free(ctx);
+}
+
+/*
+ * Loads the blocks and the root of a digest file
+ */
+static void digestcheck_read_digest(digest_file *f) {
+  char line[512];
+  uint64_t max_blocks = 64;
+  FILE *fp;
+
+  fp = fopen(f->digest_path, "r");
+  if (fp == NULL)
+    return;
+  f->has_digest = true;
+  f->valid = true;
+  f->blocks = malloc(max_blocks * sizeof(digest_block));
+
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strncmp(line, DIGEST_HEADER, strlen(DIGEST_HEADER)) != 0) {
+    f->valid = false;
+    fclose(fp);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *fields[7];
+    char *field, *saveptr = NULL;
+    char *tab;
+    int n = 0;
+
+    /* the signed part of a root line is everything before its last column */
+    if (strncmp(line, "root\t", 5) == 0 && (tab = strrchr(line, '\t')) != NULL) {
+      size_t len = tab - line;
+
+      if (len >= sizeof(f->root_line))
+        len = sizeof(f->root_line) - 1;
+      memcpy(f->root_line, line, len);
+      f->root_line[len] = '\0';
+    }
+
+    for (field = strtok_r(line, "\t\n", &saveptr); field != NULL && n < 7; field = strtok_r(NULL, "\t\n", &saveptr))
+      fields[n++] = field;
+
+    if (n == 6 && strcmp(fields[0], "block") == 0) {
+      digest_block *b;
+
+      if (f->num_blocks == max_blocks) {
+        max_blocks *= 2;
+        f->blocks = realloc(f->blocks, max_blocks * sizeof(digest_block));
+      }
+      b = &f->blocks[f->num_blocks];
+      memset(b, 0, sizeof(digest_block));
+      b->offset = strtoull(fields[2], NULL, 10);
+      b->len = strtoull(fields[3], NULL, 10);
+      if (strtoull(fields[1], NULL, 10) != f->num_blocks ||
+          !digestcheck_hex_decode(fields[4], b->leaf) ||
+          !digestcheck_hex_decode(fields[5], b->chain))
+        f->valid = false;
+      f->num_blocks++;
+    } else if (n == 6 && strcmp(fields[0], "root") == 0 && !f->has_root) {
+      f->has_root = true;
+      f->root_blocks = strtoull(fields[1], NULL, 10);
+      f->root_size = strtoull(fields[2], NULL, 10);
+      if (!digestcheck_hex_decode(fields[3], f->root) ||
+          !digestcheck_hex_decode(fields[4], f->root_chain))
+        f->valid = false;
+      snprintf(f->mac, sizeof(f->mac), "%s", fields[5]);
+    } else {
+      f->valid = false;
+    }
+  }
+  fclose(fp);
+}
+
+/*
+ * Hashes blocks until there are no more
+ */
+static void *digestcheck_worker(void *arg) {
+  static const uint8_t leaf_prefix = 0x00;
+  char *buffer = malloc(READ_SIZE);
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  digest_file *open_file = NULL;
+  uint64_t hashed = 0;
+  int fd = -1;
+
+  (void) arg;
+
+  for (;;) {
+    digest_task task;
+    uint8_t leaf[DIGEST_LENGTH];
+    uint64_t done = 0;
+
+    pthread_mutex_lock(&task_mutex);
+    if (next_task == num_tasks) {
+      pthread_mutex_unlock(&task_mutex);
+      break;
+    }
+    task = tasks[next_task++];
+    pthread_mutex_unlock(&task_mutex);
+
+    if (task.file != open_file) {
+      if (fd >= 0)
+        close(fd);
+      fd = open(task.file->path, O_RDONLY);
+      open_file = task.file;
+    }
+
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, &leaf_prefix, 1);
+    while (fd >= 0 && done < task.block->len) {
+      uint64_t want = task.block->len - done;
+      ssize_t rc = pread(fd, buffer, want < READ_SIZE ? want : READ_SIZE, task.block->offset + done);
+
+      if (rc <= 0)
+        break;
+      EVP_DigestUpdate(ctx, buffer, rc);
+      done += rc;
+    }
+    EVP_DigestFinal_ex(ctx, leaf, NULL);
+    hashed += done;
+
+    if (done < task.block->len)
+      task.block->truncated = true;
+    else if (memcmp(leaf, task.block->leaf, DIGEST_LENGTH) != 0)
+      task.block->tampered = true;
+  }
+
+  if (fd >= 0)
+    close(fd);
+  EVP_MD_CTX_free(ctx);
+  free(buffer);
+
+  pthread_mutex_lock(&task_mutex);
+  bytes_hashed += hashed;
+  pthread_mutex_unlock(&task_mutex);
+
+  return NULL;
+}
+
+static void digestcheck_report(const char *kind, const digest_file *f, int64_t block,
+                               uint64_t offset, uint64_t len) {
+  if (block >= 0)
+    printf("%s\t%s\t%" PRId64 "\t%" PRIu64 "\t%" PRIu64 "\n", kind, f->path, block, offset, len);
+  else
+    printf("%s\t%s\t\t%" PRIu64 "\t%" PRIu64 "\n", kind, f->path, offset, len);
+  problems++;
+}
+
+/*
+ * Checks the order of the blocks, the chain, the root and the signature of
+ * a file whose blocks were already hashed
+ */
+static void digestcheck_verify(digest_file *f, const uint8_t *key, size_t key_len) {
+  static const uint8_t node_prefix = 0x01;
+  uint8_t chain[DIGEST_LENGTH], root[DIGEST_LENGTH];
+  uint64_t covered = 0, i, n;
+  uint8_t *level;
+
+  if (!f->has_digest) {
+    digestcheck_report("missing", f, -1, 0, f->size);
+    return;
+  }
+  if (!f->valid) {
+    digestcheck_report("chain", f, -1, 0, f->size);
+    return;
+  }
+
+  memset(chain, 0, DIGEST_LENGTH);
+  for (i = 0; i < f->num_blocks; i++) {
+    digest_block *b = &f->blocks[i];
+
+    if (b->truncated)
+      digestcheck_report("truncated", f, i, b->offset, b->len);
+    else if (b->tampered)
+      digestcheck_report("tampered", f, i, b->offset, b->len);
+
+    digestcheck_sha256(chain, DIGEST_LENGTH, b->leaf, DIGEST_LENGTH, NULL, 0, chain);
+    if (b->offset != covered || memcmp(chain, b->chain, DIGEST_LENGTH) != 0) {
+      digestcheck_report("chain", f, i, b->offset, b->len);
+      /* continue from the recorded chain to find further edits */
+      memcpy(chain, b->chain, DIGEST_LENGTH);
+    }
+    covered = b->offset + b->len;
+  }
+
+  if (!f->has_root) {
+    printf("open\t%s\t\t%" PRIu64 "\t%" PRIu64 "\n", f->path, covered, f->size > covered ? f->size - covered : 0);
+    return;
+  }
+
+  /* Merkle root over the recorded leaves */
+  memset(root, 0, DIGEST_LENGTH);
+  n = f->num_blocks;
+  if (n > 0) {
+    level = malloc(n * DIGEST_LENGTH);
+    for (i = 0; i < n; i++)
+      memcpy(level + i * DIGEST_LENGTH, f->blocks[i].leaf, DIGEST_LENGTH);
+    while (n > 1) {
+      for (i = 0; i < n / 2; i++)
+        digestcheck_sha256(&node_prefix, 1,
+                           level + 2 * i * DIGEST_LENGTH, DIGEST_LENGTH,
+                           level + (2 * i + 1) * DIGEST_LENGTH, DIGEST_LENGTH,
+                           level + i * DIGEST_LENGTH);
+      if (n % 2 == 1)
+        memmove(level + (n / 2) * DIGEST_LENGTH, level + (n - 1) * DIGEST_LENGTH, DIGEST_LENGTH);
+      n = (n + 1) / 2;
+    }
+    memcpy(root, level, DIGEST_LENGTH);
+    free(level);
+  }
+
+  if (f->root_blocks != f->num_blocks || f->root_size != covered ||
+      memcmp(root, f->root, DIGEST_LENGTH) != 0 || memcmp(chain, f->root_chain, DIGEST_LENGTH) != 0)
+    digestcheck_report("root", f, -1, 0, covered);
+
+  if (strcmp(f->mac, "-") == 0) {
+    digestcheck_report("unsigned", f, -1, 0, covered);
+  } else if (key != NULL) {
+    uint8_t mac[DIGEST_LENGTH];
+    char mac_hex[DIGEST_HEX_LENGTH + 1];
+    unsigned int mac_len = 0;
+
+    HMAC(EVP_sha256(), key, key_len, (const uint8_t *) f->root_line, strlen(f->root_line), mac, &mac_len);
+    digestcheck_hex_encode(mac, mac_hex);
+    if (strcmp(mac_hex, f->mac) != 0)
+      digestcheck_report("signature", f, -1, 0, covered);
+  }
+
+  if (f->size > covered)
+    digestcheck_report("tail", f, -1, covered, f->size - covered);
+}
+
+int main(int argc, char **argv) {
+  uint8_t key[MAX_KEY];
+  size_t key_len = 0;
+  const char *key_file = NULL;
+  int jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *threads;
+  struct timespec start, end;
+  uint64_t blocks = 0;
+  double seconds;
+  int c, i;
+  uint64_t j;
+
+  while ((c = getopt(argc, argv, "j:k:")) != -1) {
+    switch (c) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 'k':
+        key_file = optarg;
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind >= argc || jobs < 1) {
+    fprintf(stderr, "usage: %s [-j jobs] [-k key_file] audit_file_or_directory...\n", argv[0]);
+    exit(2);
+  }
+
+  if (key_file != NULL) {
+    FILE *fp = fopen(key_file, "r");
+
+    if (fp == NULL) {
+      fprintf(stderr, "could not open \"%s\": %s\n", key_file, strerror(errno));
+      exit(2);
+    }
+    key_len = fread(key, 1, sizeof(key), fp);
+    fclose(fp);
+    /* a trailing line end is not part of the key */
+    while (key_len > 0 && (key[key_len - 1] == '\n' || key[key_len - 1] == '\r'))
+      key_len--;
+  }
+
+  for (i = optind; i < argc; i++)
+    digestcheck_add_path(argv[i]);
+
+  for (i = 0; i < num_files; i++) {
+    digestcheck_read_digest(&files[i]);
+    if (files[i].valid)
+      blocks += files[i].num_blocks;
+  }
+
+  /* the blocks of all the files are hashed in parallel */
+  tasks = malloc((blocks > 0 ? blocks : 1) * sizeof(digest_task));
+  for (i = 0; i < num_files; i++) {
+    if (!files[i].valid)
+      continue;
+    for (j = 0; j < files[i].num_blocks; j++) {
+      tasks[num_tasks].file = &files[i];
+      tasks[num_tasks].block = &files[i].blocks[j];
+      num_tasks++;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  threads = malloc(jobs * sizeof(pthread_t));
+  for (i = 0; i < jobs; i++)
+    pthread_create(&threads[i], NULL, digestcheck_worker, NULL);
+  for (i = 0; i < jobs; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("kind\tfile\tblock\toffset\tlength\n");
+  for (i = 0; i < num_files; i++)
+    digestcheck_verify(&files[i], key_file != NULL ? key : NULL, key_len);
+
+  fprintf(stderr,
+          "files %d, blocks %" PRIu64 ", hashed %.1f MB in %.3f s with %d jobs (%.1f MB/s), problems %" PRIu64 "%s\n",
+          num_files, blocks, bytes_hashed / 1048576.0, seconds, jobs,
+          seconds > 0 ? bytes_hashed / 1048576.0 / seconds : 0.0, problems,
+          key_file == NULL ? ", signatures not checked" : "");
+
+  return problems > 0 ? 1 : 0;
+}
@@ -0,0 +1,364 @@
+/*-------------------------------------------------------------------------
+ *
+ * seqcheck.c
+ *      finds the gaps of the sequence numbers of pgauditlogtofile
+ *
+ * Reads audit files written with pgaudit.log_sequence in a single streaming
+ * pass and reports the numbers that are missing. Directories are expanded
+ * to their files, oldest first.
+ *
+ * The records of concurrent backends reach the file slightly out of order,
+ * so every number is checked against a window of the next SEQCHECK_WINDOW
+ * numbers after the lowest one not seen yet: a number is only reported
+ * missing when a number a whole window ahead has been read, or at the end.
+ * The first record read starts the sequence.
+ *
+ * Every gap is printed with the record where it was detected.
+ *
+ * Copyright (c) 2020-2023, Francisco Miguel Biete Banon
+ *
+ * This code is released under the PostgreSQL licence, as given at
+ *  http://www.postgresql.org/about/licence/
+ *-------------------------------------------------------------------------
+ */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Defines */
+#define SEQCHECK_WINDOW (1 << 20)
+#define SEQCHECK_TICK "TICK"
+/* Fields of a tick: the worker has no user nor database */
+#define SEQCHECK_FIELD_USER 1
+#define SEQCHECK_FIELD_DATABASE 2
+#define SEQCHECK_FIELD_AUDIT_TYPE 12
+
+typedef struct seqcheck_file {
+  char *path;
+  time_t mtime;
+} seqcheck_file;
+
+/* Files to read */
+static seqcheck_file *files = NULL;
+static int num_files = 0;
+static int max_files = 0;
+
+/* Window of numbers already read, bit (n % SEQCHECK_WINDOW) */
+static uint8_t window[SEQCHECK_WINDOW / 8];
+static bool started = false;
+static uint64_t low = 0;  /* lowest number not read yet */
+static uint64_t high = 0; /* highest number read */
+static uint64_t first = 0;
+static const char *last_path = NULL;
+static long last_line = 0;
+
+/* Current gap, reported when it ends */
+static bool in_gap = false;
+static uint64_t gap_first = 0;
+static const char *gap_path = NULL;
+static long gap_line = 0;
+
+/* Totals */
+static uint64_t records = 0;
+static uint64_t ticks = 0;
+static uint64_t unnumbered = 0;
+static uint64_t late = 0;
+static uint64_t gaps = 0;
+static uint64_t missing = 0;
+
+/* Internal functions */
+static void seqcheck_add_path(const char *path);
+static int seqcheck_cmp_mtime(const void *a, const void *b);
+static bool seqcheck_is_record_start(const char *line, size_t len);
+static bool seqcheck_is_tick(const char *line, size_t len);
+static bool seqcheck_trailing_number(const char *line, size_t len, uint64_t *seq);
+static void seqcheck_advance(uint64_t target, const char *path, long line);
+static void seqcheck_number(uint64_t seq, const char *path, long line);
+static void seqcheck_file_read(const char *path);
+
+
+static int seqcheck_cmp_mtime(const void *a, const void *b) {
+  const seqcheck_file *fa = (const seqcheck_file *) a;
+  const seqcheck_file *fb = (const seqcheck_file *) b;
+
+  if (fa->mtime != fb->mtime)
+    return fa->mtime < fb->mtime ? -1 : 1;
+  return strcmp(fa->path, fb->path);
+}
+
+/*
+ * Adds a file, or the files of a directory
+ */
+static void seqcheck_add_path(const char *path) {
+  struct stat st;
+  DIR *dir;
+  struct dirent *de;
+
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "could not stat \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    dir = opendir(path);
+    if (dir == NULL) {
+      fprintf(stderr, "could not open directory \"%s\": %s\n", path, strerror(errno));
+      exit(2);
+    }
+    while ((de = readdir(dir)) != NULL) {
+      char child[4096];
+
+      if (de->d_name[0] == '.')
+        continue;
+      snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+      if (stat(child, &st) == 0 && S_ISREG(st.st_mode))
+        seqcheck_add_path(child);
+    }
+    closedir(dir);
+    return;
+  }
+
+  if (num_files == max_files) {
+    max_files = max_files ? max_files * 2 : 64;
+    files = realloc(files, max_files * sizeof(seqcheck_file));
+  }
+  files[num_files].path = strdup(path);
+  files[num_files].mtime = st.st_mtime;
+  num_files++;
+}
+
+/*
+ * Checks if a line starts with the timestamp of an audit record
+ */
+static bool seqcheck_is_record_start(const char *line, size_t len) {
+  static const char shape[] = "dddd-dd-dd dd:";
+  size_t i;
+
+  if (len < sizeof(shape) - 1)
+    return false;
+
+  for (i = 0; i < sizeof(shape) - 1; i++) {
+    if (shape[i] == 'd' ? !isdigit((unsigned char) line[i]) : line[i] != shape[i])
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Checks if a record start line is a tick of the worker, by its fields so
+ * the text of an audited statement cannot pass for one. None of the fields
+ * up to the audit type is quoted.
+ */
+static bool seqcheck_is_tick(const char *line, size_t len) {
+  const char *end = line + len;
+  const char *start;
+  int field;
+
+  for (field = 0; field <= SEQCHECK_FIELD_AUDIT_TYPE; field++) {
+    start = line;
+    while (line < end && *line != ',' && *line != '\n')
+      line++;
+
+    if ((field == SEQCHECK_FIELD_USER || field == SEQCHECK_FIELD_DATABASE) && line != start)
+      return false;
+    if (field == SEQCHECK_FIELD_AUDIT_TYPE)
+      return line - start == strlen(SEQCHECK_TICK) && memcmp(start, SEQCHECK_TICK, line - start) == 0;
+
+    if (line == end || *line != ',')
+      return false;
+    line++;
+  }
+  return false;
+}
+
+/*
+ * Number after the last comma of a line
+ */
+static bool seqcheck_trailing_number(const char *line, size_t len, uint64_t *seq) {
+  size_t i = len;
+
+  if (i > 0 && line[i - 1] == '\n')
+    i--;
+  len = i;
+  while (i > 0 && isdigit((unsigned char) line[i - 1]))
+    i--;
+  if (i == len || i == 0 || line[i - 1] != ',')
+    return false;
+
+  *seq = 0;
+  for (; i < len; i++)
+    *seq = *seq * 10 + (line[i] - '0');
+  return true;
+}
+
+/*
+ * Moves the window until target is its lowest number, the numbers not read
+ * are missing
+ */
+static void seqcheck_advance(uint64_t target, const char *path, long line) {
+  uint64_t scan_end = target - low > SEQCHECK_WINDOW ? low + SEQCHECK_WINDOW : target;
+
+  for (; low < scan_end; low++) {
+    uint64_t bit = low % SEQCHECK_WINDOW;
+
+    if (window[bit / 8] & (1 << (bit % 8))) {
+      window[bit / 8] &= ~(1 << (bit % 8));
+      if (in_gap) {
+        printf("gap\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s:%ld\n",
+               gap_first, low - 1, low - gap_first, gap_path, gap_line);
+        in_gap = false;
+      }
+    } else {
+      if (!in_gap) {
+        in_gap = true;
+        gap_first = low;
+        gap_path = path;
+        gap_line = line;
+        gaps++;
+      }
+      missing++;
+    }
+  }
+
+  /* the rest of the bits are clear */
+  if (low < target) {
+    if (!in_gap) {
+      in_gap = true;
+      gap_first = low;
+      gap_path = path;
+      gap_line = line;
+      gaps++;
+    }
+    missing += target - low;
+    low = target;
+  }
+}
+
+/*
+ * Accounts a number read at line of path
+ */
+static void seqcheck_number(uint64_t seq, const char *path, long line) {
+  uint64_t bit;
+
+  if (!started) {
+    started = true;
+    low = first = high = seq;
+  }
+  last_path = path;
+  last_line = line;
+
+  if (seq < low) {
+    late++;
+    return;
+  }
+
+  if (seq >= low + SEQCHECK_WINDOW)
+    seqcheck_advance(seq - SEQCHECK_WINDOW + 1, path, line);
+
+  bit = seq % SEQCHECK_WINDOW;
+  if (window[bit / 8] & (1 << (bit % 8))) {
+    late++;
+    return;
+  }
+  window[bit / 8] |= 1 << (bit % 8);
+  if (seq > high)
+    high = seq;
+
+  /* the lowest number not read yet */
+  while (window[(low % SEQCHECK_WINDOW) / 8] & (1 << ((low % SEQCHECK_WINDOW) % 8))) {
+    if (in_gap) {
+      printf("gap\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s:%ld\n",
+             gap_first, low - 1, low - gap_first, gap_path, gap_line);
+      in_gap = false;
+    }
+    bit = low % SEQCHECK_WINDOW;
+    window[bit / 8] &= ~(1 << (bit % 8));
+    low++;
+  }
+}
+
+/*
+ * Reads the records of a file: a record starts with a line starting with a
+ * timestamp and its number is at the end of its last line
+ */
+static void seqcheck_file_read(const char *path) {
+  FILE *fp;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  long line_number = 0, record_line = 0;
+  bool in_record = false, is_tick = false, has_seq = false;
+  uint64_t seq = 0;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "could not open \"%s\": %s\n", path, strerror(errno));
+    exit(2);
+  }
+
+  while ((len = getline(&line, &size, fp)) != -1) {
+    line_number++;
+    if (seqcheck_is_record_start(line, len)) {
+      if (in_record) {
+        if (has_seq) {
+          seqcheck_number(seq, path, record_line);
+          ticks += is_tick;
+        } else
+          unnumbered++;
+        records++;
+      }
+      in_record = true;
+      record_line = line_number;
+      is_tick = seqcheck_is_tick(line, len);
+    }
+    has_seq = seqcheck_trailing_number(line, len, &seq);
+  }
+  if (in_record) {
+    if (has_seq) {
+      seqcheck_number(seq, path, record_line);
+      ticks += is_tick;
+    } else
+      unnumbered++;
+    records++;
+  }
+
+  free(line);
+  fclose(fp);
+}
+
+int main(int argc, char **argv) {
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s audit_file_or_directory...\n", argv[0]);
+    exit(2);
+  }
+
+  for (i = 1; i < argc; i++)
+    seqcheck_add_path(argv[i]);
+  qsort(files, num_files, sizeof(seqcheck_file), seqcheck_cmp_mtime);
+
+  printf("kind\tfirst\tlast\tcount\tlocation\n");
+  for (i = 0; i < num_files; i++)
+    seqcheck_file_read(files[i].path);
+
+  /* whatever is left below the highest number is missing */
+  if (started)
+    seqcheck_advance(high + 1, last_path, last_line);
+
+  fprintf(stderr,
+          "files %d, records %" PRIu64 ", ticks %" PRIu64 ", without number %" PRIu64 ", "
+          "first %" PRIu64 ", last %" PRIu64 ", gaps %" PRIu64 ", missing %" PRIu64 ", "
+          "late or duplicated %" PRIu64 "\n",
+          num_files, records, ticks, unnumbered, first, high, gaps, missing, late);
+
+  return gaps > 0 ? 1 : 0;
+}